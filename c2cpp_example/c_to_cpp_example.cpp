@@ -1,4 +1,14 @@
+#include <algorithm>
 #include <iostream>
+#include <new>
+#include <utility>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef A_TRACE
+#define A_TRACE (0) // 1 to have A say when it's created and destroyed, which costs more than all the rest
+#endif
 
 //////////////
 // C++ code //
@@ -8,33 +18,213 @@ struct A
   int i;
   int j;
 
-  A() {i=1; j=2; std::cout << "class A created\n";}
+  A() {i=1; j=2; if (A_TRACE) std::cout << "class A created\n";}
   void dump() {std::cout << "class A dumped: " << i << ":" << j << std::endl;}
-  ~A() {std::cout << "class A destroyed\n";}
+  ~A() {if (A_TRACE) std::cout << "class A destroyed\n";}
+};
+
+// T's in one array, handed out as 32 bit handles: the index of the slot and
+// the generation it was at.  A slot's generation goes up when its T is
+// destroyed, so the handles from before don't get at whatever is there next.
+// The free slots are a list through the slots themselves, most recently
+// freed first (it's the one that's still in the cache), so creating and
+// destroying is O(1) and only allocates when the pool has to grow
+#define POOL_INDEX_BITS  (20)                              // a million live at once
+#define POOL_INDEX_MASK  ((1u << POOL_INDEX_BITS) - 1)
+#define POOL_GENERATIONS (1u << (32 - POOL_INDEX_BITS))    // before a slot's handles come round again
+#define POOL_NO_SLOT     (UINT32_MAX)
+
+template <typename T>
+class handlePool
+{
+private:
+  struct slot
+  {
+    union
+    {
+      alignas (T) unsigned char ucObject[sizeof (T)];
+      uint32_t u32NextFree;
+    };
+    uint32_t u32Generation; // from 1, so no handle is 0
+    bool bLive;
+  };
+
+  std::vector<slot> mv_slot;
+  uint32_t mu32_FreeHead;
+  uint32_t mu32_Free;
+
+  T *object (slot &s) {return reinterpret_cast<T *>(s.ucObject);}
+
+  // the live T's move to the new array, the new slots go on the free list
+  bool grow (size_t ulWant)
+  {
+    size_t ulSize = std::max (mv_slot.size () * 2, ulWant);
+    size_t ulOld = mv_slot.size ();
+
+    if (ulWant > (size_t) POOL_INDEX_MASK + 1)
+    {
+      return false;
+    }
+    ulSize = std::min (ulSize, (size_t) POOL_INDEX_MASK + 1);
+
+    std::vector<slot> vNew (ulSize);
+    for (size_t ul = 0 ; ul < ulOld ; ul++)
+    {
+      vNew[ul].u32Generation = mv_slot[ul].u32Generation;
+      vNew[ul].bLive = mv_slot[ul].bLive;
+      if (mv_slot[ul].bLive)
+      {
+        new (vNew[ul].ucObject) T (std::move (*object (mv_slot[ul])));
+        object (mv_slot[ul])->~T ();
+      }
+      else
+      {
+        vNew[ul].u32NextFree = mv_slot[ul].u32NextFree;
+      }
+    }
+    for (size_t ul = ulSize ; ul-- > ulOld ; )
+    {
+      vNew[ul].u32Generation = 1;
+      vNew[ul].bLive = false;
+      vNew[ul].u32NextFree = mu32_FreeHead;
+      mu32_FreeHead = (uint32_t) ul;
+    }
+    mu32_Free += (uint32_t) (ulSize - ulOld);
+    mv_slot.swap (vNew);
+
+    return true;
+  }
+
+  uint32_t take (void)
+  {
+    uint32_t u32Index = mu32_FreeHead;
+    slot &s = mv_slot[u32Index];
+
+    mu32_FreeHead = s.u32NextFree;
+    mu32_Free--;
+    new (s.ucObject) T ();
+    s.bLive = true;
+
+    return (s.u32Generation << POOL_INDEX_BITS) | u32Index;
+  }
+
+public:
+  explicit handlePool (uint32_t u32Capacity = 1024) : mu32_FreeHead (POOL_NO_SLOT), mu32_Free (0)
+  {
+    grow (u32Capacity);
+  }
+
+  // 0 when the pool is full
+  uint32_t create (void)
+  {
+    if (mu32_Free == 0 && !grow (mv_slot.size () + 1))
+    {
+      return 0;
+    }
+    return take ();
+  }
+
+  // all of them or none, the pool grows at most once
+  bool create (uint32_t *pu32Handles, size_t ulCount)
+  {
+    if (mu32_Free < ulCount && !grow (mv_slot.size () - mu32_Free + ulCount))
+    {
+      return false;
+    }
+    for (size_t ul = 0 ; ul < ulCount ; ul++)
+    {
+      pu32Handles[ul] = take ();
+    }
+    return true;
+  }
+
+  // NULL for a handle that's gone (or never was)
+  T *get (uint32_t u32Handle)
+  {
+    uint32_t u32Index = u32Handle & POOL_INDEX_MASK;
+
+    if (u32Index >= mv_slot.size () || !mv_slot[u32Index].bLive ||
+        mv_slot[u32Index].u32Generation != u32Handle >> POOL_INDEX_BITS)
+    {
+      return NULL;
+    }
+    return object (mv_slot[u32Index]);
+  }
+
+  bool destroy (uint32_t u32Handle)
+  {
+    T *pObject = get (u32Handle);
+    uint32_t u32Index = u32Handle & POOL_INDEX_MASK;
+
+    if (pObject == NULL)
+    {
+      return false;
+    }
+    slot &s = mv_slot[u32Index];
+
+    pObject->~T ();
+    s.bLive = false;
+    s.u32Generation = s.u32Generation + 1 < POOL_GENERATIONS ? s.u32Generation + 1 : 1;
+    s.u32NextFree = mu32_FreeHead;
+    mu32_FreeHead = u32Index;
+    mu32_Free++;
+
+    return true;
+  }
+
+  size_t live (void) {return mv_slot.size () - mu32_Free;}
+
+  ~handlePool ()
+  {
+    for (size_t ul = 0 ; ul < mv_slot.size () ; ul++)
+    {
+      if (mv_slot[ul].bLive)
+      {
+        object (mv_slot[ul])->~T ();
+      }
+    }
+  }
 };
 
+static handlePool<A> gs_PoolA;
+
 extern "C" {
-  // this is the C code interface to the class A
-  static void *createA (void)
+  // this is the C code interface to the class A.  A handle is a number, 0
+  // is none, and one that's been deleted is as good as 0 - it can't get at
+  // the A that was made in its slot since
+  typedef uint32_t aHandle;
+
+  static aHandle createA (void)
   {
     // create a handle to the A class
-    return (void *)(new A);
+    return gs_PoolA.create ();
   }
-  static void dumpA (void *thisPtr)
+  static void dumpA (aHandle handle)
   {
     // call A->dump ()
-    if (thisPtr != NULL) // I'm an anal retentive programmer
+    A *classPtr = gs_PoolA.get (handle);
+
+    if (classPtr != NULL) // I'm an anal retentive programmer
     {
-      A *classPtr = static_cast<A *>(thisPtr);
       classPtr->dump ();
     }
   }
-  static void *deleteA (void *thisPtr)
+  static void deleteA (aHandle handle)
   {
     // destroy the A class
-    if (thisPtr != NULL)
+    gs_PoolA.destroy (handle);
+  }
+
+  // iCount of them at once, 0 if they weren't all created (then none were)
+  static int createA_n (aHandle *handles, int iCount)
+  {
+    return iCount >= 0 && gs_PoolA.create (handles, (size_t) iCount);
+  }
+  static void deleteA_n (const aHandle *handles, int iCount)
+  {
+    for (int i = 0 ; i < iCount ; i++)
     {
-      delete (static_cast<A *>(thisPtr));
+      gs_PoolA.destroy (handles[i]);
     }
   }
 }
@@ -44,10 +234,25 @@ extern "C" {
 ////////////////////////////////////
 int main (int argc, char **argv)
 {
-  void *handle = createA();
+  aHandle handle = createA();
+  aHandle handles[4];
+  int i;
 
   dumpA (handle);
   deleteA (handle);
-  
+  dumpA (handle); // gone, so nothing
+
+  if (createA_n (handles, 4))
+  {
+    for (i = 0 ; i < 4 ; i++)
+    {
+      // the first one gets the slot back, with a new generation
+      printf ("handle %08x: ", handles[i]);
+      fflush (stdout);
+      dumpA (handles[i]);
+    }
+    deleteA_n (handles, 4);
+  }
+
   return 0;
 }
@@ -1,211 +1,1728 @@
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sched.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
 
 #include <stdio.h>
 
 #include <iostream>
+#include <algorithm>
 
 #include "epoll_example.h"
 
+#if EPOLLER_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if EPOLLER_IO_URING
+////////////////////////////////////////////////////////////////////////////////
+// The io_uring backend, built with -DEPOLLER_IO_URING=1.  It goes straight to
+// the system calls, so there's no liburing to link, and it needs 5.11 for
+// the wait timeout; epoller falls back to epoll if the ring can't be set up.
+//
+// add() is a multishot poll, edge triggered like EPOLLET.  There's no
+// system call for it: it goes in with the next wait, along with everything
+// else queued since, so a loop taking connections does one io_uring_enter
+// a turn.  addRecv() is a multishot recv into a ring of buffers the kernel
+// was given at the start (6.0 for the multishot recv, 5.19 for the buffer
+// ring, it's a poll on older ones).  The data has already been read when
+// the EPOLLIN is handed out, and drain() passes those buffers on as they
+// are until release() gives them back to the kernel.  A recv that runs out
+// of buffers stops, and starts again with the next release().
+////////////////////////////////////////////////////////////////////////////////
+
+#define URING_ENTRIES (256)   // submission queue, the completion queue is twice that
+#define URING_BUFFERS (256)   // EPOLLER_BUFFER_SIZE buffers for the recvs (a power of 2)
+
+// what a completion's for goes in the top byte of its user_data, then the
+// fd's generation and the fd itself
+#define URING_POLL    (1ULL)
+#define URING_RECV    (2ULL)
+#define URING_IGNORE  (3ULL)
+
+struct uringState
+{
+  int iFd;
+  unsigned int *puiSqHead;
+  unsigned int *puiSqTail;
+  unsigned int *puiSqArray;
+  unsigned int uiSqMask;
+  unsigned int *puiCqHead;
+  unsigned int *puiCqTail;
+  unsigned int uiCqMask;
+  io_uring_sqe *sqes;
+  io_uring_cqe *cqes;
+  void *vSqRing;
+  size_t ulSqRingSize;
+  void *vCqRing;
+  size_t ulCqRingSize;
+  size_t ulSqesSize;
+  unsigned int uiToSubmit;
+  io_uring_buf_ring *bufRing;  // NULL if the kernel has no buffer rings
+  char *szBuffers;
+  unsigned short usBufTail;
+  int iBuffers;                // how many the kernel has to fill
+  std::vector<io_uring_sqe> vHeld;  // no room in the submission queue for these yet
+};
+
+static uint64_t uringData (uint64_t u64Op, unsigned int uiGeneration, int iFd)
+{
+  return (u64Op << 56) | ((uint64_t) (uiGeneration & 0xffffff) << 32) | (uint32_t) iFd;
+}
+
+static void *uringMap (size_t ulSize, int iFd, off_t offset)
+{
+  void *vMap;
+
+  vMap = mmap (NULL, ulSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, iFd, offset);
+  if (vMap == MAP_FAILED)
+  {
+    perror ("mmap");
+    exit (1);
+  }
+
+  return vMap;
+}
+
+// the buffer goes back on the ring for the kernel to fill
+static void uringPutBuffer (uringState *ring, unsigned short usBid)
+{
+  io_uring_buf *buf;
+
+  // not ring->bufRing->bufs: in C++ the empty struct the header puts in
+  // front of the flexible array takes up room, and moves it off the start
+  buf = reinterpret_cast<io_uring_buf *>(ring->bufRing) + (ring->usBufTail & (URING_BUFFERS-1));
+  buf->addr = (uint64_t) (uintptr_t) (ring->szBuffers + (size_t) usBid * EPOLLER_BUFFER_SIZE);
+  buf->len = EPOLLER_BUFFER_SIZE;
+  buf->bid = usBid;
+  ring->usBufTail++;
+  __atomic_store_n (&ring->bufRing->tail, ring->usBufTail, __ATOMIC_RELEASE);
+  ring->iBuffers++;
+}
+
+static bool uringRecycle (uringState *ring, void *vBuffer)
+{
+  char *szBuffer = static_cast<char *>(vBuffer);
+
+  if (ring->bufRing == NULL || szBuffer < ring->szBuffers ||
+      szBuffer >= ring->szBuffers + (size_t) URING_BUFFERS * EPOLLER_BUFFER_SIZE)
+  {
+    return false;
+  }
+  uringPutBuffer (ring, (unsigned short) ((szBuffer - ring->szBuffers) / EPOLLER_BUFFER_SIZE));
+
+  return true;
+}
+
+static uringState *uringSetup (void)
+{
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  uringState *ring;
+  unsigned char *pucSq;
+  unsigned char *pucCq;
+  int iFd;
+
+  memset (&params, 0, sizeof (params));
+  iFd = (int) syscall (__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (iFd == -1)
+  {
+    return NULL;
+  }
+  if ((params.features & IORING_FEAT_EXT_ARG) == 0)
+  {
+    ::close (iFd);
+    return NULL;
+  }
+
+  ring = new uringState ();
+  ring->iFd = iFd;
+  ring->ulSqRingSize = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+  ring->ulCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof (io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+  {
+    ring->ulSqRingSize = ring->ulCqRingSize = std::max (ring->ulSqRingSize, ring->ulCqRingSize);
+  }
+  ring->vSqRing = uringMap (ring->ulSqRingSize, iFd, IORING_OFF_SQ_RING);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+  {
+    ring->vCqRing = ring->vSqRing;
+  }
+  else
+  {
+    ring->vCqRing = uringMap (ring->ulCqRingSize, iFd, IORING_OFF_CQ_RING);
+  }
+  ring->ulSqesSize = params.sq_entries * sizeof (io_uring_sqe);
+  ring->sqes = static_cast<io_uring_sqe *>(uringMap (ring->ulSqesSize, iFd, IORING_OFF_SQES));
+
+  pucSq = static_cast<unsigned char *>(ring->vSqRing);
+  ring->puiSqHead = (unsigned int *) (pucSq + params.sq_off.head);
+  ring->puiSqTail = (unsigned int *) (pucSq + params.sq_off.tail);
+  ring->puiSqArray = (unsigned int *) (pucSq + params.sq_off.array);
+  ring->uiSqMask = *(unsigned int *) (pucSq + params.sq_off.ring_mask);
+  pucCq = static_cast<unsigned char *>(ring->vCqRing);
+  ring->puiCqHead = (unsigned int *) (pucCq + params.cq_off.head);
+  ring->puiCqTail = (unsigned int *) (pucCq + params.cq_off.tail);
+  ring->uiCqMask = *(unsigned int *) (pucCq + params.cq_off.ring_mask);
+  ring->cqes = (io_uring_cqe *) (pucCq + params.cq_off.cqes);
+
+  // the recvs' buffers, without them addRecv is add
+  ring->bufRing = static_cast<io_uring_buf_ring *>(mmap (NULL, URING_BUFFERS * sizeof (io_uring_buf),
+                                                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ring->szBuffers = static_cast<char *>(malloc ((size_t) URING_BUFFERS * EPOLLER_BUFFER_SIZE));
+  if (ring->bufRing == MAP_FAILED || ring->szBuffers == NULL)
+  {
+    perror ("buffer ring");
+    exit (1);
+  }
+  memset (&reg, 0, sizeof (reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) ring->bufRing;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = 0;
+  if (syscall (__NR_io_uring_register, iFd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+  {
+    munmap (ring->bufRing, URING_BUFFERS * sizeof (io_uring_buf));
+    free (ring->szBuffers);
+    ring->bufRing = NULL;
+    ring->szBuffers = NULL;
+  }
+  else
+  {
+    for (int i = 0 ; i < URING_BUFFERS ; i++)
+    {
+      uringPutBuffer (ring, (unsigned short) i);
+    }
+  }
+
+  return ring;
+}
+
+static void uringTeardown (uringState *ring)
+{
+  if (::close (ring->iFd) == -1)
+  {
+    perror ("close");
+    exit (1);
+  }
+  munmap (ring->sqes, ring->ulSqesSize);
+  if (ring->vCqRing != ring->vSqRing)
+  {
+    munmap (ring->vCqRing, ring->ulCqRingSize);
+  }
+  munmap (ring->vSqRing, ring->ulSqRingSize);
+  if (ring->bufRing != NULL)
+  {
+    munmap (ring->bufRing, URING_BUFFERS * sizeof (io_uring_buf));
+    free (ring->szBuffers);
+  }
+  delete ring;
+}
+
+static bool uringSqFull (uringState *ring)
+{
+  return *ring->puiSqTail - __atomic_load_n (ring->puiSqHead, __ATOMIC_ACQUIRE) > ring->uiSqMask;
+}
+
+// the next slot at the tail, cleared.  The kernel only looks at the queue in
+// io_uring_enter (there's no SQPOLL), so it's fine to move the tail before
+// the entry's filled in
+static io_uring_sqe *uringTail (uringState *ring)
+{
+  unsigned int uiTail = *ring->puiSqTail;
+  io_uring_sqe *sqe;
+
+  sqe = &ring->sqes[uiTail & ring->uiSqMask];
+  memset (sqe, 0, sizeof (*sqe));
+  ring->puiSqArray[uiTail & ring->uiSqMask] = uiTail & ring->uiSqMask;
+  __atomic_store_n (ring->puiSqTail, uiTail + 1, __ATOMIC_RELEASE);
+  ring->uiToSubmit++;
+
+  return sqe;
+}
+
+// what was held back goes in, in order, as far as there's room
+static void uringFlush (uringState *ring)
+{
+  size_t i;
+
+  for (i = 0 ; i < ring->vHeld.size () && !uringSqFull (ring) ; i++)
+  {
+    *uringTail (ring) = ring->vHeld[i];
+  }
+  ring->vHeld.erase (ring->vHeld.begin (), ring->vHeld.begin () + i);
+}
+
+// hand in what's queued, and with uiMinComplete wait for that many
+// completions or iTimeout ms.  -1 with errno, ETIME for the timeout
+static int uringEnter (uringState *ring, unsigned int uiMinComplete, int iTimeout)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned int uiFlags = 0;
+  int iRet;
+
+  uringFlush (ring);
+  memset (&arg, 0, sizeof (arg));
+  if (uiMinComplete > 0)
+  {
+    uiFlags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (iTimeout >= 0)
+    {
+      ts.tv_sec = iTimeout / 1000;
+      ts.tv_nsec = (long long) (iTimeout % 1000) * 1000000;
+      arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+  }
+
+  iRet = (int) syscall (__NR_io_uring_enter, ring->iFd, ring->uiToSubmit, uiMinComplete, uiFlags,
+                        uiFlags != 0 ? &arg : NULL, uiFlags != 0 ? sizeof (arg) : 0);
+  if (iRet > 0)
+  {
+    ring->uiToSubmit -= std::min ((unsigned int) iRet, ring->uiToSubmit);
+  }
+
+  return iRet;
+}
+
+// the next submission entry to fill in, cleared.  If the queue's full and
+// the kernel won't take any of it (EBUSY while its completion queue is
+// overflowing, which only reaping fixes) the entry's held back instead, and
+// goes in with the next io_uring_enter that finds room
+static io_uring_sqe *uringSqe (uringState *ring)
+{
+  if (uringSqFull (ring))
+  {
+    if (uringEnter (ring, 0, 0) == -1 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+    {
+      perror ("io_uring_enter");
+      exit (1);
+    }
+  }
+
+  if (!ring->vHeld.empty () || uringSqFull (ring))
+  {
+    ring->vHeld.push_back (io_uring_sqe ());
+    return &ring->vHeld.back ();
+  }
+
+  return uringTail (ring);
+}
+
+// (re)start what watches iFd
+void epoller::uringArm (int iFd, fdEntry *entry)
+{
+  io_uring_sqe *sqe;
+
+  if (entry->bRecv && mp_uring->bufRing == NULL)
+  {
+    entry->bRecv = false;
+  }
+
+  sqe = uringSqe (mp_uring);
+  sqe->fd = iFd;
+  if (entry->bRecv)
+  {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uringData (URING_RECV, entry->uiGeneration, iFd);
+  }
+  else
+  {
+    // a multishot poll is edge triggered unless it asks not to be
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = entry->u32Events & ~EPOLLET;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uringData (URING_POLL, entry->uiGeneration, iFd);
+  }
+}
+
+// stop watching iFd, right away: the ring holds on to the file until the
+// cancel has gone in, and a socket isn't closed before that
+void epoller::uringForget (int iFd, fdEntry *entry)
+{
+  io_uring_sqe *sqe;
+
+  sqe = uringSqe (mp_uring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = uringData (entry->bRecv ? URING_RECV : URING_POLL, entry->uiGeneration, iFd);
+  sqe->user_data = uringData (URING_IGNORE, 0, 0);
+  if (uringEnter (mp_uring, 0, 0) == -1 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+  {
+    perror ("io_uring_enter");
+    exit (1);
+  }
+
+  for (size_t i = 0 ; i < entry->vReceived.size () ; i++)
+  {
+    uringRecycle (mp_uring, entry->vReceived[i].iov_base);
+  }
+  entry->vReceived.clear ();
+  entry->bStalled = false;
+}
+
+// a completion as an epoll event, false if there's nothing to hand out
+bool epoller::uringComplete (const io_uring_cqe *cqe, epoll_event *event)
+{
+  uint64_t u64Op = cqe->user_data >> 56;
+  unsigned int uiGeneration = (unsigned int) (cqe->user_data >> 32) & 0xffffff;
+  int iFd = (int) (uint32_t) cqe->user_data;
+  bool bMore = (cqe->flags & IORING_CQE_F_MORE) != 0;
+  bool bWasEmpty;
+  fdEntry *entry;
+
+  if (u64Op == URING_IGNORE)
+  {
+    return false;
+  }
+
+  entry = find (iFd);
+  if (entry == NULL || (entry->uiGeneration & 0xffffff) != uiGeneration)
+  {
+    // for an fd that's gone, but a buffer is still ours
+    if ((cqe->flags & IORING_CQE_F_BUFFER) != 0)
+    {
+      mp_uring->iBuffers--;
+      uringPutBuffer (mp_uring, (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+    }
+    return false;
+  }
+  event->data = entry->data;
+
+  if (u64Op == URING_POLL)
+  {
+    if (cqe->res < 0)
+    {
+      event->events = EPOLLERR;
+      return true;
+    }
+    event->events = (uint32_t) cqe->res;
+    if (!bMore)
+    {
+      // the kernel gave up on it (its completion queue overflowed, say)
+      uringArm (iFd, entry);
+    }
+    return true;
+  }
+
+  // like EPOLLET, there's an EPOLLIN when there's data and there wasn't
+  bWasEmpty = entry->vReceived.empty ();
+  if ((cqe->flags & IORING_CQE_F_BUFFER) != 0)
+  {
+    unsigned short usBid = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    struct iovec iov;
+
+    mp_uring->iBuffers--;
+    if (cqe->res > 0)
+    {
+      iov.iov_base = mp_uring->szBuffers + (size_t) usBid * EPOLLER_BUFFER_SIZE;
+      iov.iov_len = cqe->res;
+      entry->vReceived.push_back (iov);
+    }
+    else
+    {
+      uringPutBuffer (mp_uring, usBid);
+    }
+  }
+
+  event->events = EPOLLIN;
+  if (cqe->res == 0)
+  {
+    entry->bEof = true;
+    event->events |= EPOLLRDHUP;
+  }
+  else if (cqe->res == -ENOBUFS)
+  {
+    // what it has read is drained, and it starts again once there are
+    // buffers - which there may be already, if they came back before this
+    if (mp_uring->iBuffers > 0)
+    {
+      uringArm (iFd, entry);
+    }
+    else if (!entry->bStalled)
+    {
+      entry->bStalled = true;
+      mv_stalled.push_back (iFd);
+    }
+    return false;
+  }
+  else if ((cqe->res == -EINVAL || cqe->res == -ENOTSOCK) && entry->vReceived.empty ())
+  {
+    // no multishot recv in this kernel, or not a socket: it's a poll then
+    entry->bRecv = false;
+    uringArm (iFd, entry);
+    return false;
+  }
+  else if (cqe->res < 0)
+  {
+    entry->iError = -cqe->res;
+    event->events |= EPOLLERR;
+  }
+  else
+  {
+    if (!bMore)
+    {
+      uringArm (iFd, entry);
+    }
+    return bWasEmpty;
+  }
+
+  return true;
+}
+
+int epoller::uringReap (epoll_event *pEvents, int iMaxEvents)
+{
+  unsigned int uiHead = *mp_uring->puiCqHead;
+  unsigned int uiTail = __atomic_load_n (mp_uring->puiCqTail, __ATOMIC_ACQUIRE);
+  int iCount = 0;
+
+  while (uiHead != uiTail && iCount < iMaxEvents)
+  {
+    if (uringComplete (&mp_uring->cqes[uiHead & mp_uring->uiCqMask], &pEvents[iCount]))
+    {
+      iCount++;
+    }
+    uiHead++;
+  }
+  __atomic_store_n (mp_uring->puiCqHead, uiHead, __ATOMIC_RELEASE);
+
+  return iCount;
+}
+
+// epoll_wait for the ring.  What's been queued since the last call goes in
+// with the wait, or on its own if there's something to hand out already
+int epoller::uringCollect (epoll_event *pEvents, int iMaxEvents, int iTimeout)
+{
+  int iCount;
+
+  iCount = uringReap (pEvents, iMaxEvents);
+  if (iCount > 0 || iTimeout == 0)
+  {
+    if ((mp_uring->uiToSubmit > 0 || !mp_uring->vHeld.empty ()) && uringEnter (mp_uring, 0, 0) == -1 &&
+        errno != EINTR && errno != EBUSY && errno != EAGAIN)
+    {
+      perror ("io_uring_enter");
+      exit (1);
+    }
+    return iCount > 0 ? iCount : uringReap (pEvents, iMaxEvents);
+  }
+
+  for ( ; ; )
+  {
+    if (uringEnter (mp_uring, 1, iTimeout) == -1)
+    {
+      if (errno == EINTR)
+      {
+        return -1;
+      }
+      if (errno != ETIME && errno != EBUSY && errno != EAGAIN)
+      {
+        perror ("io_uring_enter");
+        exit (1);
+      }
+    }
+    iCount = uringReap (pEvents, iMaxEvents);
+    if (iCount > 0 || iTimeout >= 0)
+    {
+      return iCount;
+    }
+    // only completions there's nothing to say about, and no timeout
+  }
+}
+
+// the buffers the ring filled, whole, until they come to more than ulMax
+ssize_t epoller::uringDrain (int iFd, fdEntry *entry, std::vector<iovec> &vViews, size_t ulMax, bool *pbEof)
+{
+  size_t ulTotal = 0;
+  size_t i;
+
+  for (i = 0 ; i < entry->vReceived.size () ; i++)
+  {
+    if (ulTotal > 0 && ulTotal + entry->vReceived[i].iov_len > ulMax)
+    {
+      break;
+    }
+    ulTotal += entry->vReceived[i].iov_len;
+    vViews.push_back (entry->vReceived[i]);
+  }
+  entry->vReceived.erase (entry->vReceived.begin (), entry->vReceived.begin () + i);
+
+  if (!entry->vReceived.empty ())
+  {
+    toBacklog (entry, iFd);
+  }
+  else if (ulTotal == 0)
+  {
+    if (entry->iError != 0)
+    {
+      errno = entry->iError;
+      entry->iError = 0;
+      return -1;
+    }
+    if (entry->bEof && pbEof != NULL)
+    {
+      *pbEof = true;
+    }
+  }
+
+  return ulTotal;
+}
+#else
+static bool uringRecycle (uringState *, void *) {return false;}
+static void uringTeardown (uringState *) {}
+#endif
+
 bool epoller::removeOrClose (int iFd, bool bClose)
 {
-  bool bFound = false;
-  std::set<int>::iterator iter;
+  fdEntry *entry;
+
+  entry = find (iFd);
+  if (entry == NULL)
+  {
+    return false;
+  }
+
+#if EPOLLER_IO_URING
+  if (mp_uring != NULL)
+  {
+    uringForget (iFd, entry);
+  }
+  else
+#endif
+  {
+    // remove it from monitoring, explicitly (the event is ignored, but
+    // kernels before 2.6.9 want one)
+    epoll_ctl (mi_PollFd, EPOLL_CTL_DEL, iFd, &mv_event[0]);
+  }
+
+  if (bClose == true)
+  {
+    // give it back the way it was, then close - but not if it's stdin
+    makeFileDescriptorBlocking (iFd);
+    if (iFd != STDIN_FILENO && ::close (iFd) == -1)
+    {
+      perror ("close");
+      exit (1);
+    }
+  }
+
+  // the slot stays, for the next fd with this number
+  entry->bRegistered = false;
+  mi_Registered--;
+
+  return true;
+}
+
+epoller::epoller (int iMaxEvents, bool bUring)
+{
+  mp_uring = NULL;
+  mi_PollFd = -1;
+#if EPOLLER_IO_URING
+  if (bUring)
+  {
+    mp_uring = uringSetup ();
+  }
+#else
+  (void)bUring;
+#endif
+  if (mp_uring == NULL)
+  {
+    mi_PollFd = epoll_create1 (0);
+    if (mi_PollFd == -1)
+    {
+      perror ("epoll_create1");
+      exit (1);
+    }
+  }
+  mi_Ready = 0;
+  mi_Registered = 0;
+
+  // the kernel hands back the rest of the ready fds on the next epoll_wait,
+  // so this only has to be as big as a useful batch
+  mv_event.resize (iMaxEvents > 0 ? iMaxEvents : 1);
+}
+
+void epoller::makeFileDescriptorNonBlocking (int iFd)
+{
+  int iFlags;
+  int iNewFd;
+
+  iFlags = fcntl (iFd, F_GETFL, 0);
+  if (iFlags == -1)
+  {
+    perror ("fcntl");
+    exit (1);
+  }
+
+  iFlags |= O_NONBLOCK;
+  iNewFd = fcntl (iFd, F_SETFL, iFlags);
+  if (iNewFd == -1)
+  {
+    perror ("fcntl");
+    exit (1);
+  }
+}
+
+void epoller::makeFileDescriptorBlocking (int iFd)
+{
+  int iFlags;
+  int iNewFd;
+
+  iFlags = fcntl (iFd, F_GETFL, 0);
+  if (iFlags == -1)
+  {
+    perror ("fcntl");
+    exit (1);
+  }
+
+  iFlags &= ~O_NONBLOCK;
+  iNewFd = fcntl (iFd, F_SETFL, iFlags);
+  if (iNewFd == -1)
+  {
+    perror ("fcntl");
+    exit (1);
+  }
+}
+
+bool epoller::addEntry (int iFd, const epoll_data &epData, uint32_t u32Events, bool bRecv)
+{
+  struct epoll_event event;
+  fdEntry *entry;
+  int iRet;
+
+  if (find (iFd) != NULL)
+  {
+    std::cout << "Duplicate\n";
+    return false;
+  }
+
+  makeFileDescriptorNonBlocking (iFd);
+
+  // fds are small and reused, so the table is indexed by them.  It at least
+  // doubles when it has to grow, a connect or a disconnect after that
+  // doesn't allocate
+  if ((size_t) iFd >= mv_fd.size ())
+  {
+    fdEntry empty = {};
+
+    mv_fd.resize (std::max ((size_t) iFd + 1, mv_fd.size () * 2), empty);
+  }
+  entry = &mv_fd[iFd];
+  entry->bRegistered = true;
+  entry->bBacklogged = false;
+  entry->u32Events = u32Events;
+  entry->data = epData;
+  entry->fnRead = NULL;
+  entry->fnWrite = NULL;
+  entry->fnError = NULL;
+  entry->vUser = NULL;
+  mi_Registered++;
+
+#if EPOLLER_IO_URING
+  if (mp_uring != NULL)
+  {
+    entry->bRecv = bRecv;
+    entry->bStalled = false;
+    entry->bEof = false;
+    entry->iError = 0;
+    entry->uiGeneration++;
+    uringArm (iFd, entry);
+    return true;
+  }
+#else
+  (void)bRecv;
+#endif
+
+  event.data = epData;
+  event.events = u32Events;
+  iRet = epoll_ctl (mi_PollFd, EPOLL_CTL_ADD, iFd, &event);
+
+  if (iRet == -1)
+  {
+    perror ("epoll_ctl");
+    exit (1);
+  }
+
+  return true;
+}
+
+bool epoller::addRecv (int iFd, const epoll_data &epData)
+{
+  return addEntry (iFd, epData, EPOLLIN | EPOLLRDHUP | EPOLLET, true);
+}
+
+// the kernel's data is the fd, so dispatch() can look its handlers up
+bool epoller::add (int iFd, fdHandler fnRead, fdHandler fnWrite, fdHandler fnError, void *vUser)
+{
+  epoll_data epd;
+  uint32_t u32Events = EPOLLET;
+  fdEntry *entry;
+
+  if (fnRead != NULL)
+  {
+    u32Events |= EPOLLIN | EPOLLRDHUP;
+  }
+  if (fnWrite != NULL)
+  {
+    u32Events |= EPOLLOUT;
+  }
+  epd.fd = iFd;
+  if (!add (iFd, epd, u32Events))
+  {
+    return false;
+  }
+
+  entry = &mv_fd[iFd];
+  entry->fnRead = fnRead;
+  entry->fnWrite = fnWrite;
+  entry->fnError = fnError;
+  entry->vUser = vUser;
+
+  return true;
+}
+
+uint64_t epoller::now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void epoller::addTimer (epollTimer *timer, int iMs, timerHandler fnExpired, void *vUser)
+{
+  timer->fnExpired = fnExpired;
+  timer->vUser = vUser;
+  mo_timers.add (timer, now () + (iMs > 0 ? iMs : 0));
+}
+
+epoll_event epoller::wait (int iTimeout)
+{
+  int iRet;
+  epoll_event epEvent;
+
+  epEvent.events = 0;
+  epEvent.data.ptr = NULL;
+
+  if (mi_Ready == 0)
+  {
+    // if no file descriptor to process
+    iRet = fill (iTimeout);
+
+    if (iRet == -1 && errno == EINTR)
+    {
+      std::cout << "Signal trapped\n";
+    }
+    else if (iRet > 0)
+    {
+      mi_Ready = iRet;
+    }
+    else
+    {
+      // timeout
+      epEvent.events = 0;
+    }
+  }
+
+  if (mi_Ready > 0)
+  {
+    // with already have file descriptors to process
+    mi_Ready--;
+    epEvent = mv_event[mi_Ready];
+  }
+
+  return epEvent;
+}
+
+// hand back up to iMaxEvents ready events in one go (what wait() hasn't
+// handed out yet first), so there's one call for a lot of ready fds rather
+// than one per fd.  Returns the number of events, 0 on a timeout and -1 if
+// a signal interrupted the wait
+int epoller::wait_batch (epoll_event *pEvents, int iMaxEvents, int iTimeout)
+{
+  int iRet;
+  int iCount = 0;
+
+  while (mi_Ready > 0 && iCount < iMaxEvents)
+  {
+    mi_Ready--;
+    pEvents[iCount++] = mv_event[mi_Ready];
+  }
+  if (iCount > 0 || iMaxEvents <= 0)
+  {
+    return iCount;
+  }
+
+  iCount = takeBacklog (pEvents, iMaxEvents);
+  if (iCount == iMaxEvents)
+  {
+    return iCount;
+  }
+  iRet = collect (pEvents + iCount, iMaxEvents - iCount, iCount > 0 ? 0 : iTimeout);
+  if (iRet == -1)
+  {
+    if (errno != EINTR)
+    {
+      perror ("epoll_wait");
+      exit (1);
+    }
+    return iCount > 0 ? iCount : -1;
+  }
+
+  return iCount + iRet;
+}
+
+// what drain() left behind, as an EPOLLIN with the fd's own data.  This is
+// taken before what the kernel has: a capped fd gets no new edge for what's
+// already queued, so if it waited for spare slots a busy poller would starve
+// it for good
+int epoller::takeBacklog (epoll_event *pEvents, int iMaxEvents)
+{
+  fdEntry *entry;
+  size_t i;
+  int iCount = 0;
+
+  for (i = 0 ; i < mv_backlog.size () && iCount < iMaxEvents ; i++)
+  {
+    entry = find (mv_backlog[i]);
+    if (entry == NULL || !entry->bBacklogged)
+    {
+      // removed since
+      continue;
+    }
+    entry->bBacklogged = false;
+    pEvents[iCount].events = EPOLLIN;
+    pEvents[iCount].data = entry->data;
+    iCount++;
+  }
+  mv_backlog.erase (mv_backlog.begin (), mv_backlog.begin () + i);
+
+  return iCount;
+}
+
+// what the kernel has ready, epoll_wait style whichever the backend
+int epoller::collect (epoll_event *pEvents, int iMaxEvents, int iTimeout)
+{
+#if EPOLLER_IO_URING
+  if (mp_uring != NULL)
+  {
+    return uringCollect (pEvents, iMaxEvents, iTimeout);
+  }
+#endif
+  return epoll_wait (mi_PollFd, pEvents, iMaxEvents, iTimeout);
+}
+
+// mv_event from the backlog and the kernel, with no waiting if there's a
+// backlog.  -1 with errno from epoll_wait
+int epoller::fill (int iTimeout)
+{
+  int iRet;
+  int iCount;
+
+  iCount = takeBacklog (&(mv_event[0]), (int) mv_event.size ());
+  if (iCount == (int) mv_event.size ())
+  {
+    return iCount;
+  }
+  iRet = collect (&(mv_event[iCount]), (int) mv_event.size () - iCount, iCount > 0 ? 0 : iTimeout);
+  if (iRet == -1)
+  {
+    return iCount > 0 ? iCount : -1;
+  }
+
+  return iCount + iRet;
+}
+
+char *epoller::getBuffer (void)
+{
+  char *szBuffer;
+
+  if (mv_buffers.empty ())
+  {
+    szBuffer = static_cast<char *>(malloc (EPOLLER_BUFFER_SIZE));
+    if (szBuffer == NULL)
+    {
+      perror ("malloc");
+      exit (1);
+    }
+    return szBuffer;
+  }
+  szBuffer = mv_buffers.back ();
+  mv_buffers.pop_back ();
+
+  return szBuffer;
+}
+
+// up to EPOLLER_DRAIN_IOV buffers a readv.  A short read means the fd is
+// empty for now: more data coming in after it is a new edge, so there's no
+// need for one more read to see EAGAIN
+ssize_t epoller::drain (int iFd, std::vector<iovec> &vViews, size_t ulMax, bool *pbEof)
+{
+  struct iovec iov[EPOLLER_DRAIN_IOV];
+  size_t ulTotal = 0;
+  size_t ulWant;
+  size_t ulGot;
+  ssize_t lRet;
+  int iBuffers;
+
+  if (pbEof != NULL)
+  {
+    *pbEof = false;
+  }
+
+#if EPOLLER_IO_URING
+  fdEntry *entry = find (iFd);
+
+  if (entry != NULL && entry->bRecv)
+  {
+    return uringDrain (iFd, entry, vViews, ulMax, pbEof);
+  }
+#endif
+
+  while (ulTotal < ulMax)
+  {
+    ulWant = std::min (ulMax - ulTotal, (size_t) EPOLLER_DRAIN_IOV * EPOLLER_BUFFER_SIZE);
+    for (iBuffers = 0 ; ulWant > 0 ; iBuffers++)
+    {
+      iov[iBuffers].iov_base = getBuffer ();
+      iov[iBuffers].iov_len = std::min (ulWant, (size_t) EPOLLER_BUFFER_SIZE);
+      ulWant -= iov[iBuffers].iov_len;
+    }
+
+    do
+    {
+      lRet = readv (iFd, iov, iBuffers);
+    } while (lRet == -1 && errno == EINTR);
+
+    // the filled buffers are the caller's, the others go back
+    ulGot = lRet > 0 ? (size_t) lRet : 0;
+    ulWant = 0;
+    for (int i = 0 ; i < iBuffers ; i++)
+    {
+      ulWant += iov[i].iov_len;
+      if (ulGot > 0)
+      {
+        iov[i].iov_len = std::min (ulGot, iov[i].iov_len);
+        ulGot -= iov[i].iov_len;
+        vViews.push_back (iov[i]);
+      }
+      else
+      {
+        mv_buffers.push_back (static_cast<char *>(iov[i].iov_base));
+      }
+    }
+
+    if (lRet == 0)
+    {
+      if (pbEof != NULL)
+      {
+        *pbEof = true;
+      }
+      return ulTotal;
+    }
+    if (lRet == -1)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return ulTotal;
+      }
+      // what was read is handed out, the error comes back on the next read
+      return ulTotal > 0 ? (ssize_t) ulTotal : -1;
+    }
+
+    ulTotal += lRet;
+    if ((size_t) lRet < ulWant)
+    {
+      return ulTotal;
+    }
+  }
+
+  toBacklog (find (iFd), iFd);
+
+  return ulTotal;
+}
+
+void epoller::toBacklog (fdEntry *entry, int iFd)
+{
+  if (entry != NULL && !entry->bBacklogged)
+  {
+    entry->bBacklogged = true;
+    mv_backlog.push_back (iFd);
+  }
+}
+
+void epoller::release (std::vector<iovec> &vViews)
+{
+  for (size_t i = 0 ; i < vViews.size () ; i++)
+  {
+    if (mp_uring == NULL || !uringRecycle (mp_uring, vViews[i].iov_base))
+    {
+      mv_buffers.push_back (static_cast<char *>(vViews[i].iov_base));
+    }
+  }
+  vViews.clear ();
+
+#if EPOLLER_IO_URING
+  // there are buffers again for the recvs that ran out
+  for (size_t i = 0 ; i < mv_stalled.size () ; i++)
+  {
+    fdEntry *entry = find (mv_stalled[i]);
+
+    if (entry != NULL && entry->bStalled)
+    {
+      entry->bStalled = false;
+      uringArm (mv_stalled[i], entry);
+    }
+  }
+  mv_stalled.clear ();
+#endif
+}
+
+// the addresses go straight into vDatagrams, so it's made big enough for a
+// batch first and cut back to what came.  A short batch means the socket is
+// empty for now, as in drain()
+int epoller::receive (int iFd, std::vector<epollDatagram> &vDatagrams, int iMax)
+{
+  struct mmsghdr msgs[EPOLLER_RECV_BATCH];
+  struct iovec iov[EPOLLER_RECV_BATCH];
+  size_t ulBase;
+  int iCount = 0;
+  int iWant;
+  int iRet;
+
+#if EPOLLER_IO_URING
+  fdEntry *entry = find (iFd);
+
+  if (entry != NULL && entry->bRecv)
+  {
+    // the ring reads it, and without the addresses
+    errno = EINVAL;
+    return -1;
+  }
+#endif
+
+  while (iCount < iMax)
+  {
+    iWant = std::min (iMax - iCount, EPOLLER_RECV_BATCH);
+    ulBase = vDatagrams.size ();
+    vDatagrams.resize (ulBase + iWant);
+    for (int i = 0 ; i < iWant ; i++)
+    {
+      iov[i].iov_base = getBuffer ();
+      iov[i].iov_len = EPOLLER_BUFFER_SIZE;
+      memset (&msgs[i].msg_hdr, 0, sizeof (msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &vDatagrams[ulBase + i].addr;
+      msgs[i].msg_hdr.msg_namelen = sizeof (sockaddr_storage);
+    }
+
+    do
+    {
+      iRet = recvmmsg (iFd, msgs, iWant, MSG_DONTWAIT, NULL);
+    } while (iRet == -1 && errno == EINTR);
+
+    // the filled buffers are the caller's, the others go back
+    for (int i = 0 ; i < iWant ; i++)
+    {
+      if (i < iRet)
+      {
+        epollDatagram &datagram = vDatagrams[ulBase + i];
+
+        datagram.view.iov_base = iov[i].iov_base;
+        datagram.view.iov_len = msgs[i].msg_len;
+        datagram.addrLen = msgs[i].msg_hdr.msg_namelen;
+        datagram.bTruncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+      }
+      else
+      {
+        mv_buffers.push_back (static_cast<char *>(iov[i].iov_base));
+      }
+    }
+    vDatagrams.resize (ulBase + std::max (iRet, 0));
+
+    if (iRet == -1)
+    {
+      // what was read is handed out, the error comes back on the next call
+      return iCount > 0 ? iCount : -1;
+    }
+    iCount += iRet;
+    if (iRet < iWant)
+    {
+      return iCount;
+    }
+  }
+
+  toBacklog (find (iFd), iFd);
+
+  return iCount;
+}
+
+void epoller::release (std::vector<epollDatagram> &vDatagrams)
+{
+  for (size_t i = 0 ; i < vDatagrams.size () ; i++)
+  {
+    mv_buffers.push_back (static_cast<char *>(vDatagrams[i].view.iov_base));
+  }
+  vDatagrams.clear ();
+}
+
+// a handler may close or add fds, so the entry is looked up again after
+// each call.  An event the batch still holds for an fd that was closed is
+// dropped - or goes to whatever got its number since, which with
+// non-blocking fds only costs a read that says EAGAIN
+void epoller::dispatchOne (const epoll_event &event)
+{
+  int iFd = event.data.fd;
+  fdEntry *entry;
 
-  // remove from the list of monitored descriptors
-  iter = mset_fileDescriptors.find (iFd);
-  if (iter != mset_fileDescriptors.end())
+  entry = find (iFd);
+  if (entry == NULL)
   {
-    // remove it from monitoring, explicitly
-    epoll_ctl (mi_PollFd, EPOLL_CTL_DEL, iFd, &mv_event[0]);
+    return;
+  }
+
+  if ((event.events & (EPOLLERR | EPOLLHUP)) != 0 && entry->fnError != NULL)
+  {
+    entry->fnError (*this, iFd, event.events, entry->vUser);
+    return;
+  }
+
+  if ((event.events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) != 0 && entry->fnRead != NULL)
+  {
+    entry->fnRead (*this, iFd, event.events, entry->vUser);
+    entry = find (iFd);
+    if (entry == NULL)
+    {
+      return;
+    }
+  }
+
+  if ((event.events & EPOLLOUT) != 0 && entry->fnWrite != NULL)
+  {
+    entry->fnWrite (*this, iFd, event.events, entry->vUser);
+  }
+}
+
+// one turn of the loop.  Returns the number of fd events and timers handled,
+// or -1 if a signal cut the wait short.  Only for fds added with handlers
+// (or with add (iFd)), the others don't have their fd in the event
+int epoller::dispatch (int iTimeout)
+{
+  int iWait;
+  int iRet;
+  int iCount = 0;
 
-    if (bClose == true)
+  iWait = mo_timers.timeout (now ());
+  if (iTimeout >= 0 && (iWait < 0 || iTimeout < iWait))
+  {
+    iWait = iTimeout;
+  }
+
+  if (mi_Ready == 0)
+  {
+    iRet = fill (iWait);
+    if (iRet == -1)
     {
-      if (iFd != STDIN_FILENO)
+      if (errno != EINTR)
       {
-        // close - but not if it's stdin
-        if (::close (iFd) == -1)
-        {
-          perror ("close");
-          exit (1);
-        }
-        else
-        {
-          makeFileDescriptorBlocking (iFd);
-        }
+        perror ("epoll_wait");
+        exit (1);
       }
-      else
+      return -1;
+    }
+    mi_Ready = iRet;
+  }
+
+  while (mi_Ready > 0)
+  {
+    mi_Ready--;
+    dispatchOne (mv_event[mi_Ready]);
+    iCount++;
+  }
+
+  return iCount + mo_timers.expire (now (), *this);
+}
+
+epoller::~epoller ()
+{
+  for (size_t iFd = 0 ; iFd < mv_fd.size () ; iFd++)
+  {
+    if (mv_fd[iFd].bRegistered)
+    {
+      makeFileDescriptorBlocking (iFd);
+      if (iFd != STDIN_FILENO && ::close (iFd) == -1) // don't want to close stdin, if we've used it
       {
-        makeFileDescriptorBlocking (iFd);
+        perror ("close");
+        exit (1);
       }
     }
-    bFound = true;
-    
-    // remove this from the list of monitored file descriptors
-    mset_fileDescriptors.erase (iter);
-    
-    // shrink the list of events by one
-    mv_event.erase (mv_event.end());
   }
-  return bFound;
+
+  for (size_t i = 0 ; i < mv_buffers.size () ; i++)
+  {
+    free (mv_buffers[i]);
+  }
+
+  // close the epoll fd (or the ring, which ends what it still has going)
+  if (mp_uring != NULL)
+  {
+    uringTeardown (mp_uring);
+  }
+  else if (::close (mi_PollFd) == -1)
+  {
+    perror ("close");
+    exit (1);
+  }
 }
 
-epoller::epoller ()
+timerWheel::timerWheel ()
 {
-  mi_PollFd = epoll_create1 (0);
-  if (mi_PollFd == -1)
+  for (int i = 0 ; i <= TIMER_WHEEL_OVERFLOW ; i++)
   {
-    perror ("epoll_create1");
-    exit (1);
+    mp_slot[i] = NULL;
   }
-  mi_Ready = 0;
+  for (int i = 0 ; i < TIMER_WHEEL_LEVELS ; i++)
+  {
+    mu64_Occupied[i] = 0;
+  }
+  mu64_Now = epoller::now ();
+  mi_Pending = 0;
 }
 
-void epoller::makeFileDescriptorNonBlocking (int iFd)
+// the slot is picked by the highest bits the expiry doesn't share with now,
+// so everything in a slot falls due at or after its start, and the slots a
+// level has already passed are empty
+void timerWheel::link (epollTimer *timer)
 {
-  int iFlags;
-  int iNewFd;
+  uint64_t u64Diff = timer->u64Expiry ^ mu64_Now;
+  epollTimer **head;
+  int iLevel = 0;
+  int iSlot;
 
-  iFlags = fcntl (iFd, F_GETFL, 0);
-  if (iFlags == -1)
+  while (iLevel < TIMER_WHEEL_LEVELS && (u64Diff >> (TIMER_WHEEL_BITS * (iLevel+1))) != 0)
   {
-    perror ("fcntl");
-    exit (1);
+    iLevel++;
+  }
+  if (iLevel == TIMER_WHEEL_LEVELS)
+  {
+    timer->usSlot = TIMER_WHEEL_OVERFLOW;
+  }
+  else
+  {
+    iSlot = (int) (timer->u64Expiry >> (TIMER_WHEEL_BITS * iLevel)) & (TIMER_WHEEL_SLOTS-1);
+    timer->usSlot = (unsigned short) (iLevel * TIMER_WHEEL_SLOTS + iSlot);
+    mu64_Occupied[iLevel] |= 1ULL << iSlot;
   }
 
-  iFlags |= O_NONBLOCK;
-  iNewFd = fcntl (iFd, F_SETFL, iFlags);
-  if (iNewFd == -1)
+  head = &mp_slot[timer->usSlot];
+  timer->next = *head;
+  if (timer->next != NULL)
   {
-    perror ("fcntl");
-    exit (1);
+    timer->next->pprev = &timer->next;
   }
+  timer->pprev = head;
+  *head = timer;
 }
 
-void epoller::makeFileDescriptorBlocking (int iFd)
+void timerWheel::unlink (epollTimer *timer)
 {
-  int iFlags;
-  int iNewFd;
-
-  iFlags = fcntl (iFd, F_GETFL, 0);
-  if (iFlags == -1)
+  *timer->pprev = timer->next;
+  if (timer->next != NULL)
   {
-    perror ("fcntl");
-    exit (1);
+    timer->next->pprev = timer->pprev;
   }
+  timer->pprev = NULL;
 
-  iFlags &= ~O_NONBLOCK;
-  iNewFd = fcntl (iFd, F_SETFL, iFlags);
-  if (iNewFd == -1)
+  if (timer->usSlot != TIMER_WHEEL_OVERFLOW && mp_slot[timer->usSlot] == NULL)
   {
-    perror ("fcntl");
-    exit (1);
+    mu64_Occupied[timer->usSlot / TIMER_WHEEL_SLOTS] &= ~(1ULL << (timer->usSlot % TIMER_WHEEL_SLOTS));
   }
 }
 
-bool epoller::add (int iFd, const epoll_data &epData)
+// the slot's time has come, its timers go (at least) a level down
+void timerWheel::cascade (int iSlot)
 {
-  struct epoll_event event;
-  int iRet;
-  bool bNew = true;
+  epollTimer *list = mp_slot[iSlot];
+  epollTimer *timer;
 
-  if (mset_fileDescriptors.find(iFd) != mset_fileDescriptors.end())
+  mp_slot[iSlot] = NULL;
+  if (iSlot != TIMER_WHEEL_OVERFLOW)
   {
-    bNew = false;
-    std::cout << "Duplicate\n";
+    mu64_Occupied[iSlot / TIMER_WHEEL_SLOTS] &= ~(1ULL << (iSlot % TIMER_WHEEL_SLOTS));
   }
-  else
+  while (list != NULL)
   {
-    makeFileDescriptorNonBlocking (iFd);
+    timer = list;
+    list = timer->next;
+    link (timer);
+  }
+}
 
-    event.data = epData;
-    event.events = EPOLLIN | EPOLLET;
-    iRet = epoll_ctl (mi_PollFd, EPOLL_CTL_ADD, iFd, &event);
-    
-    if (iRet == -1)
+// when the wheel next has something to do: the first timer of the lowest
+// level, or the start of the first occupied slot of a higher one.  That's
+// a wakeup or two more per level than the earliest expiry would need, but
+// finding that would mean looking at every timer in the slot
+uint64_t timerWheel::next (void)
+{
+  for (int iLevel = 0 ; iLevel < TIMER_WHEEL_LEVELS ; iLevel++)
+  {
+    int iShift = TIMER_WHEEL_BITS * iLevel;
+    int iCurrent = (int) (mu64_Now >> iShift) & (TIMER_WHEEL_SLOTS-1);
+    uint64_t u64Later;
+
+    u64Later = iCurrent == TIMER_WHEEL_SLOTS-1 ? 0 : mu64_Occupied[iLevel] & (~0ULL << (iCurrent+1));
+    if (u64Later != 0)
     {
-      perror ("epoll_ctl");
-      exit (1);
+      return ((mu64_Now >> (iShift + TIMER_WHEEL_BITS)) << (iShift + TIMER_WHEEL_BITS)) |
+             ((uint64_t) __builtin_ctzll (u64Later) << iShift);
     }
-    
-    // make room for returned events, data within event is irrelevant
-    mv_event.push_back (event);
+  }
+  if (mp_slot[TIMER_WHEEL_OVERFLOW] != NULL)
+  {
+    return ((mu64_Now >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) + 1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+  }
+
+  return UINT64_MAX;
+}
+
+void timerWheel::add (epollTimer *timer, uint64_t u64Expiry)
+{
+  cancel (timer);
+
+  // the wheel's tick for now has been handled already
+  timer->u64Expiry = u64Expiry > mu64_Now ? u64Expiry : mu64_Now + 1;
+  link (timer);
+  mi_Pending++;
+}
 
-    // keep a record of what file descriptors we're monitoring
-    mset_fileDescriptors.insert (iFd);
+bool timerWheel::cancel (epollTimer *timer)
+{
+  if (timer->pprev == NULL)
+  {
+    return false;
   }
+  unlink (timer);
+  mi_Pending--;
 
-  return bNew;
+  return true;
 }
 
-epoll_event epoller::wait (int iTimeout)
+int timerWheel::timeout (uint64_t u64Now)
 {
-  int iRet;
-  epoll_event epEvent;
+  uint64_t u64Next;
 
-  epEvent.events = 0;
-  epEvent.data.ptr = NULL;
+  if (mi_Pending == 0)
+  {
+    return -1;
+  }
+  u64Next = next ();
+  if (u64Next <= u64Now)
+  {
+    return 0;
+  }
 
-  if (mi_Ready == 0)
+  return u64Next - u64Now > INT_MAX ? INT_MAX : (int) (u64Next - u64Now);
+}
+
+// turn the wheel to u64Now, straight to the next tick that has anything in
+// it rather than a tick at a time.  A handler may add or cancel timers, what
+// it adds is due after this tick
+int timerWheel::expire (uint64_t u64Now, epoller &ep)
+{
+  uint64_t u64Tick;
+  epollTimer *timer;
+  int iFired = 0;
+
+  while ((u64Tick = next ()) <= u64Now)
   {
-    // if no file descriptor to process
-    iRet = epoll_wait (mi_PollFd, &(mv_event[0]), mv_event.size(), iTimeout);
+    mu64_Now = u64Tick;
+    if ((u64Tick & ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)) == 0)
+    {
+      cascade (TIMER_WHEEL_OVERFLOW);
+    }
+    for (int iLevel = TIMER_WHEEL_LEVELS-1 ; iLevel > 0 ; iLevel--)
+    {
+      if ((u64Tick & ((1ULL << (TIMER_WHEEL_BITS * iLevel)) - 1)) == 0)
+      {
+        cascade (iLevel * TIMER_WHEEL_SLOTS + ((int) (u64Tick >> (TIMER_WHEEL_BITS * iLevel)) & (TIMER_WHEEL_SLOTS-1)));
+      }
+    }
 
-    if (iRet == -1 && errno == EINTR)
+    while ((timer = mp_slot[u64Tick & (TIMER_WHEEL_SLOTS-1)]) != NULL)
     {
-      std::cout << "Signal trapped\n";
+      unlink (timer);
+      mi_Pending--;
+      timer->fnExpired (ep, timer, timer->vUser);
+      iFired++;
     }
-    else if (iRet > 0)
+  }
+  if (u64Now > mu64_Now)
+  {
+    mu64_Now = u64Now;
+  }
+
+  return iFired;
+}
+
+epollerPool::epollerPool (int iLoops, bool bPin, int iMaxEvents)
+{
+  epoll_data epd;
+
+  if (iLoops <= 0)
+  {
+    iLoops = (int) sysconf (_SC_NPROCESSORS_ONLN);
+    if (iLoops <= 0)
     {
-      mi_Ready = iRet;
+      iLoops = 1;
     }
-    else
+  }
+  mp_handler = NULL;
+  mp_user = NULL;
+  mui_next = 0;
+  mi_stop = 0;
+  mb_pin = bPin;
+  mb_running = false;
+
+  for (int i = 0 ; i < iLoops ; i++)
+  {
+    loop *lp = new loop;
+
+    lp->pool = this;
+    lp->ep = new epoller (iMaxEvents);
+    lp->iIndex = i;
+    lp->iEventFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (lp->iEventFd == -1)
     {
-      // timeout
-      epEvent.events = 0;
+      perror ("eventfd");
+      exit (1);
     }
+    pthread_mutex_init (&lp->mutex, NULL);
+    lp->vEvents.resize (iMaxEvents > 0 ? iMaxEvents : 1);
+
+    // the loop knows its mailbox by this pointer, nothing else can have it
+    epd.ptr = lp;
+    lp->ep->add (lp->iEventFd, epd);
+    mv_loop.push_back (lp);
   }
+}
 
-  if (mi_Ready > 0)
+// add what's been posted to the loop to its epoller.  The eventfd is read
+// (and so reset) before the mailbox is emptied, a post after that wakes the
+// loop again
+void epollerPool::takeMail (loop *lp)
+{
+  uint64_t u64Count;
+
+  if (read (lp->iEventFd, &u64Count, sizeof (u64Count)) == -1 && errno != EAGAIN)
   {
-    // with already have file descriptors to process
-    mi_Ready--;
-    epEvent = mv_event[mi_Ready];
+    perror ("read");
+    exit (1);
   }
 
-  return epEvent;
+  pthread_mutex_lock (&lp->mutex);
+  lp->vTaken.swap (lp->vMailbox);
+  pthread_mutex_unlock (&lp->mutex);
+
+  for (size_t i = 0 ; i < lp->vTaken.size () ; i++)
+  {
+    lp->ep->add (lp->vTaken[i].iFd, lp->vTaken[i].data, lp->vTaken[i].u32Events);
+  }
+  lp->vTaken.clear ();
 }
 
-epoller::~epoller ()
+void *epollerPool::run (void *vLoop)
 {
-  for (std::set<int>::iterator iter = mset_fileDescriptors.begin() ; iter != mset_fileDescriptors.end() ; iter++)
+  loop *lp = static_cast<loop *>(vLoop);
+  epollerPool *pool = lp->pool;
+  int iCount;
+
+  if (pool->mb_pin)
+  {
+    cpu_set_t cpus;
+
+    CPU_ZERO (&cpus);
+    CPU_SET (lp->iIndex % sysconf (_SC_NPROCESSORS_ONLN), &cpus);
+    pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+  }
+
+  while (__atomic_load_n (&pool->mi_stop, __ATOMIC_ACQUIRE) == 0)
   {
-    if (*iter != STDIN_FILENO) // don't want to close stdin, if we've used it
+    iCount = lp->ep->wait_batch (lp->vEvents, -1);
+    for (int i = 0 ; i < iCount ; i++)
     {
-      if (::close (*iter) == -1)
+      if (lp->vEvents[i].data.ptr == lp)
       {
-        perror ("close");
-        exit (1);
+        pool->takeMail (lp);
       }
       else
       {
-        makeFileDescriptorBlocking (*iter);
+        pool->mp_handler (*pool, lp->iIndex, lp->vEvents[i], pool->mp_user);
       }
     }
   }
-    
-  // close the epoll fd
-  if (::close (mi_PollFd) == -1)
+
+  return NULL;
+}
+
+void epollerPool::start (handler fnHandler, void *vUser)
+{
+  if (__atomic_load_n (&mb_running, __ATOMIC_ACQUIRE))
   {
-    perror ("close");
+    return;
+  }
+  mp_handler = fnHandler;
+  mp_user = vUser;
+  __atomic_store_n (&mi_stop, 0, __ATOMIC_RELEASE);
+
+  for (size_t i = 0 ; i < mv_loop.size () ; i++)
+  {
+    if (pthread_create (&mv_loop[i]->thread, NULL, run, mv_loop[i]) != 0)
+    {
+      perror ("pthread_create");
+      exit (1);
+    }
+  }
+  __atomic_store_n (&mb_running, true, __ATOMIC_RELEASE);
+}
+
+void epollerPool::stop (void)
+{
+  uint64_t u64One = 1;
+
+  if (!__atomic_load_n (&mb_running, __ATOMIC_ACQUIRE))
+  {
+    return;
+  }
+
+  // wake every loop, it sees the flag once it's done with its batch
+  __atomic_store_n (&mi_stop, 1, __ATOMIC_RELEASE);
+  for (size_t i = 0 ; i < mv_loop.size () ; i++)
+  {
+    if (write (mv_loop[i]->iEventFd, &u64One, sizeof (u64One)) == -1)
+    {
+      perror ("write");
+      exit (1);
+    }
+  }
+  for (size_t i = 0 ; i < mv_loop.size () ; i++)
+  {
+    pthread_join (mv_loop[i]->thread, NULL);
+  }
+  __atomic_store_n (&mb_running, false, __ATOMIC_RELEASE);
+
+  // what was posted too late is still added, so it's closed with the rest
+  for (size_t i = 0 ; i < mv_loop.size () ; i++)
+  {
+    takeMail (mv_loop[i]);
+  }
+}
+
+void epollerPool::post (int iLoop, int iFd, const epoll_data &epData, uint32_t u32Events)
+{
+  loop *lp = mv_loop[iLoop];
+  handoff mail;
+  uint64_t u64One = 1;
+
+  mail.iFd = iFd;
+  mail.u32Events = u32Events;
+  mail.data = epData;
+
+  pthread_mutex_lock (&lp->mutex);
+  lp->vMailbox.push_back (mail);
+  pthread_mutex_unlock (&lp->mutex);
+
+  // read by any thread, start() and stop() change it
+  if (__atomic_load_n (&mb_running, __ATOMIC_ACQUIRE))
+  {
+    if (write (lp->iEventFd, &u64One, sizeof (u64One)) == -1)
+    {
+      perror ("write");
+      exit (1);
+    }
+  }
+  else
+  {
+    takeMail (lp);
+  }
+}
+
+int epollerPool::assign (int iFd, const epoll_data &epData)
+{
+  int iLoop = (int) (__atomic_fetch_add (&mui_next, 1, __ATOMIC_RELAXED) % mv_loop.size ());
+
+  post (iLoop, iFd, epData);
+  return iLoop;
+}
+
+int epollerPool::assignByHash (int iFd, uint64_t u64Hash, const epoll_data &epData)
+{
+  int iLoop = (int) (u64Hash % mv_loop.size ());
+
+  post (iLoop, iFd, epData);
+  return iLoop;
+}
+
+void epollerPool::addShared (int iFd, const epoll_data &epData)
+{
+  // the pool closes it, once, rather than every loop's epoller
+  mv_shared.push_back (iFd);
+  for (size_t i = 0 ; i < mv_loop.size () ; i++)
+  {
+    post ((int) i, iFd, epData, EPOLLIN | EPOLLEXCLUSIVE);
+  }
+}
+
+// set before bind(2) on every socket that is to share the address, the
+// kernel then spreads the connections (or datagrams) over them
+void epollerPool::setReusePort (int iFd)
+{
+  int iOn = 1;
+
+  if (setsockopt (iFd, SOL_SOCKET, SO_REUSEPORT, &iOn, sizeof (iOn)) == -1)
+  {
+    perror ("setsockopt");
     exit (1);
   }
 }
 
+epollerPool::~epollerPool ()
+{
+  stop ();
+
+  for (size_t i = 0 ; i < mv_loop.size () ; i++)
+  {
+    for (size_t j = 0 ; j < mv_shared.size () ; j++)
+    {
+      mv_loop[i]->ep->remove (mv_shared[j]);
+    }
+    // this closes the eventfd, and whatever was handed to the loop
+    delete mv_loop[i]->ep;
+    pthread_mutex_destroy (&mv_loop[i]->mutex);
+    delete mv_loop[i];
+  }
+  for (size_t j = 0 ; j < mv_shared.size () ; j++)
+  {
+    if (::close (mv_shared[j]) == -1)
+    {
+      perror ("close");
+      exit (1);
+    }
+  }
+}
+
 #if 0
 // stole this code from https://stackoverflow.com/questions/1798511/how-to-avoid-pressing-enter-with-getchar#1798833
 #include <termios.h>
@@ -247,6 +1764,7 @@ int blah (void)
 }
 #endif
 
+#if !EPOLLER_NO_MAIN // -DEPOLLER_NO_MAIN=1 to link the epoller into something else (udp_epoll_server)
 int main (int argc, char **argv)
 {
   epoller ep;
@@ -258,23 +1776,21 @@ int main (int argc, char **argv)
   for (int i = 0 ; i < 3 ; i++)
   {
     struct epoll_event event;
-    int iRet;
-    unsigned char var;
+    std::vector<iovec> vViews;
+    ssize_t lRet;
     
     event = ep.wait (iTimeout);
     printf (".events = %08x : ", event.events);
     if (event.events != 0)
     {
-      for ( ;; )
+      lRet = ep.drain (event.data.fd, vViews);
+      printf ("%zd bytes in %zu buffers : ", lRet, vViews.size ());
+      for (size_t j = 0 ; j < vViews.size () ; j++)
       {
-        iRet = read (event.data.fd, &var, sizeof (var));
-        if (iRet == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-        {
-          break;
-        }
-        std::cout << iRet << ":" << var << " ";
-        fflush (stdout);
+        fwrite (vViews[j].iov_base, 1, vViews[j].iov_len, stdout);
       }
+      fflush (stdout);
+      ep.release (vViews);
     }
     else
     {
@@ -284,3 +1800,4 @@ int main (int argc, char **argv)
 
   return 0;
 }
+#endif
@@ -2,35 +2,276 @@
 #define __EPOLL_EXAMPLE_H__
 
 #include <vector>
-#include <set>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#define EPOLLER_MAX_EVENTS  (64)         // default for the most events one wait() gets from the kernel
+#define EPOLLER_BUFFER_SIZE (4096)       // drain()'s buffers
+#define EPOLLER_DRAIN_IOV   (8)          // buffers per readv
+#define EPOLLER_DRAIN_MAX   (64 * 1024)  // default for the most drain() reads from an fd in one go
+#define EPOLLER_RECV_BATCH  (32)         // datagrams per recvmmsg
+#define EPOLLER_RECV_MAX    (256)        // default for the most datagrams receive() takes from an fd in one go
+
+#ifndef EPOLLER_IO_URING
+#define EPOLLER_IO_URING    (0)          // 1 builds in the io_uring backend, see epoll_example.cpp
+#endif
+
+class epoller;
+struct uringState;
+struct io_uring_cqe;
+
+// a datagram from epoller::receive, in one of its buffers until release()
+struct epollDatagram
+{
+  iovec view;
+  sockaddr_storage addr;
+  socklen_t addrLen;
+  bool bTruncated;        // longer than EPOLLER_BUFFER_SIZE, the rest is gone
+};
+
+// a timer for epoller::addTimer.  It lives in the caller's memory (in its
+// connection, say), so adding, moving and cancelling one never allocates.
+// Zero it before its first use
+struct epollTimer
+{
+  epollTimer *next;
+  epollTimer **pprev;     // NULL when it isn't pending
+  uint64_t u64Expiry;     // ms, CLOCK_MONOTONIC
+  unsigned short usSlot;
+  void (*fnExpired) (epoller &ep, epollTimer *timer, void *vUser);
+  void *vUser;
+};
+
+#define TIMER_WHEEL_BITS     (6)                                          // 64 slots a level
+#define TIMER_WHEEL_SLOTS    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS   (4)                                          // slots of 1ms, 64ms, 4.1s and 4.4min
+#define TIMER_WHEEL_OVERFLOW (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)     // more than 4.6 hours off
+
+// a hierarchical timer wheel with a 1ms tick.  A timer goes in the lowest
+// level whose slot tells it apart from now, and moves a level down each time
+// its slot comes around, so adding and cancelling are O(1) and a timer is
+// touched at most once per level before it fires
+class timerWheel
+{
+private:
+  epollTimer *mp_slot[TIMER_WHEEL_OVERFLOW + 1];
+  uint64_t mu64_Occupied[TIMER_WHEEL_LEVELS]; // a bit per non-empty slot
+  uint64_t mu64_Now;
+  int mi_Pending;
+
+  void link (epollTimer *timer);
+  void unlink (epollTimer *timer);
+  void cascade (int iSlot);
+  uint64_t next (void);
+
+public:
+  timerWheel ();
+  void add (epollTimer *timer, uint64_t u64Expiry);
+  bool cancel (epollTimer *timer);
+  int timeout (uint64_t u64Now);              // ms until the wheel has to turn, -1 if it's empty
+  int expire (uint64_t u64Now, epoller &ep);  // call what's due, returns how many
+  int pending (void) {return mi_Pending;}
+};
 
 class epoller
 {
+public:
+  // u32Events is what epoll_wait said about iFd
+  typedef void (*fdHandler) (epoller &ep, int iFd, uint32_t u32Events, void *vUser);
+  typedef void (*timerHandler) (epoller &ep, epollTimer *timer, void *vUser);
+
 private:
-  std::vector<struct epoll_event> mv_event;
-  std::set<int> mset_fileDescriptors;
+  // what's kept for each monitored file descriptor, by fd
+  struct fdEntry
+  {
+    bool bRegistered;
+    bool bBacklogged;   // drain() left data behind, see mv_backlog
+    uint32_t u32Events; // the interest mask given to epoll_ctl
+    epoll_data data;
+    fdHandler fnRead;   // the handlers, for dispatch()
+    fdHandler fnWrite;
+    fdHandler fnError;
+    void *vUser;
+#if EPOLLER_IO_URING
+    bool bRecv;                   // addRecv'd, the ring reads it
+    bool bStalled;                // its recv ran out of buffers
+    bool bEof;
+    int iError;
+    unsigned int uiGeneration;    // tells its completions from those of an fd it had the number of
+    std::vector<iovec> vReceived; // read by the ring, not drained yet
+#endif
+  };
+
+  std::vector<struct epoll_event> mv_event; // wait()'s buffer, it doesn't grow with the fds
+  std::vector<fdEntry> mv_fd;               // only grows when a higher fd is added
+  timerWheel mo_timers;
+  std::vector<int> mv_backlog;              // fds drain() stopped short on, ET won't say so again
+  std::vector<char *> mv_buffers;           // free EPOLLER_BUFFER_SIZE buffers
+  uringState *mp_uring;                     // NULL for epoll
+#if EPOLLER_IO_URING
+  std::vector<int> mv_stalled;              // recvs to start again once there are buffers
+#endif
+  int mi_Registered;
   int mi_PollFd;
   int mi_Ready;
 
+  fdEntry *find (int iFd) {return iFd >= 0 && (size_t) iFd < mv_fd.size () && mv_fd[iFd].bRegistered ? &mv_fd[iFd] : NULL;}
+
   bool removeOrClose (int iFd, bool bClose);
+  void dispatchOne (const epoll_event &event);
+  bool addEntry (int iFd, const epoll_data &epData, uint32_t u32Events, bool bRecv);
+  int collect (epoll_event *pEvents, int iMaxEvents, int iTimeout);
+  int fill (int iTimeout);
+  void toBacklog (fdEntry *entry, int iFd);
+#if EPOLLER_IO_URING
+  void uringArm (int iFd, fdEntry *entry);
+  void uringForget (int iFd, fdEntry *entry);
+  int uringCollect (epoll_event *pEvents, int iMaxEvents, int iTimeout);
+  int uringReap (epoll_event *pEvents, int iMaxEvents);
+  bool uringComplete (const io_uring_cqe *cqe, epoll_event *event);
+  ssize_t uringDrain (int iFd, fdEntry *entry, std::vector<iovec> &vViews, size_t ulMax, bool *pbEof);
+#endif
+  int takeBacklog (epoll_event *pEvents, int iMaxEvents);
+  char *getBuffer (void);
 
 public:
-  epoller ();
+  // bUring asks for the io_uring backend, if it's built in and the kernel
+  // has what it needs - it's epoll otherwise
+  explicit epoller (int iMaxEvents = EPOLLER_MAX_EVENTS, bool bUring = EPOLLER_IO_URING);
+  bool usingUring (void) {return mp_uring != NULL;}
   static void makeFileDescriptorNonBlocking (int iFd);
   static void makeFileDescriptorBlocking (int iFd);
-  bool add (int iFd, const epoll_data &epData);
+  bool add (int iFd, const epoll_data &epData, uint32_t u32Events) {return addEntry (iFd, epData, u32Events, false);}
+  bool add (int iFd, const epoll_data &epData) {return add (iFd, epData, EPOLLIN | EPOLLET);}
 
   bool add (int iFd, void *vPtr)      {epoll_data epd; epd.ptr = vPtr;   return add (iFd, epd);}
   bool add (int iFd)                  {epoll_data epd; epd.fd  = iFd;    return add (iFd, epd);}
   bool add (int iFd, uint32_t u32Val) {epoll_data epd; epd.u32 = u32Val; return add (iFd, epd);}
   bool add (int iFd, uint64_t u64Val) {epoll_data epd; epd.u64 = u64Val; return add (iFd, epd);}
 
+  // a connected socket to drain(): with io_uring the data is read before the
+  // EPOLLIN is handed out, otherwise it's add (iFd, epData)
+  bool addRecv (int iFd, const epoll_data &epData);
+  bool addRecv (int iFd, void *vPtr)      {epoll_data epd; epd.ptr = vPtr;   return addRecv (iFd, epd);}
+  bool addRecv (int iFd)                  {epoll_data epd; epd.fd  = iFd;    return addRecv (iFd, epd);}
+  bool addRecv (int iFd, uint32_t u32Val) {epoll_data epd; epd.u32 = u32Val; return addRecv (iFd, epd);}
+  bool addRecv (int iFd, uint64_t u64Val) {epoll_data epd; epd.u64 = u64Val; return addRecv (iFd, epd);}
+
+  // for dispatch(): the read handler also gets hangups and errors if there's
+  // no error handler, a NULL write handler leaves EPOLLOUT out of the mask
+  bool add (int iFd, fdHandler fnRead, fdHandler fnWrite, fdHandler fnError, void *vUser);
+
+  // (re)start a timer iMs from now, a pending one is moved
+  void addTimer (epollTimer *timer, int iMs, timerHandler fnExpired, void *vUser);
+  bool cancelTimer (epollTimer *timer) {return mo_timers.cancel (timer);}
+  static uint64_t now (void); // ms, CLOCK_MONOTONIC
+
   epoll_event wait (int iTimeout = -1);
+
+  // up to iMaxEvents ready events at once, into the caller's buffer
+  int wait_batch (epoll_event *pEvents, int iMaxEvents, int iTimeout);
+
+  template <size_t N>
+  int wait_batch (epoll_event (&events)[N], int iTimeout = -1) {return wait_batch (events, (int) N, iTimeout);}
+  int wait_batch (std::vector<epoll_event> &vEvents, int iTimeout = -1) {return wait_batch (vEvents.data (), (int) vEvents.size (), iTimeout);}
+
+  // wait for no longer than iTimeout or the next timer, then call the
+  // handlers of the ready fds and of the timers that are due
+  int dispatch (int iTimeout = -1);
+
+  // read what's waiting on iFd into pooled buffers, a view for each one is
+  // added to vViews (until release() they're the caller's).  No more than
+  // ulMax bytes at a time, so one busy fd can't starve the rest: if that's
+  // reached the fd is handed out again by the next wait, as if it had
+  // another EPOLLIN.  Returns the bytes read (0 at EOF, *pbEof says which)
+  // or -1 with errno set if nothing could be read
+  ssize_t drain (int iFd, std::vector<iovec> &vViews, size_t ulMax = EPOLLER_DRAIN_MAX, bool *pbEof = NULL);
+  void release (std::vector<iovec> &vViews);
+
+  // drain() for a datagram socket: what's waiting on iFd, a recvmmsg of
+  // EPOLLER_RECV_BATCH at a time, a pooled buffer and the sender's address
+  // for each datagram.  No more than iMax of them at a time, after that it's
+  // handed out again like drain()'s.  The socket is add()ed, not addRecv()ed.
+  // Returns how many were added to vDatagrams, -1 with errno set if none
+  int receive (int iFd, std::vector<epollDatagram> &vDatagrams, int iMax = EPOLLER_RECV_MAX);
+  void release (std::vector<epollDatagram> &vDatagrams);
+
   bool remove (int iFd) {return removeOrClose (iFd, false);}
   bool close (int iFd)  {return removeOrClose (iFd, true);}
 
+  bool isRegistered (int iFd) {return find (iFd) != NULL;}
+  int registered (void)       {return mi_Registered;}
+
   ~epoller ();  
 };
 
 
+// a reactor pool: an epoller per thread (pinned to a core of its own if
+// asked), all calling the same handler.  An fd is handed to a loop through
+// its mailbox (an eventfd), and the loop adds it to its own epoller - an
+// epoller is only touched by its own thread once the pool is started.  A
+// listen socket that every loop should accept on is added to all of them
+// with EPOLLEXCLUSIVE, so a connection wakes one loop and not the lot.  The
+// other way to spread connections is a socket per loop with SO_REUSEPORT
+// (see setReusePort), each one posted to its own loop.  Needs -pthread
+class epollerPool
+{
+public:
+  // called on the loop's thread for every event but the mailbox's
+  typedef void (*handler) (epollerPool &pool, int iLoop, const epoll_event &event, void *vUser);
+
+private:
+  struct handoff
+  {
+    int iFd;
+    uint32_t u32Events;
+    epoll_data data;
+  };
+
+  struct loop
+  {
+    epollerPool *pool;
+    epoller *ep;
+    int iIndex;
+    int iEventFd;
+    pthread_t thread;
+    pthread_mutex_t mutex;          // for vMailbox
+    std::vector<handoff> vMailbox;
+    std::vector<handoff> vTaken;    // only used by the loop
+    std::vector<epoll_event> vEvents;
+  };
+
+  std::vector<loop *> mv_loop;
+  std::vector<int> mv_shared;
+  handler mp_handler;
+  void *mp_user;
+  unsigned int mui_next;
+  int mi_stop;
+  bool mb_pin;
+  bool mb_running;
+
+  static void *run (void *vLoop);
+  void takeMail (loop *lp);
+
+public:
+  // iLoops of 0 is one per core
+  explicit epollerPool (int iLoops = 0, bool bPin = true, int iMaxEvents = EPOLLER_MAX_EVENTS);
+  int size (void) {return (int) mv_loop.size ();}
+  epoller &at (int iLoop) {return *mv_loop[iLoop]->ep;} // only on iLoop's thread once started
+
+  void start (handler fnHandler, void *vUser);
+  void stop (void);
+
+  // hand iFd to a loop, from any thread
+  void post (int iLoop, int iFd, const epoll_data &epData, uint32_t u32Events = EPOLLIN | EPOLLET);
+  int assign (int iFd, const epoll_data &epData);                      // round robin
+  int assignByHash (int iFd, uint64_t u64Hash, const epoll_data &epData);
+  void addShared (int iFd, const epoll_data &epData);                  // every loop, EPOLLEXCLUSIVE
+
+  static void setReusePort (int iFd);
+
+  ~epollerPool ();
+};
+
 #endif //__EPOLL_EXAMPLE_H__
@@ -8,6 +8,8 @@
 #include <sys/ioctl.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <time.h>
 
 void setWindowSize (int cols, int rows)
 {
@@ -44,115 +46,197 @@ void setTermIos (struct termios newt)
   tcsetattr (STDIN_FILENO, TCSANOW, &newt);
 }
 
-void setCursorPos (int iCol, int iRow)
+static long long nowMs (void)
 {
-  printf ("\e[%d;%df", iRow, iCol);
-  fflush (stdout);
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-void getCursorPos (int *piCol, int *piRow)
+// the reply to \e[6n is \e[<ROW>;<COLUMN>R, maybe after something that was
+// typed; whatever doesn't fit starts it over
+struct cursorReply
 {
-  char *szPtr = NULL;
-  char szRow[10] = "";
-  char szCol[10] = "";
-  int iMode;
+  int iState; // 0 waiting for \e, 1 for [, 2 in the row, 3 in the column, 4 done
+  int iRow;
+  int iCol;
+};
 
-  printf ("\e[6n");
-  fflush (stdout);
+static void parseCursorReply (struct cursorReply *reply, char c)
+{
+  int *piNumber = reply->iState == 2 ? &reply->iRow : &reply->iCol;
 
-  // read back the cursor position, returns as \e[<ROW>;<COLUMN>R
-  for ( iMode = 0 ;; )
+  switch (reply->iState)
   {
-    int iChar = getchar();
+  case 0:
+    if (c == '\e')
+    {
+      reply->iState = 1;
+    }
+    break;
+  case 1:
+    reply->iState = c == '[' ? 2 : (c == '\e' ? 1 : 0);
+    reply->iRow = 0;
+    reply->iCol = 0;
+    break;
+  case 2:
+  case 3:
+    if (c >= '0' && c <= '9' && *piNumber < 100000)
+    {
+      *piNumber = *piNumber * 10 + c - '0';
+    }
+    else if (c == ';' && reply->iState == 2)
+    {
+      reply->iState = 3;
+    }
+    else if (c == 'R' && reply->iState == 3)
+    {
+      reply->iState = 4;
+    }
+    else
+    {
+      reply->iState = c == '\e' ? 1 : 0;
+    }
+    break;
+  }
+}
 
-    switch (iMode)
+// all in one write: save the cursor, off to the bottom right (the terminal
+// stops it at the edge), ask where it is and put it back.  Then the reply,
+// straight from the fd and for no longer than iTimeout ms, however many
+// reads it comes in.  0 if it came
+int probeTerminalSize (int iTimeout, int *piCols, int *piRows)
+{
+  static const char szProbe[] = "\e7\e[999;999H\e[6n\e8";
+  struct cursorReply reply = {0, 0, 0};
+  struct pollfd pfd;
+  long long llDeadline;
+  long long llNow;
+  char buffer[64];
+  ssize_t lRet;
+  ssize_t l;
+
+  if (write (STDOUT_FILENO, szProbe, sizeof (szProbe) - 1) != sizeof (szProbe) - 1)
+  {
+    perror ("write");
+    return -1;
+  }
+
+  llDeadline = nowMs () + iTimeout;
+  pfd.fd = STDIN_FILENO;
+  pfd.events = POLLIN;
+  while (reply.iState != 4)
+  {
+    llNow = nowMs ();
+    if (llNow >= llDeadline)
     {
-    case 0:
-      if (iChar == '[')
-      {
-        szPtr = szRow;
-        iMode = 1;
-        // start reading Row
-      }        
-      break;
-    case 1:
-      if (iChar == ';')
-      {
-        *szPtr = '\0';
-        szPtr = szCol;
-        iMode = 2;
-        // start reading Column
-      }
-      else
-      {
-        *szPtr = (char) iChar;
-        szPtr++;
-      }
-      break;
-    case 2:
-      if (iChar == 'R')
+      return -1;
+    }
+    lRet = poll (&pfd, 1, (int) (llDeadline - llNow));
+    if (lRet == 0)
+    {
+      return -1;
+    }
+    if (lRet > 0)
+    {
+      lRet = read (STDIN_FILENO, buffer, sizeof (buffer));
+      if (lRet == 0)
       {
-        *szPtr = '\0';
+        return -1;
       }
-      else
+    }
+    if (lRet < 0)
+    {
+      if (errno == EINTR)
       {
-        *szPtr = (char) iChar;
-        szPtr++;
+        continue;
       }
-      break;
+      perror ("read");
+      return -1;
     }
-    
-    if (iChar == 'R')
+
+    // what comes after the R is lost, it was typed before the reply got here
+    for (l = 0 ; l < lRet && reply.iState != 4 ; l++)
     {
-      break;
+      parseCursorReply (&reply, buffer[l]);
     }
   }
 
-  *piRow = atoi (szRow);
-  *piCol = atoi (szCol);
+  *piCols = reply.iCol;
+  *piRows = reply.iRow;
+  return 0;
 }
 
+// maximizeTerminalSize [-t timeout] [-n]
+//   -t is how long to wait for the terminal to answer, in ms (1000), -n only
+//   says what the size is
 int main (int argc, char **argv)
 {
   struct termios oldt;
+  struct winsize win;
+  int iTimeout = 1000;
+  int bSet = 1;
   int iMaxCol;
   int iMaxRow;
-  int iCol=0;
-  int iRow=0;
+  int iOpt;
+  int iRet = 0;
 
-  // turn off canonical and echo
-  oldt = clearTermIosFlags (ICANON | ECHO);
+  while ((iOpt = getopt (argc, argv, "t:n")) != -1)
+  {
+    switch (iOpt)
+    {
+    case 't':
+      iTimeout = atoi (optarg);
+      break;
+    case 'n':
+      bSet = 0;
+      break;
+    default:
+      fprintf (stderr, "usage: %s [-t timeout] [-n]\n", argv[0]);
+      return 1;
+    }
+  }
 
-  if (isatty(STDOUT_FILENO))
+  if (!isatty (STDIN_FILENO) || !isatty (STDOUT_FILENO))
   {
-    // get current position
-    getCursorPos (&iCol, &iRow);
+    printf ("This doesn't appear to be connected to a terminal, no change\n");
+    return 0;
+  }
 
-    // force [x,y] position to furthest bottom and right of the screen, by using ridiculous numbers
-    setCursorPos (9999, 9999);
-  
-    // query ACTUAL cursor position which will be the bottom right of the screen
-    getCursorPos (&iMaxCol, &iMaxRow);
+  // turn off canonical and echo
+  oldt = clearTermIosFlags (ICANON | ECHO);
 
+  if (probeTerminalSize (iTimeout, &iMaxCol, &iMaxRow) == 0)
+  {
     // set the window size to the maximum column, and row value
-    setWindowSize (iMaxCol, iMaxRow);
-
-    // reset the cursor position to where it was right after the user hit <return> to run this program
-    setCursorPos (iCol, iRow);
+    if (bSet)
+    {
+      setWindowSize (iMaxCol, iMaxRow);
+    }
 
     // report to the user what the size of the screen is
     printf ("Terminal size is %d columns and %d rows\n", iMaxCol, iMaxRow);
-
-    // turn back on ICANON and ECHO
-    setTermIos (oldt);
   }
   else
   {
-    printf ("This doesn't appear to be connected to a terminal, no change\n");
+    // a reply that comes late isn't for the shell
+    tcflush (STDIN_FILENO, TCIFLUSH);
 
-    // turn back on ICANON and ECHO
-    setTermIos (oldt);
+    if (ioctl (STDIN_FILENO, TIOCGWINSZ, (char *) &win) == 0 && win.ws_col != 0 && win.ws_row != 0)
+    {
+      printf ("No answer from the terminal in %d ms, the size stays at %d columns and %d rows\n",
+              iTimeout, win.ws_col, win.ws_row);
+    }
+    else
+    {
+      printf ("No answer from the terminal in %d ms, and no size to go by, no change\n", iTimeout);
+      iRet = 1;
+    }
   }
 
-  return 0;
+  // turn back on ICANON and ECHO
+  setTermIos (oldt);
+
+  return iRet;
 }
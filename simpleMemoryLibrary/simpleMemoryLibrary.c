@@ -3,14 +3,28 @@
 // ----------------------------------
 // gcc -g -Wall -rdynamic ./simpleMemoryLibrary.c -ldl
 // gcc -g -Wall -rdynamic ./simpleMemoryLibrary.c -ldl -pthread
+// gcc -g -Wall -rdynamic ./simpleMemoryLibrary.c ./simpleMemoryLibraryNew.cpp -ldl -pthread -lstdc++
+//
+// (the last one adds operator new and delete for C++ programs, see
+// simpleMemoryLibraryNew.cpp)
 //
 // #defines for control (use -D{define}=1 to enable)
 //   -DSML_PRINTF=1 : enable printf's output
 //   -DTRACE=1      : enable stack trace on each allocate/free
+//   -DSML_POOL=1   : serve blocks of up to SML_POOL_MAX_SIZE bytes from per
+//                    thread slabs instead of glibc (needs pthread)
 //
-// Both are disabled by default - if you never enable trace, you can omit
+// All three are disabled by default - if you never enable trace, you can omit
 // -rdynamic from the compile line.
 //
+// smlBench.cpp measures what a build costs against plain glibc, run it after
+// any change to the hooks.
+//
+// With TRACE, only the raw return addresses are captured on each allocation.
+// Identical stacks are stored once in a call site table, and a block just
+// keeps the 32 bit ID of its stack.  The addresses are turned into names
+// (with dladdr(3)) the first time a call site is reported.
+//
 // This library over-rides malloc(3), realloc(3), calloc(3), and the free(3)
 // functions in order to detect memory leaks, and memory over-runs.  All
 // allocations and frees are reported to stdout.  Any (detected) over-run
@@ -19,16 +33,135 @@
 // This supports pthread - if you aren't using pthreads, just disable the
 // #include of pthread.h to compile out mutexes and to remove PID tracking
 //
+// Allocated blocks are tracked in a registry that is split into shards, each
+// with its own mutex and list.  A block picks its shard from a hash of its
+// address, and the number of shards is sized to the number of cores, so
+// threads allocating at the same time rarely wait on each other.
+//
+// With pthreads, every thread also gets its own registry (a thread cache), and
+// its blocks go there instead of into a shard.  Only the owning thread takes
+// that mutex in the hot path.  A block freed by another thread is verified and
+// pushed onto a lock-free stack on the owner's cache, and the owner unlinks
+// and releases it the next time it allocates or frees.  The caches of threads
+// that have exited are kept, and handed to the next thread that is created.
+// The shards are still used for blocks allocated while a thread has no cache
+// (while it's being set up, or after it's been torn down on thread exit).
+//
+// The allocation count and the number of bytes in use are kept per thread too,
+// and only summed up when they are asked for.  The peak is tracked from a
+// process-wide total that each thread adds to in batches of
+// SML_COUNTER_BATCH bytes, so it can be low by up to that much per thread.
+//
+// With SML_POOL, small blocks don't go to glibc at all.  Each thread cache
+// owns slabs of SML_POOL_SLAB_SIZE bytes, one list of them per size class,
+// carved out of one address range that's reserved at start up (so whether a
+// pointer is pooled is a single compare).  A slot only holds the guard bands
+// around the caller's bytes.  The size, the call site and the state of the
+// slot are kept in a side table at the start of its slab, and the slab
+// itself stands in for the registry the block is on.  A slot freed by
+// another thread goes on a lock-free stack on its slab, and the owner takes
+// those back once the slab runs out.
+//
 // This should be light enough to leave in a final build.
 //
+// Sampling: if SML_SAMPLE_BYTES is set in the environment when the program
+// starts, only about one allocation per SML_SAMPLE_BYTES bytes allocated is
+// tracked (a Poisson process over the bytes, the way tcmalloc's heap profiler
+// does it).  Only the sampled blocks get guard bands and go on a registry,
+// everything else is passed straight to glibc.  The sampled pointers are kept
+// in a small lock-free hash set so free(3) can tell them apart.  The counts,
+// the usage and mem_show_allocations() are scaled up to estimates of the
+// whole heap, and over-runs are only caught in the sampled blocks.  Sampling
+// can't be turned on or off once allocations have been made, but the
+// interval can be changed with mem_set_sample_interval().
+//
+// Background scanning: with pthreads, setting SML_SCAN_CPU (a percentage of
+// one core) in the environment starts a thread that checks the guard bands of
+// SML_SCAN_BLOCKS blocks (4096 if unset) at a time, then sleeps long enough to
+// stay within that share of the CPU.  Only one registry is locked at a time,
+// for one batch, so allocating threads never wait for a whole walk.  The
+// scanner keeps its place in a list with a marker entry that frees just step
+// over, and a corrupt block is reported with the thread that allocated it
+// before the usual abort().  A child made by fork(2) has no scanner.
+//
+// Guard pages: setting SML_GUARD_BYTES in the environment gives every tracked
+// block of that many bytes or more a span of pages of its own, out of one
+// range of address space that's reserved at start up (like the pool's).  The
+// caller's bytes end right at a PROT_NONE page, so an over-run faults at the
+// instruction that does it - or, with SML_GUARD_BEFORE set too, they start
+// right after one, for under-runs.  The header is on a page of its own at the
+// start of the span and stays on the lists, so the counts and the reports
+// don't change, but the walks (mem_check_integrity() and the scanner) skip
+// these blocks.  Only the pad up to the alignment is checked, at free(3).  A
+// span is unmapped when its block is freed and its address is never used
+// again, so a use after free (or a second free) faults as well.  A realloc of
+// a guarded block always moves it.  Once the range is used up, or the kernel
+// won't split the mapping any further, blocks get the guard words again.
+// The smaller blocks, and those the pool serves, are as they were.
+//
+// Aligned blocks: memalign(3), posix_memalign(3), aligned_alloc(3), valloc(3)
+// and pvalloc(3) are tracked like malloc(3).  An alignment of up to 16 bytes
+// is what every block gets anyway.  For a bigger one, glibc's memalign gives
+// the chunk and the header goes right below the aligned address, so the gap
+// in front of it is less than the alignment (and is all that's wasted).  The
+// word just in front of such a header says how far back glibc's chunk
+// starts - for any other block, that word is glibc's chunk size.  A realloc
+// of an aligned block copies it into a plain one.  malloc_usable_size(3)
+// returns the size that was asked for, the rest of the chunk holds the guard
+// bands.  free_sized() and free_aligned_sized() (C23, and what C++'s sized
+// delete uses) check the cap where the caller says the block ends, without
+// reading the size from the header, so a wrong size shows up as an over-run.
+// Pooled blocks and guard page ones know their size, it's compared instead.
+//
+// Event log: with pthreads, setting SML_EVENTLOG to a file name in the
+// environment records every tracked malloc, calloc, realloc and free as a
+// 32 byte record (struct mem_event) with the pointer, the size, the call site
+// and a TSC time stamp.  A thread adds its events to a ring of its own without
+// taking a lock, and a library thread copies the rings into the file (through
+// a window of it that's mapped with mmap(2)) every millisecond.  Events that
+// don't fit in a full ring are dropped, and the file says how many.  Nothing
+// is formatted in the hooks the way SML_PRINTF does it, smlEventDecode.c turns
+// the file into text afterwards.  Like the scanner, it stops in a child.
+//
 // Additional functions available:
 //   void mem_show_allocations (FILE *fp) - shows what's currently allocated
 //   int mem_get_alloc_count (void) - get the # of allocations
 //   size_t mem_get_usage (void) - amount of memory allocated by the callers
+//   size_t mem_get_peak_usage (void) - the most mem_get_usage() has been
 //   size_t mem_get_real_usage (void) - mem_get_usage() + all over-head
-//   void mem_check_integrity (void) - check all the boundaries
+//   void mem_check_integrity (void) - check all the boundaries, this is the
+//      only call (with mem_get_real_usage and mem_show_allocations) that walks
+//      every block
 //   void mem_ignore_current_allocations (void) - removes currently
 //      allocated blocks out of the linked list for tracking
+//   int mem_set_sample_interval (size_t sBytes) - change the mean number of
+//      bytes between samples, -1 if the program wasn't started sampling
+//   size_t mem_get_sample_interval (void) - 0 if every block is tracked
+//   unsigned long mem_get_scan_passes (void) - full passes the background
+//      scanner has made over the heap, 0 if it isn't running
+//   void mem_get_stats (struct mem_stats *stats) - totals, a log2 histogram
+//      of the live block sizes and (with TRACE) the call sites holding the
+//      most bytes.  With pthreads, also the threads holding the most bytes
+//      and how long MUTEX_LOCK has waited for a held mutex, in all and at
+//      most (these are printed at exit too).  None of it walks the blocks,
+//      it's kept as they come and go
+//   void mem_show_stats (FILE *fp) - prints mem_get_stats(), with the rates
+//      since it was last called.  With pthreads and SML_STATS_SIGUSR2 set in
+//      the environment, a SIGUSR2 prints it to stderr
+//   void mem_flush_events (void) - write out what's waiting in the event
+//      rings now, rather than on the next pass of the writer
+//   unsigned int mem_mark_generation (void) - start a new generation and
+//      return its number.  Every block remembers the generation it was
+//      allocated in (a realloc that moves it makes it a new one)
+//   void free_sized (void *vPtr, size_t size) - free(3) of a block whose
+//      size the caller knows
+//   void free_aligned_sized (void *vPtr, size_t alignment, size_t size) -
+//      the same for a block from aligned_alloc(3)
+//   void mem_report_since (FILE *fp, unsigned int uiGeneration) - the blocks
+//      allocated since that mark that are still live, by call site with the
+//      most bytes first.  Marking the generation once the program has warmed
+//      up and reporting now and then shows a slow leak without a restart, and
+//      nothing has to be ignored for it
 //
 // Glibc does internal allocations which it never frees, so you may see
 // some outstanding allocations when your code exits.  You can suppress
@@ -37,10 +170,12 @@
 //
 // !!NOTE!!
 //
-// If when using this little library you immediately get an abort() on startup
-// it's most likely a failure in internalStaticAlloc (size_t size).  Basically
-// calls can be made before we can use the internal allocators within glibc.
-// You can fix this by changing the size of ullStatic[]
+// Calls can be made before we can use the internal allocators within glibc
+// (C++ start up, and dlsym(3) itself).  internalStaticAlloc (size_t size)
+// serves those from a bootstrap arena, chunks of SML_BOOT_CHUNK bytes from
+// mmap(2) that are shared by all threads.  The arena is never given back -
+// free(3) just leaves its blocks alone, and realloc(3) copies them out into
+// a real block - but it's only used until init() has found glibc.
 ////////////////////////////////////////////////////////////////////////////////
 // This code is based off from this presentation:
 //    https://www.slideshare.net/tetsu.koba/tips-of-malloc-free
@@ -54,14 +189,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <malloc.h>
 #if (defined TRACE && TRACE==1)
 #include <execinfo.h>
 #endif //(defined TRACE && TRACE==1)
 #include <strings.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/queue.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 #include <pthread.h> // if this is commented out, pthread support is removed
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif //defined __SSE2__
 
 #ifndef __USE_GNU
 #define __USE_GNU 1
@@ -97,33 +244,380 @@ while (0)
 #define GUARD_BAND_TOP       (0xDEADBEEFCAFEF00DULL)
 #define GUARD_BAND_BOTTOM    (0x0CACAFECEBADC0DEULL)
 
-LIST_HEAD (listHead, memoryHeader) gp_listHead;
+// the word in front of the header of a block with a bigger alignment than
+// malloc(3)'s: this in the top half, and how far glibc's chunk starts before
+// the header in the bottom one.  Glibc's chunk sizes never get near these bits
+#define GUARD_ALIGNED        (0xA119ED0000000000ULL)
+#define GUARD_ALIGNED_MASK   (0xFFFFFFFF00000000ULL)
+
+// what every tracked block is aligned to anyway
+#define ALIGN_PLAIN          (sizeof (struct memoryHeader) % 16 == 0 ? 16 : 8)
+
+// a size to free with that isn't known, internalFree() finds it in the header
+#define SIZE_UNKNOWN         ((size_t) -1)
+
+// the end of a block is padded up to 8 bytes with the low byte of each pad
+// byte's address.  On a little endian machine the whole 8 byte word at an
+// aligned address "a" then reads as GUARD_TAIL_PATTERN + (a & 0xFF) * 0x01..01
+// (a & 0xFF is a multiple of 8, so no byte carries into the next one), and
+// the pad is checked or written with one masked compare
+#if (defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define GUARD_TAIL_WORD      1
+#else
+#define GUARD_TAIL_WORD      0
+#endif //(defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define GUARD_TAIL_PATTERN   (0x0706050403020100ULL)
+#define GUARD_TAIL_BYTES     (0x0101010101010101ULL)
+#define MEM_REGISTRY_MAX     (256) // must be a power of 2
+#define SML_BOOT_CHUNK       (256*1024)
+#define SML_BOOT_CHUNKS      (64)  // most chunks the bootstrap arena can have
+#define SML_BOOT_ALIGN       (16)  // what glibc's malloc(3) guarantees
+#define SML_COUNTER_BATCH    (64*1024)
+
+// a block's uiStackId is 0 if it was allocated inside the hooks, else the
+// index+1 of its call site or one of these
+#define STACK_ID_UNKNOWN      (0xFFFFFFFFU) // no TRACE, or the call site table is full
+#define STACK_ID_NO_BACKTRACE (0xFFFFFFFEU) // backtrace(3) didn't get as far as the caller
+#define STACK_ID_IS_SITE(id)  ((id) != 0 && (id) <= SML_CALLSITE_MAX)
+#define SML_TRACE_DEPTH       (32)
+#define SML_CALLSITE_MAX      (1 << 16) // must be a power of 2
+#define SML_CALLSITE_NAME_MAX (1024)
+#define SML_CALLSITE_ARENA    (64*1024)
+
+#define SML_SAMPLE_SET_BUCKETS (1 << 16) // must be a power of 2
+#define SML_SAMPLE_SET_WAYS    (8)       // pointers per bucket, one cache line
+#define SML_SAMPLE_SET_PROBES  (2)       // buckets a pointer can be in
+
+#define SML_GUARD_REGION_SIZE  (1ULL << 40) // address space reserved for guarded blocks
+
+#define SML_SHOW_BLOCKS        (4096)     // mem_show_allocations() copies this many at first
+#define SML_SCAN_BLOCKS        (4096)     // per time slice, unless set in the environment
+#define SML_SCAN_PASS_SLEEP    (10000000) // ns, the least to wait after each full pass
+
+#define SML_EVENT_RING         (16*1024)      // records per thread, must be a power of 2
+#define SML_EVENT_WINDOW       (16*1024*1024) // bytes of the file that are mapped at a time
+#define SML_EVENT_DRAIN        (1000000)      // ns between the writer's passes
+#define SML_EVENT_SYNC_EVERY   (100)          // passes between two MEM_EVENT_SYNC records
+
+#if (defined SML_POOL && SML_POOL==1 && defined _PTHREAD_H)
+#define SML_POOL_ENABLED 1
+#else
+#define SML_POOL_ENABLED 0
+#endif //(defined SML_POOL && SML_POOL==1 && defined _PTHREAD_H)
+
+#define SML_POOL_SLAB_SIZE   (64*1024)     // must be a power of 2
+#define SML_POOL_REGION_SIZE (16ULL << 30) // address space reserved for slabs
+#define SML_POOL_MAX_SIZE    (1024)        // larger blocks still go to glibc
+#define SML_POOL_CLASSES     (17)
+#define POOL_SLOT_GUARDS     ((MEM_HEADER_GUARD_LEN + MEM_CAP_GUARD_LEN) * sizeof (unsigned long long))
+#define POOL_NO_SLOT         (0xFFFFFFFFU)
+
+#define POOL_SLOT_FREE    (0)
+#define POOL_SLOT_USED    (1)
+#define POOL_SLOT_IGNORED (2) // by mem_ignore_current_allocations()
+#define POOL_SLOT_REMOTE  (3) // freed by another thread, the owner takes it back
+
+LIST_HEAD (listHead, memoryHeader);
+
+// allocation counters, in a thread cache these only have one writer (apart
+// from the llOther ones).  The first ones count what the thread did, the
+// llOwn and llOther ones count the blocks on its registry, whoever did it
+struct allocCounters
+{
+  long long llAllocCount;
+  long long llLiveBytes;
+  long long llUnpublished; // bytes not yet added to gll_publishedBytes
+  long long llAllocs;      // ever made, for the rates (the frees are what's not live)
+  long long llHistogram[MEM_STATS_BUCKETS]; // live blocks by statsBucket()
+  long long llOwnCount;    // changed by the owner, see countOwner()
+  long long llOwnBytes;
+  long long llOtherCount;  // changed by other threads, atomically
+  long long llOtherBytes;
+  long long llLockWaits;   // MUTEX_LOCKs that found the mutex held
+  long long llLockWaitNs;
+};
+
+// one shard of the allocation registry, kept on its own cache line so two
+// shards never share one between cores
+struct memoryRegistry
+{
+#ifdef _PTHREAD_H
+  pthread_mutex_t mutex;
+#endif //_PTHREAD_H
+  struct listHead listHead;
+  struct threadCache *cache; // NULL for the shared shards
+} __attribute__((aligned(64)));
+
 struct memoryHeader
 {
-  char *szAllocator;
+  struct memoryRegistry *registry;
+  unsigned int uiStackId; // 0 for blocks allocated inside the hooks
+  unsigned int uiGeneration;
   size_t size;
+  double dWeight;         // 1 over the chance it was sampled, 1 if every block is tracked
 #ifdef _PTHREAD_H
   pthread_t threadId;
 #endif //_PTHREAD_H
   LIST_ENTRY (memoryHeader) doubleLL;
+  struct memoryHeader *remoteNext; // != NULL once freed by a thread other than the owner
   unsigned long long ullFixedValues[MEM_HEADER_GUARD_LEN];
 };
 
+// a block of SML_GUARD_BYTES or more, at the start of its own span of pages.
+// The header is on the lists like any other, the caller's bytes are on pages
+// of their own that end at the guard page (or start after it)
+struct guardSpan
+{
+  struct memoryHeader head;
+  char *szData;  // the caller's bytes
+  size_t sData;  // the size rounded up to the alignment, the rest is the pad
+  size_t sSpan;  // everything that was mapped, the guard page included
+};
+
+// blocks freed by another thread stay on the owner's list until it gets to
+// them, but they are gone as far as the caller is concerned
+#define IS_REMOTE_FREED(ml) (__atomic_load_n (&(ml)->remoteNext, __ATOMIC_RELAXED) != NULL)
+
+// a generation from uiSince on, the counter is allowed to wrap
+#define GENERATION_SINCE(uiGeneration, uiSince) ((unsigned int) ((uiGeneration) - (uiSince)) < 0x80000000U)
+
+#ifdef _PTHREAD_H
+#define CACHE_ALIVE (0)
+#define CACHE_DEAD  (1)
+
+// terminates the remote free stack, so that remoteNext is never NULL for a
+// block that's waiting to be released by its owner
+#define REMOTE_FREE_END ((struct memoryHeader *) 1)
+
+// the registry of a single thread
+struct threadCache
+{
+  struct memoryRegistry registry;
+  struct memoryHeader *remoteFreeHead; // pushed by other threads, drained by anyone
+  struct threadCache *next;            // list of all caches, they are never freed
+  struct allocCounters counters;
+  int iState;                          // CACHE_ALIVE or CACHE_DEAD
+  pthread_t threadId;                  // current owner
+  int iTid;
+  char szName[16];                     // of the last owner, kept when it exits
+  struct eventRing *eventRing;         // made by the owner the first time it logs
+  unsigned short usIndex;              // the thread in the event log
+#if SML_POOL_ENABLED
+  struct poolSlab *poolSlabs[SML_POOL_CLASSES]; // the slab at the front has room
+#endif //SML_POOL_ENABLED
+};
+
+#define THREAD_CACHE_NONE     (0)
+#define THREAD_CACHE_CREATING (1)
+#define THREAD_CACHE_ACTIVE   (2)
+#define THREAD_CACHE_GONE     (3)
+#endif //_PTHREAD_H
+
 struct memoryCap
 {
   unsigned long long ullFixedValues[MEM_CAP_GUARD_LEN];
 };
 
+// what the header holds for a block, for a pool slot it's kept in the side
+// table of its slab
+struct poolSlot
+{
+  unsigned int uiSize;
+  unsigned int uiStackId;
+  unsigned int uiNext;  // free list and remote free stack, index+1 (0 ends it)
+  unsigned int uiState; // POOL_SLOT_*
+  unsigned int uiGeneration;
+};
+
+// a block mem_show_allocations() is going to print, copied out of a registry
+// while it's locked
+struct shownBlock
+{
+  void *vPtr;
+  size_t size;
+  double dWeight;
+  unsigned int uiStackId;
+};
+
+// what mem_report_since() adds up for each call site
+struct generationSite
+{
+  long long llCount;
+  long long llBytes;
+};
+
+// a slab of slots of one size class.  It belongs to one thread cache for
+// good, and is covered by that cache's registry mutex (apart from
+// uiRemoteFree).  The slots start at gui_poolDataOffset[uiClass]
+struct poolSlab
+{
+  struct poolSlab *next;      // the owner's slabs of this class
+  struct threadCache *cache;
+  unsigned int uiClass;
+  unsigned int uiFree;        // free list, index+1
+  unsigned int uiBump;        // slots from here on have never been used
+  unsigned int uiRemoteFree;  // freed by other threads, index+1
+  struct poolSlot slots[];
+};
+
+// in front of a block of the bootstrap arena, so realloc(3) knows how much
+// to copy out
+struct bootHeader
+{
+  size_t size;
+  size_t spare; // keeps the block on SML_BOOT_ALIGN
+};
+
+struct bootChunk
+{
+  char *szStart;
+  char *szEnd;
+};
+
+static struct memoryRegistry g_registry[MEM_REGISTRY_MAX];
+static unsigned int gui_registryMask=0;
+
 #ifdef _PTHREAD_H
-pthread_mutex_t g_mutex;
+static struct threadCache *gp_cacheList = NULL;
+static pthread_mutex_t g_cacheMutex;
+static pthread_key_t g_cacheKey;
+static __thread struct threadCache *gp_threadCache = NULL;
+static __thread int gi_threadCacheState = THREAD_CACHE_NONE;
 #endif //_PTHREAD_H
 
 static __thread int gi_hookDisabled=0;
-static int gi_allocCount=0;
+
+// the bootstrap arena, see internalStaticAlloc().  The chunks are only added
+// to, and a free(3) that isn't in gp_bootLow..gp_bootHigh never looks at them
+static struct bootChunk g_bootChunks[SML_BOOT_CHUNKS];
+static int gi_bootChunks = 0;
+static char *gp_bootNext = NULL;  // the unused part of the last chunk
+static char *gp_bootLow = NULL;
+static char *gp_bootHigh = NULL;
+static char gc_bootLock = 0;
+
+#if (defined _EXECINFO_H && _EXECINFO_H == 1)
+// one distinct allocation stack
+struct callSite
+{
+  unsigned long long ullHash; // 0 while the slot is free
+  int iDepth;
+  void *vFrames[SML_TRACE_DEPTH];
+  char *szName;               // filled in the first time it's reported
+  long long llLiveCount;      // of the blocks it allocated, for mem_get_stats()
+  long long llLiveBytes;
+};
+
+static struct callSite *gp_callSites = NULL;
+// the table entries in use, in the order they were added, so they can be
+// ranked without going through the whole table
+static unsigned int gui_callSiteOrder[SML_CALLSITE_MAX];
+static unsigned int gui_callSiteCount = 0;
+#ifdef _PTHREAD_H
+static pthread_mutex_t g_callSiteMutex;
+#endif //_PTHREAD_H
+#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+
+// sampling is only ever switched on in init(), see sampleThisAllocation()
+static int gi_sampling = 0;
+static size_t gs_sampleInterval = 0;
+static void **gp_sampledSet = NULL;
+static long gl_sampledLive = 0;
+static __thread long long gll_sampleCountdown = 0;
+static __thread unsigned long long gull_sampleRandom = 0;
+
+// guard pages are only switched on in init() too, see guardInit().  Spans
+// are handed out from the start of the region and never handed out again
+static char *gp_guardRegion = NULL;
+static unsigned long long gull_guardUsed = 0;
+static size_t gs_guardBytes = 0;   // 0 if there are no guarded blocks
+static size_t gs_pageSize = 0;
+static int gi_guardBefore = 0;
+
+#ifdef _PTHREAD_H
+// where the background scanner is in the walk.  Its place in a list is the
+// marker, which is on that list just like a block (of size 0, with valid
+// guard bands) so nothing else has to know about it
+struct scanMarker
+{
+  struct memoryHeader head;
+  struct memoryCap cap;
+};
+
+struct scanCursor
+{
+  struct memoryRegistry *registry; // NULL between passes
+  int iInPool;                     // done with the list, now the pool slots
+  struct poolSlab *slab;
+  unsigned int uiSlot;
+};
+
+static struct scanMarker g_scanMarker;
+static int gi_scanCpu = 0;         // 0 if the scanner isn't running
+static int gi_scanBlocks = SML_SCAN_BLOCKS;
+static unsigned long gul_scanPasses = 0;
+static sem_t g_statsSem;           // posted by the SIGUSR2 handler
+
+// the events of one thread.  Only the thread moves ullHead and only the
+// writer moves ullTail, so neither has to lock
+struct eventRing
+{
+  unsigned long long ullHead __attribute__((aligned(64)));
+  unsigned long long ullDropped; // lost since the last one that fit
+  unsigned long long ullTail __attribute__((aligned(64)));
+  struct mem_event events[SML_EVENT_RING] __attribute__((aligned(64)));
+};
+
+static int gi_eventLog = 0;        // set in init() once the file is open
+static int gi_eventFd = -1;
+static struct eventRing *gp_eventShared = NULL; // for threads without a cache
+static pthread_mutex_t g_eventSharedMutex;      // its producers
+static pthread_mutex_t g_eventMutex;            // the writer's side of every ring
+static char *gp_eventWindow = NULL;
+static unsigned long long gull_eventWindowStart = 0; // offset of the window in the file
+static size_t gs_eventWindowUsed = 0;
+#if (defined _EXECINFO_H && _EXECINFO_H == 1)
+static unsigned int gui_eventSites = 0;         // call site names written so far
+#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+static unsigned short gus_cacheCount = 0;
+#define IS_SCAN_MARKER(ml) ((ml) == &g_scanMarker.head)
+#else
+#define IS_SCAN_MARKER(ml) (0)
+#endif //_PTHREAD_H
+
+#if SML_POOL_ENABLED
+// the size of the caller's block each class holds, a slot adds the guards
+static const unsigned int gui_poolClassSize[SML_POOL_CLASSES] =
+{
+  16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 256, 320, 384, 512, 640, 768, 1024
+};
+static unsigned char guc_poolClass[SML_POOL_MAX_SIZE/16 + 1]; // by (size+15)/16
+static unsigned int gui_poolSlots[SML_POOL_CLASSES];
+static unsigned int gui_poolDataOffset[SML_POOL_CLASSES];
+static char *gp_poolRegion = NULL;
+static unsigned long long gull_poolSlabsUsed = 0;
+#endif //SML_POOL_ENABLED
+
+// what threads without a cache count into (updated atomically), how much has
+// been handed to mem_ignore_current_allocations(), and the batched total that
+// the peak is taken from
+static struct allocCounters g_sharedCounters;
+static struct allocCounters g_ignoredCounters;
+#ifdef _PTHREAD_H
+static struct allocCounters g_exitedCounters; // what the earlier owners of reused caches did
+#endif //_PTHREAD_H
+static long long gll_publishedBytes=0;
+static long long gll_peakBytes=0;
+#ifdef _PTHREAD_H
+static long long gll_lockWaitMaxNs=0;
+#endif //_PTHREAD_H
+static unsigned int gui_generation=0; // see mem_mark_generation()
 static void * (*gp_orgMalloc)  (size_t size)              = NULL;
 static void   (*gp_orgFree)    (void *ptr)                = NULL;
 static void * (*gp_orgCalloc)  (size_t nmeb, size_t size) = NULL;
 static void * (*gp_orgRealloc) (void *ptr, size_t size)   = NULL;
+static size_t (*gp_orgUsableSize) (void *ptr)             = NULL;
+static void * (*gp_orgMemalign) (size_t alignment, size_t size) = NULL;
 
 void static init (void) __attribute__((constructor)); // initialize this library
 void static end  (void) __attribute__((destructor));  // check for any outstanding allocs
@@ -131,8 +625,10 @@ void static end  (void) __attribute__((destructor));  // check for any outstandi
 #if (defined SML_PRINTF && SML_PRINTF==1)
 #undef SML_PRINTF
 #define SML_PRINTF(...) printf (__VA_ARGS__)
+#define SML_PRINTF_ENABLED 1
 #else
 #define SML_PRINTF(...)
+#define SML_PRINTF_ENABLED 0
 #endif //(defined SML_PRINTF && SML_PRINTF==1)
 
 #ifdef _PTHREAD_H
@@ -152,6 +648,7 @@ do                                      \
   }                                     \
 } while (0)
 
+// only a lock that has to wait is timed, see mutexWait()
 #define MUTEX_LOCK(mp)                  \
 do                                      \
 {                                       \
@@ -159,10 +656,9 @@ do                                      \
   {                                     \
     SML_PRINTF ("MUTEX_LOCK\n");        \
   }                                     \
-  if (pthread_mutex_lock(mp) != 0)      \
+  if (pthread_mutex_trylock(mp) != 0)   \
   {                                     \
-    perror("pthread_mutex_lock");       \
-    abort ();                           \
+    mutexWait (mp);                     \
   }                                     \
 } while (0)
 
@@ -203,313 +699,3526 @@ do                                      \
 
 static void init (void);
 static void end (void);
-static char *trace (int iLen, unsigned ucGetPtr);
+static unsigned int trace (int iLen);
+static const char *getStackName (unsigned int uiStackId);
 static struct memoryHeader *verifyIntegrity (void *vPtr);
-static void *internalRealloc (void *vPtr, size_t size, size_t nmemb, unsigned char type);
-static void internalFree (void *vPtr, int iLen);
+static int guardsIntact (void *vPtr, size_t size);
+static void verifyGuards (void *vPtr, size_t size);
+static void verifyGuardsSlow (void *vPtr, size_t size);
+static void writeGuards (void *vPtr, size_t size);
+static void prefetchNext (struct memoryHeader *ml);
+static void showBlock (FILE *fp, int *iCount, int iAllocCount, void *vPtr,
+                       size_t size, double dWeight, unsigned int uiStackId);
+static struct memoryRegistry *getRegistry (struct memoryHeader *mHead);
+static struct memoryRegistry *registryNext (struct memoryRegistry *registry);
+static void registryInsert (struct memoryHeader *mHead);
+static int registryRemove (struct memoryHeader *mHead);
+static void registryRelink (struct memoryHeader *mHead);
+static int registryRemoteFree (struct memoryHeader *mHead);
+static void countAlloc (unsigned int uiStackId, size_t size, long long llCount, long long llBytes,
+                        struct memoryRegistry *owner);
+static void countOwner (struct memoryRegistry *owner, struct threadCache *self,
+                        long long llCount, long long llBytes);
+static void updatePeak (long long llBytes);
+static void sumCounters (struct allocCounters *total);
+#ifdef _PTHREAD_H
+static void mutexWait (pthread_mutex_t *mp);
+static void threadName (int iTid, char *szName);
+static struct threadCache *getThreadCache (void);
+static void releaseThreadCache (void *vCache);
+static void drainRemoteFrees (struct threadCache *cache);
+static int startThread (void *(*fnThread) (void *));
+static void scanStart (void);
+static void statsStart (void);
+static void eventOpen (const char *szFile);
+static void eventStart (void);
+static void eventFinish (void);
+#endif //_PTHREAD_H
+static void eventLog (unsigned char ucOp, const void *vPtr, size_t size, unsigned int uiStackId);
+static double sampleWeight (size_t size);
+static void estimate (size_t size, double dWeight, long long *llCount, long long *llBytes);
+static int sampledSetInsert (void *vPtr);
+static void **sampledSetFind (void *vPtr);
+static int sampledSetRemove (void *vPtr);
+static void *sampledAlloc (size_t size, size_t nmemb, unsigned char type, size_t alignment, int iLen);
+static void *sampledRealloc (void *vPtr, size_t size, int iLen);
+static void guardInit (size_t sBytes);
+static int guardOwns (void *vPtr);
+static struct memoryHeader *guardMap (size_t size, size_t alignment);
+static struct memoryHeader *guardVerify (void *vPtr);
+static void guardWritePad (struct memoryHeader *mHead);
+static void guardRelease (struct memoryHeader *mHead);
+static void *blockData (struct memoryHeader *mHead);
+static void blockRelease (struct memoryHeader *mHead);
+#if SML_POOL_ENABLED
+static void poolInit (void);
+#endif //SML_POOL_ENABLED
+static int poolOwns (void *vPtr);
+static void *poolAlloc (size_t size, unsigned char type, int iLen);
+static void *poolRealloc (void *vPtr, size_t size, int iLen);
+static void poolFree (void *vPtr, size_t sizeHint);
+static struct poolSlot *poolNext (struct memoryRegistry *registry, struct poolSlab **slab,
+                                  unsigned int *uiSlot, void **vPtr);
+static size_t poolUsableSize (void *vPtr);
+static void *blockBase (struct memoryHeader *mHead);
+static int reallocInPlace (struct memoryHeader *mHead, size_t size);
+static void *internalRealloc (void *vPtr, size_t size, size_t nmemb, unsigned char type,
+                              double dWeight, size_t alignment, int iLen);
+static void *internalStaticAlloc (size_t size);
+static void *bootAligned (size_t alignment, size_t size);
+static int bootOwns (void *vPtr);
+static void *bootRealloc (void *vPtr, size_t size);
+static void internalFree (void *vPtr, size_t sizeHint, int iLen);
+static void *alignedAlloc (size_t alignment, size_t size, int iLen);
 
 static void init (void)
 {
-  // only realloc and free are actually used, but I keep pointers to all
-  gp_orgMalloc  = (void* (*)(long unsigned int)) dlsym (RTLD_NEXT, "malloc");
+  long lCores;
+  unsigned int uiShards;
+  unsigned int ui;
+  char *szSample;
+  char *szGuard;
+#ifdef _PTHREAD_H
+  char *szScan;
+  char *szEvents;
+#endif //_PTHREAD_H
+
+  // one shard per core, rounded up to a power of 2 so the hash can be masked.
+  // This is done before dlsym(3) is called, so any allocation that sysconf(3)
+  // makes is still served by internalStaticAlloc()
+  lCores = sysconf (_SC_NPROCESSORS_ONLN);
+  for (uiShards = 1 ;
+       uiShards < MEM_REGISTRY_MAX && (long) uiShards < lCores ;
+       uiShards <<= 1)
+  {
+  }
+  for (ui = 0 ; ui < uiShards ; ui++)
+  {
+    MUTEX_INIT (&g_registry[ui].mutex);
+    LIST_INIT (&g_registry[ui].listHead);
+  }
+  gui_registryMask = uiShards - 1;
+
+  // getenv(3) doesn't allocate, so this can be done before dlsym(3) as well
+  szSample = getenv ("SML_SAMPLE_BYTES");
+  if (szSample != NULL && strtoull (szSample, NULL, 0) > 0)
+  {
+    // the set is touched a page at a time, untouched pages read as zeros
+    gp_sampledSet = (void **) mmap (NULL, SML_SAMPLE_SET_BUCKETS * SML_SAMPLE_SET_WAYS * sizeof (void *),
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (gp_sampledSet != MAP_FAILED)
+    {
+      gs_sampleInterval = (size_t) strtoull (szSample, NULL, 0);
+      gi_sampling = 1;
+    }
+    else
+    {
+      gp_sampledSet = NULL;
+    }
+  }
+  szGuard = getenv ("SML_GUARD_BYTES");
+  if (szGuard != NULL && strtoull (szGuard, NULL, 0) > 0)
+  {
+    guardInit ((size_t) strtoull (szGuard, NULL, 0));
+  }
+#if (defined _EXECINFO_H && _EXECINFO_H == 1)
+  // the call site table is touched a page at a time as it fills up
+  gp_callSites = (struct callSite *) mmap (NULL, SML_CALLSITE_MAX * sizeof (struct callSite),
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (gp_callSites == MAP_FAILED)
+  {
+    gp_callSites = NULL;
+  }
+  MUTEX_INIT (&g_callSiteMutex);
+#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+#ifdef _PTHREAD_H
+  MUTEX_INIT (&g_cacheMutex);
+  if (pthread_key_create (&g_cacheKey, releaseThreadCache) != 0)
+  {
+    perror ("pthread_key_create");
+    abort ();
+  }
+#endif //_PTHREAD_H
+#if SML_POOL_ENABLED
+  poolInit ();
+#endif //SML_POOL_ENABLED
+#ifdef _PTHREAD_H
+  // open(2) and mmap(2) don't allocate, so the log is ready for the first
+  // malloc(3).  Only its writer has to wait for pthread_create(3)
+  szEvents = getenv ("SML_EVENTLOG");
+  if (szEvents != NULL && szEvents[0] != '\0')
+  {
+    eventOpen (szEvents);
+  }
+#endif //_PTHREAD_H
+
+  // the tracked blocks only need realloc, free and malloc_usable_size (and
+  // malloc while sampling), but I keep pointers to all.  Each wrapper uses
+  // the bootstrap arena until its own pointer is set, so malloc goes last -
+  // by then everything it leads to is there
   gp_orgFree    = (void  (*)(void*)) dlsym (RTLD_NEXT, "free");
-  gp_orgCalloc  = (void* (*)(long unsigned int, long unsigned int)) dlsym (RTLD_NEXT, "calloc");
+  gp_orgUsableSize = (size_t (*)(void*)) dlsym (RTLD_NEXT, "malloc_usable_size");
   gp_orgRealloc = (void* (*)(void*, long unsigned int)) dlsym (RTLD_NEXT, "realloc");
-  MUTEX_INIT (&g_mutex);
+  gp_orgCalloc  = (void* (*)(long unsigned int, long unsigned int)) dlsym (RTLD_NEXT, "calloc");
+  gp_orgMemalign = (void* (*)(size_t, size_t)) dlsym (RTLD_NEXT, "memalign");
+  gp_orgMalloc  = (void* (*)(long unsigned int)) dlsym (RTLD_NEXT, "malloc");
 
-  LIST_INIT (&gp_listHead);
   malloc (0);
+
+#ifdef _PTHREAD_H
+  // only now, pthread_create(3) allocates
+  szScan = getenv ("SML_SCAN_CPU");
+  if (szScan != NULL && atoi (szScan) > 0)
+  {
+    gi_scanCpu = atoi (szScan) > 100 ? 100 : atoi (szScan);
+    szScan = getenv ("SML_SCAN_BLOCKS");
+    if (szScan != NULL && atoi (szScan) > 0)
+    {
+      gi_scanBlocks = atoi (szScan);
+    }
+    scanStart ();
+  }
+  if (getenv ("SML_STATS_SIGUSR2") != NULL)
+  {
+    statsStart ();
+  }
+  if (gi_eventLog)
+  {
+    eventStart ();
+  }
+#endif //_PTHREAD_H
 }
 
-int mem_get_alloc_count (void)
+static struct memoryRegistry *getRegistry (struct memoryHeader *mHead)
 {
-  return gi_allocCount;
+  unsigned long long ullHash;
+
+  // the low bits of a heap address are always the same, so drop them and
+  // spread the rest with a multiplicative (Fibonacci) hash before masking
+  ullHash = ((unsigned long long) mHead) >> 4;
+  ullHash *= 0x9E3779B97F4A7C15ULL;
+
+  return &g_registry[(ullHash >> 32) & gui_registryMask];
 }
 
-size_t mem_get_usage (void)
+// iterate over every registry, the shards first and then every thread cache.
+// Pass NULL to get the first one, NULL is returned after the last one
+static struct memoryRegistry *registryNext (struct memoryRegistry *registry)
 {
-  struct memoryHeader *ml;
-  size_t size=0;
+#ifdef _PTHREAD_H
+  struct threadCache *cache;
+#endif //_PTHREAD_H
+
+  if (registry == NULL)
+  {
+    return &g_registry[0];
+  }
 
-  MUTEX_LOCK (&g_mutex);
-  for (ml = gp_listHead.lh_first ;
-       ml != NULL ;
-       ml = ml->doubleLL.le_next)
+  if (registry->cache == NULL)
   {
-    verifyIntegrity (ml+1);
-    if (ml->szAllocator != NULL)
+    if (registry < &g_registry[gui_registryMask])
     {
-      size += ml->size;
+      return registry+1;
     }
+#ifdef _PTHREAD_H
+    cache = __atomic_load_n (&gp_cacheList, __ATOMIC_ACQUIRE);
+#else
+    return NULL;
+#endif //_PTHREAD_H
+  }
+#ifdef _PTHREAD_H
+  else
+  {
+    cache = registry->cache->next;
   }
-  MUTEX_UNLOCK (&g_mutex);
 
-  return size;
+  if (cache != NULL)
+  {
+    // what's been freed into it is left for its owner to release, the
+    // walkers skip those blocks
+    return &cache->registry;
+  }
+#endif //_PTHREAD_H
+
+  return NULL;
 }
 
-size_t mem_get_real_usage (void)
+static void registryInsert (struct memoryHeader *mHead)
 {
-  struct memoryHeader *ml;
-  size_t size=0;
+  struct memoryRegistry *registry = NULL;
 
-  MUTEX_LOCK (&g_mutex);
-  for (ml = gp_listHead.lh_first ;
-       ml != NULL ;
-       ml = ml->doubleLL.le_next)
+#ifdef _PTHREAD_H
+  struct threadCache *cache = getThreadCache ();
+
+  if (cache != NULL)
+  {
+    registry = &cache->registry;
+  }
+  else
+#endif //_PTHREAD_H
   {
-    verifyIntegrity (ml+1);
-    size += ml->size + sizeof(struct memoryHeader) + sizeof(struct memoryCap);
+    registry = getRegistry (mHead);
   }
-  MUTEX_UNLOCK (&g_mutex);
 
-  return size;
+  // the registry is remembered, the address may not be valid to hash again
+  // by the time the block is removed (realloc)
+  mHead->registry = registry;
+  mHead->remoteNext = NULL;
+  mHead->doubleLL.le_next = NULL;
+  mHead->doubleLL.le_prev = NULL;
+  MUTEX_LOCK (&registry->mutex);
+  LIST_INSERT_HEAD (&registry->listHead, mHead, doubleLL);
+  MUTEX_UNLOCK (&registry->mutex);
 }
 
-void mem_check_integrity (void)
+// returns 1 if the block was on a list, 0 if it has been ignored
+static int registryRemove (struct memoryHeader *mHead)
 {
-  struct memoryHeader *ml;
+  struct memoryRegistry *registry = mHead->registry;
+  int iLinked = 0;
 
-  MUTEX_LOCK (&g_mutex);
-  for (ml = gp_listHead.lh_first ;
-       ml != NULL ;
-       ml = ml->doubleLL.le_next)
+  // blocks taken out by mem_ignore_current_allocations() have a NULL le_prev
+  MUTEX_LOCK (&registry->mutex);
+  if (mHead->doubleLL.le_prev != NULL)
   {
-    verifyIntegrity (ml+1);
+    LIST_REMOVE (mHead, doubleLL);
+    mHead->doubleLL.le_prev = NULL;
+    iLinked = 1;
   }
-  MUTEX_UNLOCK (&g_mutex);
+  MUTEX_UNLOCK (&registry->mutex);
+
+  return iLinked;
 }
 
-void mem_ignore_current_allocations (void)
+// undo registryRemove(): the block goes back on the list it came off, so it
+// stays in the counts of the thread it was counted in
+static void registryRelink (struct memoryHeader *mHead)
 {
-  struct memoryHeader *ml;
+  struct memoryRegistry *registry = mHead->registry;
 
-  MUTEX_LOCK (&g_mutex);
-  for (ml = gp_listHead.lh_first ;
-       ml != NULL ;
-       ml = ml->doubleLL.le_next)
-  {
-    LIST_REMOVE (ml, doubleLL);
-    ml->doubleLL.le_prev = NULL;
-  }
-  gi_allocCount = 0;
-  MUTEX_UNLOCK (&g_mutex);
+  MUTEX_LOCK (&registry->mutex);
+  LIST_INSERT_HEAD (&registry->listHead, mHead, doubleLL);
+  MUTEX_UNLOCK (&registry->mutex);
 }
 
-void mem_show_allocations (FILE *fp)
+// hand a block that's being freed back to the thread which owns it, returns 0
+// if the caller has to unlink and release the block itself
+static int registryRemoteFree (struct memoryHeader *mHead)
 {
-  struct memoryHeader *ml;
-  int iCount=0;
+#ifdef _PTHREAD_H
+  struct threadCache *cache = mHead->registry->cache;
+  struct memoryHeader *mOld;
 
-  MUTEX_LOCK (&g_mutex);
-  for (ml = gp_listHead.lh_first ;
-       ml != NULL ;
-       ml = ml->doubleLL.le_next)
+  if (cache == NULL || cache == gp_threadCache ||
+      __atomic_load_n (&cache->iState, __ATOMIC_ACQUIRE) != CACHE_ALIVE)
   {
-    verifyIntegrity (ml+1);
-    if (ml->szAllocator != NULL && ml->size != 0)
-    {
-      if (iCount++==0)
-      {
-        // write a header
-        fprintf (fp, "\n");
-        int iLen = fprintf (fp, "%d block%s remains allocated\n",
-                            gi_allocCount, gi_allocCount != 1 ? "s":"");
-        while (--iLen > 0)
-        {
-          fprintf (fp, "-");
-        }
-        fprintf (fp, "\n");
-      }
-      fprintf (fp, "  Address %p size of %zu, allocated by \"%s\"\n",
-               ml->ullFixedValues+MEM_HEADER_GUARD_LEN, ml->size, ml->szAllocator);
-    }
+    return 0;
   }
 
-  if (iCount != 0)
+  // Treiber stack push - there's no pop, the whole stack is taken at once
+  // by drainRemoteFrees(), so there's no ABA problem to worry about
+  mOld = __atomic_load_n (&cache->remoteFreeHead, __ATOMIC_RELAXED);
+  do
   {
-    fprintf (fp, "\n");
-  }
-  else
+    __atomic_store_n (&mHead->remoteNext, mOld, __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n (&cache->remoteFreeHead, &mOld, mHead, 1,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+  // the owner may have exited since it was looked at, after its last drain:
+  // then nobody else is going to release it
+  if (__atomic_load_n (&cache->iState, __ATOMIC_SEQ_CST) != CACHE_ALIVE)
   {
-    fprintf (fp, "No memory allocations currently\n");
+    drainRemoteFrees (cache);
   }
-  MUTEX_UNLOCK (&g_mutex);
-}
-
-static void end (void)
-{
-  mem_show_allocations (stderr);
-  mem_check_integrity ();
-  MUTEX_DESTROY (&g_mutex);
+  return 1;
+#else
+  (void) mHead;
+  return 0;
+#endif //_PTHREAD_H
 }
 
-#if (defined _EXECINFO_H && _EXECINFO_H == 1)
-static size_t getFunction (char *szDst, size_t sOffset, char *szSrc, size_t sMax)
+#ifdef _PTHREAD_H
+static struct threadCache *getThreadCache (void)
 {
-  size_t sSrc;
-  size_t sDst=sOffset;
-  int iMode=0;
+  struct threadCache *cache;
 
-  for (sSrc = 0 ; szSrc[sSrc] != '\0' ; sSrc++)
+  if (gi_threadCacheState == THREAD_CACHE_ACTIVE)
   {
-    if (sDst == sMax)
+    if (gp_threadCache->remoteFreeHead != REMOTE_FREE_END)
     {
-      szDst[sMax-1] = '\0';
-
-      break;
+      drainRemoteFrees (gp_threadCache);
     }
+    return gp_threadCache;
+  }
+  else if (gi_threadCacheState != THREAD_CACHE_NONE)
+  {
+    // being created (pthread_setspecific(3) can allocate) or already gone,
+    // either way use the shards
+    return NULL;
+  }
+  gi_threadCacheState = THREAD_CACHE_CREATING;
 
-    switch (szSrc[sSrc])
+  // pick up the cache of a thread that has exited, or make a new one.  The
+  // caches come from mmap(2) so they don't show up as allocations
+  MUTEX_LOCK (&g_cacheMutex);
+  for (cache = gp_cacheList ; cache != NULL ; cache = cache->next)
+  {
+    if (cache->iState == CACHE_DEAD)
     {
-    case '(' :
-      iMode = 1;
       break;
-    case '\0' :
-    case ')' :
-      iMode = 2;
-      if (sDst < sMax)
-      {
-        szDst[sDst++] = '<';
-      }
-      if (sDst < sMax)
-      {
-        szDst[sDst++] = '<';
-      }
-      if (sDst < sMax)
-      {
-        szDst[sDst++] = '-';
-      }
-      break;
-    default:
-      if (iMode == 1 && sDst < sMax)
-      {
-        szDst[sDst++] = szSrc[sSrc];
-      }
     }
   }
-
-  return sDst;
-}
-
-static char *trace (int iLen, unsigned ucGetPtr)
-{
-  char *szPtr=NULL;
-  int nptrs;
-  char **strings;
-  void *buffer[200];
-
-  nptrs = backtrace(buffer, sizeof(buffer)/sizeof(buffer[0]));
-
-  strings = backtrace_symbols(buffer, nptrs);
-  if (strings == NULL)
-  {
-    perror("backtrace_symbols");
-    exit(EXIT_FAILURE);
-  }
-
-  if (ucGetPtr == 0)
+  if (cache == NULL)
   {
-    int j;
-    for (j = 0; j < nptrs; j++)
+    cache = (struct threadCache *) mmap (NULL, sizeof (struct threadCache),
+                                         PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED)
     {
-      SML_PRINTF("TRACE> %s\n", strings[j]);
+      MUTEX_UNLOCK (&g_cacheMutex);
+      gi_threadCacheState = THREAD_CACHE_GONE;
+      return NULL;
     }
+    MUTEX_INIT (&cache->registry.mutex);
+    LIST_INIT (&cache->registry.listHead);
+    cache->registry.cache = cache;
+    cache->remoteFreeHead = REMOTE_FREE_END;
+    cache->usIndex = gus_cacheCount++;
+    cache->next = gp_cacheList;
+    __atomic_store_n (&gp_cacheList, cache, __ATOMIC_RELEASE);
   }
   else
   {
-    const size_t maxSize = 1024;
-    int i;
-    size_t sPos = 0;
+    // the blocks on its registry stay with the cache, but what the thread
+    // that had it did goes to the exited threads
+    __atomic_add_fetch (&g_exitedCounters.llAllocs, cache->counters.llAllocs, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&g_exitedCounters.llLockWaits, cache->counters.llLockWaits, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&g_exitedCounters.llLockWaitNs, cache->counters.llLockWaitNs, __ATOMIC_RELAXED);
+    __atomic_store_n (&cache->counters.llAllocs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&cache->counters.llLockWaits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&cache->counters.llLockWaitNs, 0, __ATOMIC_RELAXED);
+  }
+  cache->threadId = pthread_self ();
+  cache->iTid = (int) syscall (SYS_gettid);
+  __atomic_store_n (&cache->iState, CACHE_ALIVE, __ATOMIC_RELEASE);
+  MUTEX_UNLOCK (&g_cacheMutex);
 
-    szPtr = (char *)realloc (szPtr, maxSize);
-    ASSERT (szPtr != NULL, "szPtr is NULL");
-    for (i = iLen-1; i < nptrs; i++)
-    {
-      sPos = getFunction (szPtr, sPos, strings[i], maxSize);
-    }
+  // anything its last owner left in it is ours to release now
+  drainRemoteFrees (cache);
 
-    if (sPos != 0)
-    {
-      szPtr[sPos-3] = '\0';
-      szPtr = (char *)realloc (szPtr, sPos-2);
-    }
-    else
+  if (pthread_setspecific (g_cacheKey, cache) != 0)
+  {
+    perror ("pthread_setspecific");
+    abort ();
+  }
+  gp_threadCache = cache;
+  gi_threadCacheState = THREAD_CACHE_ACTIVE;
+  eventLog (MEM_EVENT_THREAD, (void *) pthread_self (), (size_t) cache->iTid, 0);
+
+  return cache;
+}
+
+// pthread key destructor, called when the thread exits
+static void releaseThreadCache (void *vCache)
+{
+  struct threadCache *cache = (struct threadCache *) vCache;
+
+  // the name is gone from /proc once it has exited
+  threadName (cache->iTid, cache->szName);
+
+  // from here on this thread allocates into the shards, and frees of its
+  // blocks (even by itself) are done directly under the cache mutex
+  gp_threadCache = NULL;
+  gi_threadCacheState = THREAD_CACHE_GONE;
+  // sequentially consistent, with the push in registryRemoteFree(): either
+  // the drain below sees the block, or the thread freeing it sees this
+  __atomic_store_n (&cache->iState, CACHE_DEAD, __ATOMIC_SEQ_CST);
+
+  drainRemoteFrees (cache);
+}
+
+// MUTEX_LOCK() of a mutex that's held: wait for it, and count the wait for
+// this thread and the longest of anyone's.  An uncontended lock never gets
+// here, so it doesn't pay for the clock
+static void mutexWait (pthread_mutex_t *mp)
+{
+  struct allocCounters *counters = &g_sharedCounters;
+  struct timespec tsStart;
+  struct timespec tsEnd;
+  long long llNs;
+  long long llMax;
+
+  clock_gettime (CLOCK_MONOTONIC, &tsStart);
+  if (pthread_mutex_lock (mp) != 0)
+  {
+    perror ("pthread_mutex_lock");
+    abort ();
+  }
+  clock_gettime (CLOCK_MONOTONIC, &tsEnd);
+  llNs = (long long) (tsEnd.tv_sec - tsStart.tv_sec) * 1000000000LL + (tsEnd.tv_nsec - tsStart.tv_nsec);
+
+  if (gi_threadCacheState == THREAD_CACHE_ACTIVE)
+  {
+    counters = &gp_threadCache->counters;
+    __atomic_store_n (&counters->llLockWaits, counters->llLockWaits + 1, __ATOMIC_RELAXED);
+    __atomic_store_n (&counters->llLockWaitNs, counters->llLockWaitNs + llNs, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_add_fetch (&counters->llLockWaits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&counters->llLockWaitNs, llNs, __ATOMIC_RELAXED);
+  }
+
+  llMax = __atomic_load_n (&gll_lockWaitMaxNs, __ATOMIC_RELAXED);
+  while (llNs > llMax &&
+         !__atomic_compare_exchange_n (&gll_lockWaitMaxNs, &llMax, llNs, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+  }
+}
+
+// the comm of a thread of this process, read with open(2) and read(2) so
+// nothing is allocated
+static void threadName (int iTid, char *szName)
+{
+  char szPath[64];
+  ssize_t sLen = 0;
+  int iFd;
+
+  snprintf (szPath, sizeof (szPath), "/proc/self/task/%d/comm", iTid);
+  iFd = open (szPath, O_RDONLY | O_CLOEXEC);
+  if (iFd >= 0)
+  {
+    sLen = read (iFd, szName, 15);
+    close (iFd);
+  }
+  if (sLen < 0)
+  {
+    sLen = 0;
+  }
+  if (sLen > 0 && szName[sLen-1] == '\n')
+  {
+    sLen--;
+  }
+  szName[sLen] = '\0';
+}
+
+// unlink and release the blocks other threads have freed into this cache.
+// Anyone may call this, but not with the cache mutex held
+static void drainRemoteFrees (struct threadCache *cache)
+{
+  struct memoryHeader *mHead;
+  struct memoryHeader *mNext;
+
+  mHead = __atomic_exchange_n (&cache->remoteFreeHead, REMOTE_FREE_END, __ATOMIC_SEQ_CST);
+  if (mHead == REMOTE_FREE_END)
+  {
+    return;
+  }
+
+  MUTEX_LOCK (&cache->registry.mutex);
+  for (mNext = mHead ; mNext != REMOTE_FREE_END ; mNext = mNext->remoteNext)
+  {
+    if (mNext->doubleLL.le_prev != NULL)
+    {
+      LIST_REMOVE (mNext, doubleLL);
+      mNext->doubleLL.le_prev = NULL;
+    }
+  }
+  MUTEX_UNLOCK (&cache->registry.mutex);
+
+  for ( ; mHead != REMOTE_FREE_END ; mHead = mNext)
+  {
+    mNext = mHead->remoteNext;
+    blockRelease (mHead);
+  }
+}
+
+// a bad block found by the scanner.  The allocating thread is named first,
+// then verifyGuardsSlow() says what's wrong with it and aborts
+static void scanReport (void *vPtr, size_t size, unsigned int uiStackId, pthread_t threadId)
+{
+  fprintf (stderr, "\nBackground scan: block %p of %zu bytes, allocated by thread 0x%lx at \"%s\", is corrupt\n",
+           vPtr, size, (unsigned long) threadId,
+           uiStackId != 0 ? getStackName (uiStackId) : "(inside the hooks)");
+  verifyGuardsSlow (vPtr, size);
+}
+
+// check up to iMax blocks of the cursor's registry, the list first and then
+// its pool slots, and move the cursor on.  Returns how many were looked at,
+// *iPassDone is set once the last registry is done
+static int scanStep (struct scanCursor *cursor, int iMax, int *iPassDone)
+{
+  struct memoryRegistry *registry;
+  struct memoryHeader *marker = &g_scanMarker.head;
+  struct memoryHeader *ml;
+  struct memoryHeader *mLast = NULL;
+  struct poolSlot *slot = NULL;
+  void *vBlock;
+  int iCount = 0;
+
+  if (cursor->registry == NULL)
+  {
+    cursor->registry = registryNext (NULL);
+    cursor->iInPool = 0;
+    cursor->slab = NULL;
+  }
+  registry = cursor->registry;
+
+  MUTEX_LOCK (&registry->mutex);
+  if (!cursor->iInPool)
+  {
+    // carry on after the marker, unless this is a new registry or
+    // mem_ignore_current_allocations() has taken the marker out with the rest
+    if (marker->registry == registry && marker->doubleLL.le_prev != NULL)
+    {
+      ml = marker->doubleLL.le_next;
+      LIST_REMOVE (marker, doubleLL);
+      marker->doubleLL.le_prev = NULL;
+    }
+    else
+    {
+      ml = registry->listHead.lh_first;
+      marker->registry = registry;
+    }
+
+    for ( ; ml != NULL && iCount < iMax ; ml = ml->doubleLL.le_next, iCount++)
+    {
+      prefetchNext (ml);
+      // a block freed by another thread was checked then, and it's not the
+      // caller's any more.  A guarded one has its guard page instead
+      if (!IS_REMOTE_FREED (ml) && !guardOwns (ml) && !guardsIntact (ml+1, ml->size))
+      {
+        scanReport (ml+1, ml->size, ml->uiStackId, ml->threadId);
+      }
+      mLast = ml;
+    }
+
+    if (ml != NULL)
+    {
+      LIST_INSERT_AFTER (mLast, marker, doubleLL);
+    }
+    else
+    {
+      cursor->iInPool = 1;
+    }
+  }
+
+  // the slabs are never freed, so the place in them stays good while the
+  // mutex isn't held.  A slab that's moved to the front of its list in the
+  // mean time may be missed, it's checked on the next pass
+  if (cursor->iInPool)
+  {
+    while (iCount < iMax &&
+           (slot = poolNext (registry, &cursor->slab, &cursor->uiSlot, &vBlock)) != NULL)
+    {
+      if (!guardsIntact (vBlock, slot->uiSize))
+      {
+        scanReport (vBlock, slot->uiSize, slot->uiStackId, cursor->slab->cache->threadId);
+      }
+      iCount++;
+    }
+  }
+  MUTEX_UNLOCK (&registry->mutex);
+
+  if (cursor->iInPool && slot == NULL)
+  {
+    cursor->registry = registryNext (registry);
+    cursor->iInPool = 0;
+    cursor->slab = NULL;
+    *iPassDone = cursor->registry == NULL;
+  }
+
+  return iCount;
+}
+
+// a batch of blocks, then a sleep that's long enough to keep the CPU time
+// of the batch within gi_scanCpu percent
+static void *scanThread (void *vArg)
+{
+  struct scanCursor cursor;
+  struct timespec tsStart;
+  struct timespec tsEnd;
+  struct timespec tsSleep;
+  long long llUsed;
+  long long llSleep;
+  int iPassDone;
+  int iLeft;
+
+  (void)vArg;
+  memset (&cursor, 0, sizeof (cursor));
+  for ( ; ; )
+  {
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &tsStart);
+    for (iLeft = gi_scanBlocks, iPassDone = 0 ; iLeft > 0 && !iPassDone ; )
+    {
+      iLeft -= scanStep (&cursor, iLeft, &iPassDone);
+    }
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &tsEnd);
+
+    llUsed = (tsEnd.tv_sec - tsStart.tv_sec) * 1000000000LL + (tsEnd.tv_nsec - tsStart.tv_nsec);
+    llSleep = llUsed * (100 - gi_scanCpu) / gi_scanCpu;
+    if (iPassDone)
+    {
+      __atomic_add_fetch (&gul_scanPasses, 1, __ATOMIC_RELAXED);
+      // a small heap shouldn't be checked over and over
+      if (llSleep < SML_SCAN_PASS_SLEEP)
+      {
+        llSleep = SML_SCAN_PASS_SLEEP;
+      }
+    }
+    if (llSleep > 0)
+    {
+      tsSleep.tv_sec = llSleep / 1000000000LL;
+      tsSleep.tv_nsec = llSleep % 1000000000LL;
+      nanosleep (&tsSleep, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+// start one of the library's own threads, returns 0 if it's running.  It
+// takes no signals, they're the program's.  Its stack and TLS are allocated
+// with the hooks disabled so they don't show up as a leak
+static int startThread (void *(*fnThread) (void *))
+{
+  pthread_t thread;
+  sigset_t sAll;
+  sigset_t sOld;
+  int iResult;
+
+  sigfillset (&sAll);
+  pthread_sigmask (SIG_SETMASK, &sAll, &sOld);
+  gi_hookDisabled = 1;
+  iResult = pthread_create (&thread, NULL, fnThread, NULL);
+  gi_hookDisabled = 0;
+  pthread_sigmask (SIG_SETMASK, &sOld, NULL);
+
+  if (iResult == 0)
+  {
+    pthread_detach (thread);
+  }
+  return iResult;
+}
+
+// start the background scanner, called at the end of init()
+static void scanStart (void)
+{
+  writeGuards (&g_scanMarker.head + 1, 0);
+  if (startThread (scanThread) != 0)
+  {
+    gi_scanCpu = 0;
+  }
+}
+
+// nothing but sem_post(3) is safe in a signal handler, the report is written
+// by a thread that waits for it
+static void statsSignal (int iSignal)
+{
+  int iErrno = errno;
+
+  (void)iSignal;
+  sem_post (&g_statsSem);
+  errno = iErrno;
+}
+
+static void *statsThread (void *vArg)
+{
+  (void)vArg;
+  for ( ; ; )
+  {
+    if (sem_wait (&g_statsSem) == 0)
+    {
+      mem_show_stats (stderr);
+    }
+  }
+
+  return NULL;
+}
+
+// print mem_show_stats() on every SIGUSR2, called at the end of init()
+static void statsStart (void)
+{
+  struct sigaction action;
+
+  if (sem_init (&g_statsSem, 0, 0) != 0 || startThread (statsThread) != 0)
+  {
+    return;
+  }
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = statsSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGUSR2, &action, NULL);
+}
+
+// the time stamp of an event, the decoder turns the ticks into time with
+// the MEM_EVENT_SYNC records
+static unsigned long long eventTime (void)
+{
+#if (defined __x86_64__ || defined __i386__)
+  return __builtin_ia32_rdtsc ();
+#else
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif //(defined __x86_64__ || defined __i386__)
+}
+
+static void eventSet (struct mem_event *event, unsigned char ucOp, unsigned short usThread,
+                      unsigned long long ullPtr, unsigned long long ullSize, unsigned int uiStackId)
+{
+  event->ullTime = eventTime ();
+  event->ullPtr = ullPtr;
+  event->ullSize = ullSize;
+  event->uiStackId = uiStackId;
+  event->usThread = usThread;
+  event->ucOp = ucOp;
+  event->ucSpare = 0;
+}
+
+static struct eventRing *eventRingNew (void)
+{
+  struct eventRing *ring;
+
+  ring = (struct eventRing *) mmap (NULL, sizeof (struct eventRing), PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  return ring != MAP_FAILED ? ring : NULL;
+}
+
+// add an event to a ring, only ever called by its one producer
+static void eventPush (struct eventRing *ring, unsigned short usThread, unsigned char ucOp,
+                       unsigned long long ullPtr, unsigned long long ullSize, unsigned int uiStackId)
+{
+  unsigned long long ullHead = ring->ullHead;
+  unsigned long long ullRoom;
+
+  // after a loss, the count of what was lost goes in first
+  ullRoom = SML_EVENT_RING - (ullHead - __atomic_load_n (&ring->ullTail, __ATOMIC_ACQUIRE));
+  if (ullRoom < (ring->ullDropped != 0 ? 2U : 1U))
+  {
+    ring->ullDropped++;
+    return;
+  }
+  if (ring->ullDropped != 0)
+  {
+    eventSet (&ring->events[ullHead++ & (SML_EVENT_RING-1)], MEM_EVENT_DROPPED, usThread,
+              0, ring->ullDropped, 0);
+    ring->ullDropped = 0;
+  }
+  eventSet (&ring->events[ullHead++ & (SML_EVENT_RING-1)], ucOp, usThread, ullPtr, ullSize, uiStackId);
+  __atomic_store_n (&ring->ullHead, ullHead, __ATOMIC_RELEASE);
+}
+
+// log an event of the calling thread.  Nothing here allocates or formats,
+// the writer thread does the rest
+static void eventLog (unsigned char ucOp, const void *vPtr, size_t size, unsigned int uiStackId)
+{
+  struct threadCache *cache;
+  unsigned long long ullPtr = (unsigned long long) (unsigned long) vPtr;
+
+  if (!__atomic_load_n (&gi_eventLog, __ATOMIC_RELAXED))
+  {
+    return;
+  }
+
+  // the first allocation of a thread is logged before the block goes on
+  // its registry, which is what makes the cache
+  cache = getThreadCache ();
+  if (cache != NULL)
+  {
+    if (cache->eventRing == NULL)
+    {
+      __atomic_store_n (&cache->eventRing, eventRingNew (), __ATOMIC_RELEASE);
+    }
+    if (cache->eventRing != NULL)
+    {
+      eventPush (cache->eventRing, cache->usIndex, ucOp, ullPtr, size, uiStackId);
+      return;
+    }
+  }
+
+  MUTEX_LOCK (&g_eventSharedMutex);
+  eventPush (gp_eventShared, MEM_EVENT_NO_THREAD, ucOp, ullPtr, size, uiStackId);
+  MUTEX_UNLOCK (&g_eventSharedMutex);
+}
+
+// map the next window of the file, which grows a window at a time.  Returns
+// 0, and stops the log, if it can't
+static int eventNextWindow (void)
+{
+  void *vWindow;
+
+  if (gp_eventWindow != NULL)
+  {
+    munmap (gp_eventWindow, SML_EVENT_WINDOW);
+    gp_eventWindow = NULL;
+    gull_eventWindowStart += SML_EVENT_WINDOW;
+  }
+  gs_eventWindowUsed = 0;
+
+  if (ftruncate (gi_eventFd, (off_t) (gull_eventWindowStart + SML_EVENT_WINDOW)) != 0 ||
+      (vWindow = mmap (NULL, SML_EVENT_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       gi_eventFd, (off_t) gull_eventWindowStart)) == MAP_FAILED)
+  {
+    perror ("SML_EVENTLOG");
+    __atomic_store_n (&gi_eventLog, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  gp_eventWindow = (char *) vWindow;
+
+  return 1;
+}
+
+// copy records into the file, with g_eventMutex held
+static void eventWrite (const struct mem_event *events, size_t sCount)
+{
+  size_t sFit;
+
+  while (sCount > 0)
+  {
+    if (gs_eventWindowUsed == SML_EVENT_WINDOW && !eventNextWindow ())
+    {
+      return;
+    }
+    sFit = (SML_EVENT_WINDOW - gs_eventWindowUsed) / sizeof (struct mem_event);
+    if (sFit > sCount)
+    {
+      sFit = sCount;
+    }
+    memcpy (gp_eventWindow + gs_eventWindowUsed, events, sFit * sizeof (struct mem_event));
+    gs_eventWindowUsed += sFit * sizeof (struct mem_event);
+    events += sFit;
+    sCount -= sFit;
+  }
+}
+
+// returns how many events were waiting
+static unsigned long long eventDrainRing (struct eventRing *ring)
+{
+  unsigned long long ullTail;
+  unsigned long long ullHead;
+  unsigned long long ullCount;
+  unsigned long long ullWaiting;
+
+  if (ring == NULL)
+  {
+    return 0;
+  }
+
+  ullTail = ring->ullTail;
+  ullHead = __atomic_load_n (&ring->ullHead, __ATOMIC_ACQUIRE);
+  ullWaiting = ullHead - ullTail;
+  while (ullTail != ullHead)
+  {
+    // up to the end of the ring in one go
+    ullCount = SML_EVENT_RING - (ullTail & (SML_EVENT_RING-1));
+    if (ullCount > ullHead - ullTail)
+    {
+      ullCount = ullHead - ullTail;
+    }
+    eventWrite (&ring->events[ullTail & (SML_EVENT_RING-1)], (size_t) ullCount);
+    ullTail += ullCount;
+  }
+  __atomic_store_n (&ring->ullTail, ullTail, __ATOMIC_RELEASE);
+
+  return ullWaiting;
+}
+
+// ties the time stamps to the clocks
+static void eventSync (void)
+{
+  struct mem_event event;
+  struct timespec tsMono;
+  struct timespec tsReal;
+
+  clock_gettime (CLOCK_MONOTONIC, &tsMono);
+  clock_gettime (CLOCK_REALTIME, &tsReal);
+  eventSet (&event, MEM_EVENT_SYNC, MEM_EVENT_NO_THREAD,
+            tsMono.tv_sec * 1000000000ULL + tsMono.tv_nsec,
+            tsReal.tv_sec * 1000000000ULL + tsReal.tv_nsec, 0);
+  eventWrite (&event, 1);
+}
+
+// the names of the call sites added since the last pass, the events only
+// have their IDs
+static void eventSites (void)
+{
+#if (defined _EXECINFO_H && _EXECINFO_H == 1)
+  struct mem_event events[2 + SML_CALLSITE_NAME_MAX / sizeof (struct mem_event)];
+  const char *szName;
+  unsigned int uiCount;
+  unsigned int uiStackId;
+  size_t sLen;
+
+  uiCount = __atomic_load_n (&gui_callSiteCount, __ATOMIC_ACQUIRE);
+  for ( ; gui_eventSites < uiCount ; gui_eventSites++)
+  {
+    uiStackId = gui_callSiteOrder[gui_eventSites] + 1;
+    szName = getStackName (uiStackId);
+    sLen = strlen (szName);
+    if (sLen > SML_CALLSITE_NAME_MAX)
+    {
+      sLen = SML_CALLSITE_NAME_MAX;
+    }
+    memset (events, 0, sizeof (events));
+    eventSet (&events[0], MEM_EVENT_SITE, MEM_EVENT_NO_THREAD, 0, sLen, uiStackId);
+    memcpy (&events[1], szName, sLen);
+    eventWrite (events, 1 + (sLen + sizeof (struct mem_event) - 1) / sizeof (struct mem_event));
+  }
+#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+}
+
+// one pass of the writer, over the ring of the shared shards and that of
+// every thread.  Returns the most events one of them had waiting
+static unsigned long long eventDrain (int iSync)
+{
+  struct threadCache *cache;
+  unsigned long long ullMost = 0;
+  unsigned long long ullWaiting;
+
+  if (!__atomic_load_n (&gi_eventLog, __ATOMIC_RELAXED))
+  {
+    return 0;
+  }
+
+  MUTEX_LOCK (&g_eventMutex);
+  if (__atomic_load_n (&gi_eventLog, __ATOMIC_RELAXED))
+  {
+    if (iSync)
+    {
+      eventSync ();
+    }
+    ullMost = eventDrainRing (gp_eventShared);
+    for (cache = __atomic_load_n (&gp_cacheList, __ATOMIC_ACQUIRE) ; cache != NULL ; cache = cache->next)
+    {
+      ullWaiting = eventDrainRing (__atomic_load_n (&cache->eventRing, __ATOMIC_ACQUIRE));
+      if (ullWaiting > ullMost)
+      {
+        ullMost = ullWaiting;
+      }
+    }
+    eventSites ();
+  }
+  MUTEX_UNLOCK (&g_eventMutex);
+
+  return ullMost;
+}
+
+static void *eventThread (void *vArg)
+{
+  struct timespec tsSleep;
+  unsigned long long ullMost = 0;
+  unsigned int uiPass;
+
+  (void)vArg;
+  tsSleep.tv_sec = 0;
+  tsSleep.tv_nsec = SML_EVENT_DRAIN;
+  for (uiPass = 1 ; ; uiPass++)
+  {
+    // a thread that's filling its ring that fast gets another pass at once
+    if (ullMost < SML_EVENT_RING/4)
+    {
+      nanosleep (&tsSleep, NULL);
+    }
+    ullMost = eventDrain (uiPass % SML_EVENT_SYNC_EVERY == 0);
+  }
+
+  return NULL;
+}
+
+// the child has no writer, and the file is still the parent's
+static void eventForkChild (void)
+{
+  __atomic_store_n (&gi_eventLog, 0, __ATOMIC_RELAXED);
+}
+
+// create the file and write its header, called from init() before the
+// first allocation.  gi_eventLog is only set if it all worked
+static void eventOpen (const char *szFile)
+{
+  struct mem_event header;
+
+  MUTEX_INIT (&g_eventSharedMutex);
+  MUTEX_INIT (&g_eventMutex);
+  gp_eventShared = eventRingNew ();
+  gi_eventFd = open (szFile, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (gp_eventShared == NULL || gi_eventFd < 0)
+  {
+    perror ("SML_EVENTLOG");
+    return;
+  }
+  if (!eventNextWindow ())
+  {
+    return;
+  }
+
+  eventSet (&header, MEM_EVENT_HEADER, MEM_EVENT_NO_THREAD, (unsigned long long) getpid (),
+            sizeof (struct mem_event), 0);
+  header.ullTime = MEM_EVENT_MAGIC;
+  eventWrite (&header, 1);
+  eventSync ();
+  gi_eventLog = 1;
+}
+
+// start the writer, called at the end of init()
+static void eventStart (void)
+{
+  pthread_atfork (NULL, NULL, eventForkChild);
+  if (startThread (eventThread) != 0)
+  {
+    // nothing would empty the rings, keep what's there and stop
+    eventFinish ();
+  }
+}
+
+// write out the rings one last time, and cut the file down to what's in it.
+// Whatever the destructors that run after end() do isn't logged
+static void eventFinish (void)
+{
+  eventDrain (1);
+
+  MUTEX_LOCK (&g_eventMutex);
+  if (__atomic_load_n (&gi_eventLog, __ATOMIC_RELAXED))
+  {
+    __atomic_store_n (&gi_eventLog, 0, __ATOMIC_RELAXED);
+    if (ftruncate (gi_eventFd, (off_t) (gull_eventWindowStart + gs_eventWindowUsed)) != 0)
+    {
+      perror ("SML_EVENTLOG");
+    }
+  }
+  MUTEX_UNLOCK (&g_eventMutex);
+}
+#else
+static void eventLog (unsigned char ucOp, const void *vPtr, size_t size, unsigned int uiStackId)
+{
+  (void)ucOp;
+  (void)vPtr;
+  (void)size;
+  (void)uiStackId;
+}
+#endif //_PTHREAD_H
+
+
+static void updatePeak (long long llBytes)
+{
+  long long llPeak = __atomic_load_n (&gll_peakBytes, __ATOMIC_RELAXED);
+
+  while (llBytes > llPeak &&
+         !__atomic_compare_exchange_n (&gll_peakBytes, &llPeak, llBytes, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+  }
+}
+
+// the histogram bucket of a size, 0 for 0 bytes and i for 2^(i-1) up to
+// 2^i - 1 bytes, with everything too big in the last one
+static int statsBucket (size_t size)
+{
+  int iBucket;
+
+  if (size == 0)
+  {
+    return 0;
+  }
+  iBucket = 64 - __builtin_clzll ((unsigned long long) size);
+
+  return iBucket < MEM_STATS_BUCKETS ? iBucket : MEM_STATS_BUCKETS-1;
+}
+
+// what a call site holds right now.  Every allocating thread of a hot site
+// hits the same line, but with TRACE the backtrace(3) costs far more
+static void siteCount (unsigned int uiStackId, long long llCount, long long llBytes)
+{
+#if (defined _EXECINFO_H && _EXECINFO_H == 1)
+  if (STACK_ID_IS_SITE (uiStackId) && gp_callSites != NULL)
+  {
+    __atomic_add_fetch (&gp_callSites[uiStackId-1].llLiveCount, llCount, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&gp_callSites[uiStackId-1].llLiveBytes, llBytes, __ATOMIC_RELAXED);
+  }
+#else
+  (void)uiStackId;
+  (void)llCount;
+  (void)llBytes;
+#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+}
+
+// the blocks on a registry are the thread's it belongs to, whoever frees
+// them.  owner is the registry the block is on, NULL for a new block (it goes
+// on this thread's), and self is this thread's cache if it has one.  The
+// owner's own changes are single writer stores like the rest, anyone else's
+// are atomic adds to llOther, and the live blocks of a thread are the sum of
+// the two.  The shards are the threads without a cache
+static void countOwner (struct memoryRegistry *owner, struct threadCache *self,
+                        long long llCount, long long llBytes)
+{
+#ifdef _PTHREAD_H
+  struct allocCounters *counters;
+
+  if (self != NULL && (owner == NULL || owner->cache == self))
+  {
+    counters = &self->counters;
+    __atomic_store_n (&counters->llOwnCount, counters->llOwnCount + llCount, __ATOMIC_RELAXED);
+    __atomic_store_n (&counters->llOwnBytes, counters->llOwnBytes + llBytes, __ATOMIC_RELAXED);
+    return;
+  }
+
+  counters = owner != NULL && owner->cache != NULL ? &owner->cache->counters : &g_sharedCounters;
+  __atomic_add_fetch (&counters->llOtherCount, llCount, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&counters->llOtherBytes, llBytes, __ATOMIC_RELAXED);
+#else
+  (void)owner;
+  (void)self;
+  (void)llCount;
+  (void)llBytes;
+#endif //_PTHREAD_H
+}
+
+// count a block of size bytes coming (llCount > 0) or going (llCount < 0), a
+// realloc(3) is one of each.  llCount and llBytes are the estimates for the
+// block, they are 1 and size unless sampling.  owner is for countOwner()
+static void countAlloc (unsigned int uiStackId, size_t size, long long llCount, long long llBytes,
+                        struct memoryRegistry *owner)
+{
+  struct threadCache *self = NULL;
+  struct allocCounters *counters;
+  long long llUnpublished;
+  int iBucket = statsBucket (size);
+
+#ifdef _PTHREAD_H
+  if (gi_threadCacheState == THREAD_CACHE_ACTIVE)
+  {
+    self = gp_threadCache;
+  }
+#endif //_PTHREAD_H
+  siteCount (uiStackId, llCount, llBytes);
+  countOwner (owner, self, llCount, llBytes);
+#ifdef _PTHREAD_H
+  if (self != NULL)
+  {
+    // only this thread writes these, the stores are atomic only so that
+    // sumCounters() never sees half of one
+    counters = &self->counters;
+    __atomic_store_n (&counters->llAllocCount, counters->llAllocCount + llCount, __ATOMIC_RELAXED);
+    __atomic_store_n (&counters->llLiveBytes, counters->llLiveBytes + llBytes, __ATOMIC_RELAXED);
+    __atomic_store_n (&counters->llHistogram[iBucket], counters->llHistogram[iBucket] + llCount, __ATOMIC_RELAXED);
+    if (llCount > 0)
+    {
+      __atomic_store_n (&counters->llAllocs, counters->llAllocs + llCount, __ATOMIC_RELAXED);
+    }
+    llUnpublished = counters->llUnpublished + llBytes;
+    if (llUnpublished > -SML_COUNTER_BATCH && llUnpublished < SML_COUNTER_BATCH)
+    {
+      counters->llUnpublished = llUnpublished;
+      return;
+    }
+    counters->llUnpublished = 0;
+  }
+  else
+#endif //_PTHREAD_H
+  {
+    counters = &g_sharedCounters;
+    __atomic_add_fetch (&counters->llAllocCount, llCount, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&counters->llLiveBytes, llBytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&counters->llHistogram[iBucket], llCount, __ATOMIC_RELAXED);
+    if (llCount > 0)
+    {
+      __atomic_add_fetch (&counters->llAllocs, llCount, __ATOMIC_RELAXED);
+    }
+    llUnpublished = llBytes;
+  }
+
+  updatePeak (__atomic_add_fetch (&gll_publishedBytes, llUnpublished, __ATOMIC_RELAXED));
+}
+
+// add up the counters of every thread, O(threads)
+static void sumCounters (struct allocCounters *total)
+{
+#ifdef _PTHREAD_H
+  struct threadCache *cache;
+#endif //_PTHREAD_H
+
+  total->llAllocCount = __atomic_load_n (&g_sharedCounters.llAllocCount, __ATOMIC_RELAXED) -
+                        __atomic_load_n (&g_ignoredCounters.llAllocCount, __ATOMIC_RELAXED);
+  total->llLiveBytes  = __atomic_load_n (&g_sharedCounters.llLiveBytes, __ATOMIC_RELAXED) -
+                        __atomic_load_n (&g_ignoredCounters.llLiveBytes, __ATOMIC_RELAXED);
+#ifdef _PTHREAD_H
+  for (cache = __atomic_load_n (&gp_cacheList, __ATOMIC_ACQUIRE) ;
+       cache != NULL ;
+       cache = cache->next)
+  {
+    total->llAllocCount += __atomic_load_n (&cache->counters.llAllocCount, __ATOMIC_RELAXED);
+    total->llLiveBytes  += __atomic_load_n (&cache->counters.llLiveBytes, __ATOMIC_RELAXED);
+  }
+#endif //_PTHREAD_H
+
+  updatePeak (total->llLiveBytes);
+}
+
+// the per thread parts of mem_get_stats(), after stats->llLiveCount is set.
+// What's been ignored was never freed
+static void sumStats (struct mem_stats *stats)
+{
+#ifdef _PTHREAD_H
+  struct threadCache *cache;
+#endif //_PTHREAD_H
+  int i;
+
+  stats->llAllocs = __atomic_load_n (&g_sharedCounters.llAllocs, __ATOMIC_RELAXED);
+#ifdef _PTHREAD_H
+  stats->llAllocs += __atomic_load_n (&g_exitedCounters.llAllocs, __ATOMIC_RELAXED);
+#endif //_PTHREAD_H
+  for (i = 0 ; i < MEM_STATS_BUCKETS ; i++)
+  {
+    stats->llHistogram[i] = __atomic_load_n (&g_sharedCounters.llHistogram[i], __ATOMIC_RELAXED) -
+                            __atomic_load_n (&g_ignoredCounters.llHistogram[i], __ATOMIC_RELAXED);
+  }
+#ifdef _PTHREAD_H
+  for (cache = __atomic_load_n (&gp_cacheList, __ATOMIC_ACQUIRE) ;
+       cache != NULL ;
+       cache = cache->next)
+  {
+    stats->llAllocs += __atomic_load_n (&cache->counters.llAllocs, __ATOMIC_RELAXED);
+    for (i = 0 ; i < MEM_STATS_BUCKETS ; i++)
+    {
+      stats->llHistogram[i] += __atomic_load_n (&cache->counters.llHistogram[i], __ATOMIC_RELAXED);
+    }
+  }
+#endif //_PTHREAD_H
+  stats->llFrees = stats->llAllocs - stats->llLiveCount -
+                   __atomic_load_n (&g_ignoredCounters.llAllocCount, __ATOMIC_RELAXED);
+}
+
+// rank the call sites by the bytes they hold, only the ones that make it
+// get their names
+static void statsTopSites (struct mem_stats *stats)
+{
+#if (defined _EXECINFO_H && _EXECINFO_H == 1)
+  unsigned int uiTop[MEM_STATS_TOP_SITES];
+  unsigned int uiCount;
+  unsigned int uiIndex;
+  unsigned int ui;
+  long long llBytes;
+  int i;
+
+  if (gp_callSites == NULL)
+  {
+    return;
+  }
+
+  uiCount = __atomic_load_n (&gui_callSiteCount, __ATOMIC_ACQUIRE);
+  for (ui = 0 ; ui < uiCount ; ui++)
+  {
+    uiIndex = gui_callSiteOrder[ui];
+    llBytes = __atomic_load_n (&gp_callSites[uiIndex].llLiveBytes, __ATOMIC_RELAXED);
+    if (llBytes <= 0 ||
+        (stats->iSites == MEM_STATS_TOP_SITES && llBytes <= stats->sites[MEM_STATS_TOP_SITES-1].llBytes))
+    {
+      continue;
+    }
+
+    // insertion into the short sorted list
+    i = stats->iSites < MEM_STATS_TOP_SITES ? stats->iSites++ : MEM_STATS_TOP_SITES-1;
+    for ( ; i > 0 && stats->sites[i-1].llBytes < llBytes ; i--)
+    {
+      stats->sites[i] = stats->sites[i-1];
+      uiTop[i] = uiTop[i-1];
+    }
+    stats->sites[i].llBytes = llBytes;
+    stats->sites[i].llCount = __atomic_load_n (&gp_callSites[uiIndex].llLiveCount, __ATOMIC_RELAXED);
+    uiTop[i] = uiIndex;
+  }
+
+  for (i = 0 ; i < stats->iSites ; i++)
+  {
+    stats->sites[i].szName = getStackName (uiTop[i]+1);
+  }
+#else
+  (void)stats;
+#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+}
+
+#ifdef _PTHREAD_H
+// one row of the threads, from the counters it's kept in.  The totals take
+// in every row, the list only the ones holding the most bytes
+static void statsAddThread (struct mem_stats *stats, struct threadCache **top, int *iFilled,
+                            struct allocCounters *counters, struct threadCache *cache, int iTid)
+{
+  struct mem_stats_thread entry;
+  int i;
+
+  memset (&entry, 0, sizeof (entry));
+  entry.llLiveCount = __atomic_load_n (&counters->llOwnCount, __ATOMIC_RELAXED) +
+                      __atomic_load_n (&counters->llOtherCount, __ATOMIC_RELAXED);
+  entry.llLiveBytes = __atomic_load_n (&counters->llOwnBytes, __ATOMIC_RELAXED) +
+                      __atomic_load_n (&counters->llOtherBytes, __ATOMIC_RELAXED);
+  entry.llAllocs = __atomic_load_n (&counters->llAllocs, __ATOMIC_RELAXED);
+  entry.llLockWaits = __atomic_load_n (&counters->llLockWaits, __ATOMIC_RELAXED);
+  entry.llLockWaitNs = __atomic_load_n (&counters->llLockWaitNs, __ATOMIC_RELAXED);
+  entry.iTid = iTid;
+  if (cache != NULL)
+  {
+    entry.ulThreadId = (unsigned long) cache->threadId;
+    entry.iTid = cache->iTid;
+    entry.iAlive = __atomic_load_n (&cache->iState, __ATOMIC_ACQUIRE) == CACHE_ALIVE;
+  }
+  stats->llLockWaits += entry.llLockWaits;
+  stats->llLockWaitNs += entry.llLockWaitNs;
+
+  if (cache == NULL && entry.llAllocs == 0 && entry.llLiveCount == 0 && entry.llLockWaits == 0)
+  {
+    return;
+  }
+  stats->iThreads++;
+  if (*iFilled < MEM_STATS_TOP_THREADS || entry.llLiveBytes > stats->threads[MEM_STATS_TOP_THREADS-1].llLiveBytes)
+  {
+    // insertion into the short sorted list
+    i = *iFilled < MEM_STATS_TOP_THREADS ? (*iFilled)++ : MEM_STATS_TOP_THREADS-1;
+    for ( ; i > 0 && stats->threads[i-1].llLiveBytes < entry.llLiveBytes ; i--)
+    {
+      stats->threads[i] = stats->threads[i-1];
+      top[i] = top[i-1];
+    }
+    stats->threads[i] = entry;
+    top[i] = cache;
+  }
+}
+#endif //_PTHREAD_H
+
+// the lock totals, and the threads ranked by the bytes they hold.  Every
+// cache is a thread, and the shards are one more for the threads without one.
+// The threads whose cache went to a new one are one more, with what they did
+// (the blocks they left are the cache's)
+static void statsTopThreads (struct mem_stats *stats)
+{
+#ifdef _PTHREAD_H
+  struct threadCache *top[MEM_STATS_TOP_THREADS];
+  struct threadCache *cache;
+  int iFilled = 0;
+  int i;
+
+  statsAddThread (stats, top, &iFilled, &g_sharedCounters, NULL, 0);
+  statsAddThread (stats, top, &iFilled, &g_exitedCounters, NULL, -1);
+  for (cache = __atomic_load_n (&gp_cacheList, __ATOMIC_ACQUIRE) ;
+       cache != NULL ;
+       cache = cache->next)
+  {
+    statsAddThread (stats, top, &iFilled, &cache->counters, cache, 0);
+  }
+  stats->llLockWaitMaxNs = __atomic_load_n (&gll_lockWaitMaxNs, __ATOMIC_RELAXED);
+
+  for (i = 0 ; i < iFilled ; i++)
+  {
+    if (top[i] == NULL)
+    {
+      continue;
+    }
+    if (stats->threads[i].iAlive)
+    {
+      threadName (stats->threads[i].iTid, stats->threads[i].szName);
+    }
+    else
+    {
+      memcpy (stats->threads[i].szName, top[i]->szName, sizeof (stats->threads[i].szName));
+      stats->threads[i].szName[sizeof (stats->threads[i].szName)-1] = '\0';
+    }
+  }
+#else
+  (void)stats;
+#endif //_PTHREAD_H
+}
+
+void mem_get_stats (struct mem_stats *stats)
+{
+  struct allocCounters total;
+  struct rusage usage;
+  struct timespec ts;
+
+  memset (stats, 0, sizeof (*stats));
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  stats->ullTimeNs = (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+
+  sumCounters (&total);
+  stats->llLiveCount = total.llAllocCount;
+  stats->llLiveBytes = total.llLiveBytes;
+  stats->llPeakBytes = __atomic_load_n (&gll_peakBytes, __ATOMIC_RELAXED);
+  if (getrusage (RUSAGE_SELF, &usage) == 0)
+  {
+    stats->llPeakRss = (long long) usage.ru_maxrss * 1024;
+  }
+  sumStats (stats);
+  statsTopSites (stats);
+  statsTopThreads (stats);
+}
+
+// the lock and thread lines of mem_show_stats(), and of the report at exit
+static void showThreadStats (FILE *fp, const struct mem_stats *stats)
+{
+  const struct mem_stats_thread *thread;
+  int i;
+
+  if (stats->iThreads == 0)
+  {
+    return;
+  }
+  fprintf (fp, "  %lld locks had to wait, %.3fms in all, the longest %.3fms\n", stats->llLockWaits,
+           (double) stats->llLockWaitNs / 1e6, (double) stats->llLockWaitMaxNs / 1e6);
+  fprintf (fp, "  threads holding the most (%d in all):\n", stats->iThreads);
+  fprintf (fp, "    %8s %-16s %-6s %12s %14s %12s %10s %10s\n", "tid", "name", "", "live blocks",
+           "live bytes", "allocations", "waits", "wait ms");
+  for (i = 0 ; i < stats->iThreads && i < MEM_STATS_TOP_THREADS ; i++)
+  {
+    thread = &stats->threads[i];
+    if (thread->ulThreadId == 0)
+    {
+      fprintf (fp, "    %8s %-16s %-6s", "-", thread->iTid == -1 ? "(exited)" : "(no cache)", "");
+    }
+    else
+    {
+      fprintf (fp, "    %8d %-16s %-6s", thread->iTid, thread->szName, thread->iAlive ? "" : "exited");
+    }
+    fprintf (fp, " %12lld %14lld %12lld %10lld %10.3f\n", thread->llLiveCount, thread->llLiveBytes,
+             thread->llAllocs, thread->llLockWaits, (double) thread->llLockWaitNs / 1e6);
+  }
+}
+
+void mem_show_stats (FILE *fp)
+{
+  static unsigned long long ullLastTimeNs = 0;
+  static long long llLastAllocs = 0;
+  static long long llLastFrees = 0;
+#ifdef _PTHREAD_H
+  static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif //_PTHREAD_H
+  struct mem_stats stats;
+  double dSeconds;
+  int i;
+
+  mem_get_stats (&stats);
+
+  // the rates are since the last report (or since start up)
+  MUTEX_LOCK (&statsMutex);
+  dSeconds = ullLastTimeNs != 0 ? (double) (stats.ullTimeNs - ullLastTimeNs) / 1e9 : 0.0;
+  fprintf (fp, "\nmemory stats%s\n", gi_sampling ? " (estimates, sampling)" : "");
+  fprintf (fp, "------------\n");
+  fprintf (fp, "  %lld blocks live, %lld bytes (peak %lld), process peak RSS %lld bytes\n",
+           stats.llLiveCount, stats.llLiveBytes, stats.llPeakBytes, stats.llPeakRss);
+  if (dSeconds > 0.0)
+  {
+    fprintf (fp, "  %lld allocations, %lld frees (%.0f/s and %.0f/s over the last %.1fs)\n",
+             stats.llAllocs, stats.llFrees,
+             (double) (stats.llAllocs - llLastAllocs) / dSeconds,
+             (double) (stats.llFrees - llLastFrees) / dSeconds, dSeconds);
+  }
+  else
+  {
+    fprintf (fp, "  %lld allocations, %lld frees\n", stats.llAllocs, stats.llFrees);
+  }
+  ullLastTimeNs = stats.ullTimeNs;
+  llLastAllocs = stats.llAllocs;
+  llLastFrees = stats.llFrees;
+  MUTEX_UNLOCK (&statsMutex);
+
+  fprintf (fp, "  live blocks by size:\n");
+  for (i = 0 ; i < MEM_STATS_BUCKETS ; i++)
+  {
+    if (stats.llHistogram[i] != 0)
+    {
+      fprintf (fp, "    %12llu - %-12llu %lld\n",
+               i == 0 ? 0ULL : 1ULL << (i-1), i == 0 ? 0ULL : (i == MEM_STATS_BUCKETS-1 ? ~0ULL : (1ULL << i) - 1),
+               stats.llHistogram[i]);
+    }
+  }
+  if (stats.iSites != 0)
+  {
+    fprintf (fp, "  call sites holding the most:\n");
+  }
+  for (i = 0 ; i < stats.iSites ; i++)
+  {
+    fprintf (fp, "    %lld bytes in %lld blocks, \"%s\"\n",
+             stats.sites[i].llBytes, stats.sites[i].llCount, stats.sites[i].szName);
+  }
+  showThreadStats (fp, &stats);
+  fprintf (fp, "\n");
+}
+
+int mem_get_alloc_count (void)
+{
+  struct allocCounters total;
+
+  sumCounters (&total);
+  return (int) total.llAllocCount;
+}
+
+size_t mem_get_usage (void)
+{
+  struct allocCounters total;
+
+  sumCounters (&total);
+  return (size_t) total.llLiveBytes;
+}
+
+int mem_set_sample_interval (size_t sBytes)
+{
+  // blocks that weren't sampled have no header, so the mode itself can't
+  // change after start up
+  if (!gi_sampling || sBytes == 0)
+  {
+    return -1;
+  }
+
+  // each thread picks it up after its next sample
+  __atomic_store_n (&gs_sampleInterval, sBytes, __ATOMIC_RELAXED);
+  return 0;
+}
+
+size_t mem_get_sample_interval (void)
+{
+  if (!gi_sampling)
+  {
+    return 0;
+  }
+
+  return __atomic_load_n (&gs_sampleInterval, __ATOMIC_RELAXED);
+}
+
+unsigned long mem_get_scan_passes (void)
+{
+#ifdef _PTHREAD_H
+  return __atomic_load_n (&gul_scanPasses, __ATOMIC_RELAXED);
+#else
+  return 0;
+#endif //_PTHREAD_H
+}
+
+void mem_flush_events (void)
+{
+#ifdef _PTHREAD_H
+  eventDrain (1);
+#endif //_PTHREAD_H
+}
+
+unsigned int mem_mark_generation (void)
+{
+  return __atomic_add_fetch (&gui_generation, 1, __ATOMIC_RELAXED);
+}
+
+size_t mem_get_peak_usage (void)
+{
+  struct allocCounters total;
+
+  // folds the exact current total into the peak
+  sumCounters (&total);
+  return (size_t) __atomic_load_n (&gll_peakBytes, __ATOMIC_RELAXED);
+}
+
+size_t mem_get_real_usage (void)
+{
+  struct memoryRegistry *registry;
+  struct memoryHeader *ml;
+  struct poolSlab *slab;
+  struct poolSlot *slot;
+  unsigned int uiSlot;
+  void *vBlock;
+  size_t size=0;
+
+  for (registry = registryNext (NULL) ;
+       registry != NULL ;
+       registry = registryNext (registry))
+  {
+    MUTEX_LOCK (&registry->mutex);
+    for (ml = registry->listHead.lh_first ;
+         ml != NULL ;
+         ml = ml->doubleLL.le_next)
+    {
+      prefetchNext (ml);
+      if (guardOwns (ml))
+      {
+        // the guard page holds no memory
+        size += IS_REMOTE_FREED (ml) ? 0 : ((struct guardSpan *) ml)->sSpan - gs_pageSize;
+        continue;
+      }
+      verifyIntegrity (ml+1);
+      if (!IS_REMOTE_FREED (ml) && !IS_SCAN_MARKER (ml))
+      {
+        size += ml->size + sizeof(struct memoryHeader) + sizeof(struct memoryCap) +
+                ((char *) ml - (char *) blockBase (ml));
+      }
+    }
+    for (slab = NULL ; (slot = poolNext (registry, &slab, &uiSlot, &vBlock)) != NULL ; )
+    {
+      verifyGuards (vBlock, slot->uiSize);
+      size += slot->uiSize + POOL_SLOT_GUARDS + sizeof (struct poolSlot);
+    }
+    MUTEX_UNLOCK (&registry->mutex);
+  }
+
+  return size;
+}
+
+void mem_check_integrity (void)
+{
+  struct memoryRegistry *registry;
+  struct memoryHeader *ml;
+  struct poolSlab *slab;
+  struct poolSlot *slot;
+  unsigned int uiSlot;
+  void *vBlock;
+
+  for (registry = registryNext (NULL) ;
+       registry != NULL ;
+       registry = registryNext (registry))
+  {
+    MUTEX_LOCK (&registry->mutex);
+    for (ml = registry->listHead.lh_first ;
+         ml != NULL ;
+         ml = ml->doubleLL.le_next)
+    {
+      prefetchNext (ml);
+      // a guarded block is checked by its guard page as it's written
+      if (!guardOwns (ml))
+      {
+        verifyIntegrity (ml+1);
+      }
+    }
+    for (slab = NULL ; (slot = poolNext (registry, &slab, &uiSlot, &vBlock)) != NULL ; )
+    {
+      verifyGuards (vBlock, slot->uiSize);
+    }
+    MUTEX_UNLOCK (&registry->mutex);
+  }
+}
+
+void mem_ignore_current_allocations (void)
+{
+  struct memoryRegistry *registry;
+  struct memoryHeader *ml;
+  struct poolSlab *slab;
+  struct poolSlot *slot;
+  unsigned int uiSlot;
+  void *vBlock;
+
+  long long llCount=0;
+  long long llBytes=0;
+  long long llHistogram[MEM_STATS_BUCKETS];
+  long long llOwnerCount;
+  long long llOwnerBytes;
+  struct threadCache *self = NULL;
+  int i;
+
+#ifdef _PTHREAD_H
+  if (gi_threadCacheState == THREAD_CACHE_ACTIVE)
+  {
+    self = gp_threadCache;
+  }
+#endif //_PTHREAD_H
+  memset (llHistogram, 0, sizeof (llHistogram));
+  for (registry = registryNext (NULL) ;
+       registry != NULL ;
+       registry = registryNext (registry))
+  {
+    llOwnerCount = llCount;
+    llOwnerBytes = llBytes;
+    MUTEX_LOCK (&registry->mutex);
+    while ((ml = registry->listHead.lh_first) != NULL)
+    {
+      // freeing an ignored block doesn't count it down again, so these are
+      // taken out of the totals here once and for all
+      if (ml->uiStackId != 0 && !IS_REMOTE_FREED (ml))
+      {
+        long long llBlockCount;
+        long long llBlockBytes;
+
+        estimate (ml->size, ml->dWeight, &llBlockCount, &llBlockBytes);
+        llCount += llBlockCount;
+        llBytes += llBlockBytes;
+        llHistogram[statsBucket (ml->size)] += llBlockCount;
+        siteCount (ml->uiStackId, -llBlockCount, -llBlockBytes);
+      }
+      LIST_REMOVE (ml, doubleLL);
+      ml->doubleLL.le_prev = NULL;
+    }
+    for (slab = NULL ; (slot = poolNext (registry, &slab, &uiSlot, &vBlock)) != NULL ; )
+    {
+      llCount++;
+      llBytes += slot->uiSize;
+      llHistogram[statsBucket (slot->uiSize)]++;
+      siteCount (slot->uiStackId, -1, -(long long) slot->uiSize);
+      __atomic_store_n (&slot->uiState, POOL_SLOT_IGNORED, __ATOMIC_RELAXED);
+    }
+    MUTEX_UNLOCK (&registry->mutex);
+    countOwner (registry, self, llOwnerCount - llCount, llOwnerBytes - llBytes);
+  }
+  __atomic_add_fetch (&g_ignoredCounters.llAllocCount, llCount, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&g_ignoredCounters.llLiveBytes, llBytes, __ATOMIC_RELAXED);
+  for (i = 0 ; i < MEM_STATS_BUCKETS ; i++)
+  {
+    __atomic_add_fetch (&g_ignoredCounters.llHistogram[i], llHistogram[i], __ATOMIC_RELAXED);
+  }
+  __atomic_sub_fetch (&gll_publishedBytes, llBytes, __ATOMIC_RELAXED);
+}
+
+// write one line of mem_show_allocations(), and the header before the first
+static void showBlock (FILE *fp, int *iCount, int iAllocCount, void *vPtr,
+                       size_t size, double dWeight, unsigned int uiStackId)
+{
+  int iLen;
+
+  if ((*iCount)++==0)
+  {
+    // write a header
+    fprintf (fp, "\n");
+    if (gi_sampling)
+    {
+      iLen = fprintf (fp, "about %d block%s remain%s allocated (sampled every %zu bytes)\n",
+                      iAllocCount, iAllocCount != 1 ? "s":"", iAllocCount != 1 ? "":"s",
+                      mem_get_sample_interval ());
+    }
+    else
+    {
+      iLen = fprintf (fp, "%d block%s remains allocated\n",
+                      iAllocCount, iAllocCount != 1 ? "s":"");
+    }
+    while (--iLen > 0)
+    {
+      fprintf (fp, "-");
+    }
+    fprintf (fp, "\n");
+  }
+
+  if (gi_sampling)
+  {
+    fprintf (fp, "  Address %p size of %zu (stands for about %zu bytes), allocated by \"%s\"\n",
+             vPtr, size, (size_t) (size * dWeight + 0.5), getStackName (uiStackId));
+  }
+  else
+  {
+    fprintf (fp, "  Address %p size of %zu, allocated by \"%s\"\n",
+             vPtr, size, getStackName (uiStackId));
+  }
+}
+
+// one more block for mem_show_allocations(), counted even if there's no room
+// for it so the caller knows how much it needs
+static void shownAdd (struct shownBlock *blocks, size_t sRoom, size_t *sUsed, void *vPtr,
+                      size_t size, double dWeight, unsigned int uiStackId)
+{
+  if (*sUsed < sRoom)
+  {
+    blocks[*sUsed].vPtr = vPtr;
+    blocks[*sUsed].size = size;
+    blocks[*sUsed].dWeight = dWeight;
+    blocks[*sUsed].uiStackId = uiStackId;
+  }
+  (*sUsed)++;
+}
+
+void mem_show_allocations (FILE *fp)
+{
+  struct memoryRegistry *registry;
+  struct memoryHeader *ml;
+  struct poolSlab *slab;
+  struct poolSlot *slot;
+  struct shownBlock *blocks;
+  unsigned int uiSlot;
+  size_t sRoom = SML_SHOW_BLOCKS;
+  size_t sUsed;
+  size_t s;
+  void *vBlock;
+  int iCount=0;
+  int iAllocCount;
+
+  // nothing is printed with a registry locked, fprintf(3) may allocate.  The
+  // blocks are copied out instead, into a mapping that's made bigger (and
+  // the registry walked again) when they don't fit
+  blocks = (struct shownBlock *) mmap (NULL, sRoom * sizeof (*blocks), PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (blocks == MAP_FAILED)
+  {
+    fprintf (fp, "mem_show_allocations: out of memory\n");
+    return;
+  }
+
+  // each registry is locked in turn, so the report is not one atomic snapshot
+  // of the whole heap if other threads keep allocating while it's written
+  iAllocCount = mem_get_alloc_count ();
+  for (registry = registryNext (NULL) ;
+       registry != NULL ;
+       registry = registryNext (registry))
+  {
+    for ( ; ; )
+    {
+      sUsed = 0;
+      MUTEX_LOCK (&registry->mutex);
+      for (ml = registry->listHead.lh_first ;
+           ml != NULL ;
+           ml = ml->doubleLL.le_next)
+      {
+        prefetchNext (ml);
+        if (!guardOwns (ml))
+        {
+          verifyIntegrity (ml+1);
+        }
+        if (ml->uiStackId != 0 && ml->size != 0 && !IS_REMOTE_FREED (ml))
+        {
+          shownAdd (blocks, sRoom, &sUsed, blockData (ml), ml->size, ml->dWeight, ml->uiStackId);
+        }
+      }
+      for (slab = NULL ; (slot = poolNext (registry, &slab, &uiSlot, &vBlock)) != NULL ; )
+      {
+        verifyGuards (vBlock, slot->uiSize);
+        if (slot->uiSize != 0)
+        {
+          shownAdd (blocks, sRoom, &sUsed, vBlock, slot->uiSize, 1.0, slot->uiStackId);
+        }
+      }
+      MUTEX_UNLOCK (&registry->mutex);
+
+      if (sUsed <= sRoom)
+      {
+        break;
+      }
+      munmap (blocks, sRoom * sizeof (*blocks));
+      sRoom = sUsed * 2;
+      blocks = (struct shownBlock *) mmap (NULL, sRoom * sizeof (*blocks), PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (blocks == MAP_FAILED)
+      {
+        fprintf (fp, "mem_show_allocations: out of memory\n");
+        return;
+      }
+    }
+
+    for (s = 0 ; s < sUsed ; s++)
+    {
+      showBlock (fp, &iCount, iAllocCount, blocks[s].vPtr, blocks[s].size,
+                 blocks[s].dWeight, blocks[s].uiStackId);
+    }
+  }
+  munmap (blocks, sRoom * sizeof (*blocks));
+
+  if (iCount != 0)
+  {
+    fprintf (fp, "\n");
+  }
+  else
+  {
+    fprintf (fp, "No memory allocations currently\n");
+  }
+}
+
+// add a block to the call site it came from, sites[0] stands for the blocks
+// without a known stack (all of them without TRACE) and the one after the
+// last call site for those whose backtrace(3) failed
+static void generationCount (struct generationSite *sites, unsigned int uiStackId,
+                             size_t size, double dWeight)
+{
+  struct generationSite *site;
+  long long llCount;
+  long long llBytes;
+
+  estimate (size, dWeight, &llCount, &llBytes);
+  if (uiStackId == STACK_ID_NO_BACKTRACE)
+  {
+    site = &sites[SML_CALLSITE_MAX+1];
+  }
+  else
+  {
+    site = &sites[STACK_ID_IS_SITE (uiStackId) ? uiStackId : 0];
+  }
+  site->llCount += llCount;
+  site->llBytes += llBytes;
+}
+
+void mem_report_since (FILE *fp, unsigned int uiGeneration)
+{
+  struct memoryRegistry *registry;
+  struct memoryHeader *ml;
+  struct poolSlab *slab;
+  struct poolSlot *slot;
+  struct generationSite *sites;
+  unsigned int *uiOrder;
+  unsigned int uiSlot;
+  unsigned int uiSites = 0;
+  unsigned int uiGap;
+  unsigned int ui;
+  unsigned int uj;
+  unsigned int uiSwap;
+#if (defined _EXECINFO_H && _EXECINFO_H == 1)
+  unsigned int uiCount;
+#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+  size_t sMap;
+  void *vBlock;
+  long long llCount = 0;
+  long long llBytes = 0;
+  int iLen;
+
+  // one entry per possible call site, only the pages of the sites that are
+  // used get touched.  Nothing is printed with a registry locked, fprintf(3)
+  // may allocate
+  sMap = (SML_CALLSITE_MAX+2) * (sizeof (struct generationSite) + sizeof (unsigned int));
+  sites = (struct generationSite *) mmap (NULL, sMap, PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (sites == MAP_FAILED)
+  {
+    fprintf (fp, "mem_report_since: out of memory\n");
+    return;
+  }
+  uiOrder = (unsigned int *) (sites + SML_CALLSITE_MAX+2);
+
+  for (registry = registryNext (NULL) ;
+       registry != NULL ;
+       registry = registryNext (registry))
+  {
+    MUTEX_LOCK (&registry->mutex);
+    for (ml = registry->listHead.lh_first ;
+         ml != NULL ;
+         ml = ml->doubleLL.le_next)
+    {
+      prefetchNext (ml);
+      if (ml->uiStackId != 0 && !IS_REMOTE_FREED (ml) &&
+          GENERATION_SINCE (ml->uiGeneration, uiGeneration))
+      {
+        generationCount (sites, ml->uiStackId, ml->size, ml->dWeight);
+      }
+    }
+    for (slab = NULL ; (slot = poolNext (registry, &slab, &uiSlot, &vBlock)) != NULL ; )
+    {
+      if (GENERATION_SINCE (slot->uiGeneration, uiGeneration))
+      {
+        generationCount (sites, slot->uiStackId, slot->uiSize, 1.0);
+      }
+    }
+    MUTEX_UNLOCK (&registry->mutex);
+  }
+
+  // the sites that have any, the ones in use are listed in gui_callSiteOrder
+  if (sites[0].llCount != 0)
+  {
+    uiOrder[uiSites++] = 0;
+  }
+  if (sites[SML_CALLSITE_MAX+1].llCount != 0)
+  {
+    uiOrder[uiSites++] = SML_CALLSITE_MAX+1;
+  }
+#if (defined _EXECINFO_H && _EXECINFO_H == 1)
+  uiCount = __atomic_load_n (&gui_callSiteCount, __ATOMIC_ACQUIRE);
+  for (ui = 0 ; ui < uiCount ; ui++)
+  {
+    if (sites[gui_callSiteOrder[ui]+1].llCount != 0)
+    {
+      uiOrder[uiSites++] = gui_callSiteOrder[ui]+1;
+    }
+  }
+#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+  for (ui = 0 ; ui < uiSites ; ui++)
+  {
+    llCount += sites[uiOrder[ui]].llCount;
+    llBytes += sites[uiOrder[ui]].llBytes;
+  }
+
+  // shell sort, qsort(3) may allocate.  The most bytes first
+  for (uiGap = uiSites/2 ; uiGap > 0 ; uiGap /= 2)
+  {
+    for (ui = uiGap ; ui < uiSites ; ui++)
+    {
+      for (uj = ui ;
+           uj >= uiGap && sites[uiOrder[uj-uiGap]].llBytes < sites[uiOrder[uj]].llBytes ;
+           uj -= uiGap)
+      {
+        uiSwap = uiOrder[uj];
+        uiOrder[uj] = uiOrder[uj-uiGap];
+        uiOrder[uj-uiGap] = uiSwap;
+      }
+    }
+  }
+
+  if (uiSites == 0)
+  {
+    fprintf (fp, "No blocks allocated since generation %u are live\n", uiGeneration);
+  }
+  else
+  {
+    iLen = fprintf (fp, "\n%s%lld block%s (%lld bytes) allocated since generation %u %s live, from %u call site%s\n",
+                    gi_sampling ? "about " : "", llCount, llCount != 1 ? "s" : "", llBytes,
+                    uiGeneration, llCount != 1 ? "are" : "is", uiSites, uiSites != 1 ? "s" : "");
+    while (--iLen > 1)
+    {
+      fprintf (fp, "-");
+    }
+    fprintf (fp, "\n");
+    for (ui = 0 ; ui < uiSites ; ui++)
+    {
+      fprintf (fp, "  %lld block%s, %lld bytes, allocated by \"%s\"\n",
+               sites[uiOrder[ui]].llCount, sites[uiOrder[ui]].llCount != 1 ? "s" : "",
+               sites[uiOrder[ui]].llBytes,
+               getStackName (uiOrder[ui] == 0 ? STACK_ID_UNKNOWN :
+                             uiOrder[ui] == SML_CALLSITE_MAX+1 ? STACK_ID_NO_BACKTRACE : uiOrder[ui]));
+    }
+    fprintf (fp, "\n");
+  }
+
+  munmap (sites, sMap);
+}
+
+static void end (void)
+{
+#ifdef _PTHREAD_H
+  struct mem_stats stats;
+#endif //_PTHREAD_H
+
+  mem_show_allocations (stderr);
+  mem_check_integrity ();
+#ifdef _PTHREAD_H
+  // which threads the heap is left to, and what the locks in here cost
+  mem_get_stats (&stats);
+  fprintf (stderr, "\nthreads\n-------\n");
+  showThreadStats (stderr, &stats);
+  fprintf (stderr, "\n");
+  if (gi_eventLog)
+  {
+    eventFinish ();
+  }
+#endif //_PTHREAD_H
+
+
+  // the registry mutexes are not destroyed, glibc and the destructors of
+  // other libraries still free memory after this has run
+}
+
+#if (defined _EXECINFO_H && _EXECINFO_H == 1)
+// name one return address the way backtrace_symbols(3) does, but with
+// dladdr(3), which doesn't allocate any memory.  Written as "name+0xoff<<-"
+static size_t getFunction (char *szDst, size_t sOffset, void *vAddr, size_t sMax)
+{
+  Dl_info info;
+  int iLen;
+
+  if (sOffset >= sMax)
+  {
+    return sOffset;
+  }
+
+  if (dladdr (vAddr, &info) == 0)
+  {
+    iLen = snprintf (szDst+sOffset, sMax-sOffset, "%p<<-", vAddr);
+  }
+  else if (info.dli_sname != NULL)
+  {
+    iLen = snprintf (szDst+sOffset, sMax-sOffset, "%s+0x%lx<<-", info.dli_sname,
+                     (unsigned long) ((char *) vAddr - (char *) info.dli_saddr));
+  }
+  else
+  {
+    iLen = snprintf (szDst+sOffset, sMax-sOffset, "+0x%lx<<-",
+                     (unsigned long) ((char *) vAddr - (char *) info.dli_fbase));
+  }
+
+  if (iLen < 0 || (size_t) iLen >= sMax-sOffset)
+  {
+    // truncated, snprintf(3) has terminated it
+    return sMax;
+  }
+
+  return sOffset + iLen;
+}
+
+// hand out memory for the call site names, which are never freed.  Only
+// called with g_callSiteMutex held
+static char *callSiteNameAlloc (size_t size)
+{
+  static char *szArena = NULL;
+  static size_t sLeft = 0;
+  char *szPtr;
+
+  if (size > sLeft)
+  {
+    szArena = (char *) mmap (NULL, SML_CALLSITE_ARENA, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (szArena == MAP_FAILED)
+    {
+      szArena = NULL;
+      sLeft = 0;
+      return NULL;
+    }
+    sLeft = SML_CALLSITE_ARENA;
+  }
+  szPtr = szArena;
+  szArena += size;
+  sLeft -= size;
+
+  return szPtr;
+}
+
+static const char *getStackName (unsigned int uiStackId)
+{
+  struct callSite *site;
+  char szName[SML_CALLSITE_NAME_MAX];
+  char *szCopy;
+  size_t sPos = 0;
+  int i;
+
+  if (uiStackId == 0)
+  {
+    return "(inside the hooks)";
+  }
+  if (uiStackId == STACK_ID_NO_BACKTRACE)
+  {
+    return "backtraceFailed";
+  }
+  if (!STACK_ID_IS_SITE (uiStackId) || gp_callSites == NULL)
+  {
+    return "callSiteTableFull";
+  }
+
+  site = &gp_callSites[uiStackId-1];
+  szCopy = __atomic_load_n (&site->szName, __ATOMIC_ACQUIRE);
+  if (szCopy != NULL)
+  {
+    return szCopy;
+  }
+
+  // only symbolized the first time it's reported
+  MUTEX_LOCK (&g_callSiteMutex);
+  if (site->szName == NULL)
+  {
+    for (i = 0 ; i < site->iDepth ; i++)
+    {
+      sPos = getFunction (szName, sPos, site->vFrames[i], sizeof (szName));
+    }
+    if (sPos >= sizeof (szName))
+    {
+      sPos = strlen (szName);
+    }
+    else if (sPos >= 3)
+    {
+      // drop the trailing "<<-"
+      sPos -= 3;
+      szName[sPos] = '\0';
+    }
+    else
+    {
+      // this should never happen..
+      szName[0] = '\0';
+      sPos = 0;
+    }
+
+    szCopy = callSiteNameAlloc (sPos+1);
+    if (szCopy != NULL)
+    {
+      memcpy (szCopy, szName, sPos+1);
+      __atomic_store_n (&site->szName, szCopy, __ATOMIC_RELEASE);
+    }
+  }
+  szCopy = site->szName;
+  MUTEX_UNLOCK (&g_callSiteMutex);
+
+  return szCopy != NULL ? szCopy : "callSiteNameFailed";
+}
+
+// capture the return addresses of the caller, skipping iLen-1 frames (this
+// function, the internal ones and the malloc(3) wrapper), and return the ID
+// of the matching entry in the call site table.  Nothing is symbolized here.
+// Each entry point passes the iLen for a trace() in the function it calls,
+// and every internal function in between adds 1 for itself
+static unsigned int trace (int iLen)
+{
+  void *buffer[SML_TRACE_DEPTH+8];
+  void **vFrames;
+  struct callSite *site;
+  unsigned long long ullHash;
+  unsigned long long ullSlotHash;
+  unsigned int uiIndex;
+  unsigned int uiProbe;
+  int iDepth;
+  int i;
+
+  if (gp_callSites == NULL)
+  {
+    return STACK_ID_UNKNOWN;
+  }
+
+  iDepth = backtrace (buffer, sizeof(buffer)/sizeof(buffer[0])) - (iLen-1);
+  if (iDepth <= 0)
+  {
+    return STACK_ID_NO_BACKTRACE;
+  }
+  if (iDepth > SML_TRACE_DEPTH)
+  {
+    iDepth = SML_TRACE_DEPTH;
+  }
+  vFrames = &buffer[iLen-1];
+
+  ullHash = (unsigned long long) iDepth;
+  for (i = 0 ; i < iDepth ; i++)
+  {
+    ullHash = (ullHash ^ (unsigned long long) vFrames[i]) * 0x9E3779B97F4A7C15ULL;
+  }
+  ullHash |= 1; // 0 marks an empty slot
+
+  // open addressing with linear probing.  Entries are never removed or
+  // changed once their hash is published, so the lookup doesn't lock
+  for (uiProbe = 0, uiIndex = (unsigned int) (ullHash >> 32) & (SML_CALLSITE_MAX-1) ;
+       uiProbe < SML_CALLSITE_MAX ;
+       uiProbe++, uiIndex = (uiIndex+1) & (SML_CALLSITE_MAX-1))
+  {
+    site = &gp_callSites[uiIndex];
+    ullSlotHash = __atomic_load_n (&site->ullHash, __ATOMIC_ACQUIRE);
+    if (ullSlotHash == 0)
+    {
+      break;
+    }
+    if (ullSlotHash == ullHash && site->iDepth == iDepth &&
+        memcmp (site->vFrames, vFrames, iDepth * sizeof (vFrames[0])) == 0)
+    {
+      return uiIndex+1;
+    }
+  }
+
+  // a new call site, probe again under the mutex as another thread may have
+  // been adding the same one
+  MUTEX_LOCK (&g_callSiteMutex);
+  for ( ;
+       uiProbe < SML_CALLSITE_MAX ;
+       uiProbe++, uiIndex = (uiIndex+1) & (SML_CALLSITE_MAX-1))
+  {
+    site = &gp_callSites[uiIndex];
+    if (site->ullHash == 0)
+    {
+      site->iDepth = iDepth;
+      memcpy (site->vFrames, vFrames, iDepth * sizeof (vFrames[0]));
+      __atomic_store_n (&site->ullHash, ullHash, __ATOMIC_RELEASE);
+      gui_callSiteOrder[gui_callSiteCount] = uiIndex;
+      __atomic_store_n (&gui_callSiteCount, gui_callSiteCount+1, __ATOMIC_RELEASE);
+      break;
+    }
+    if (site->ullHash == ullHash && site->iDepth == iDepth &&
+        memcmp (site->vFrames, vFrames, iDepth * sizeof (vFrames[0])) == 0)
+    {
+      break;
+    }
+  }
+  MUTEX_UNLOCK (&g_callSiteMutex);
+
+  return uiProbe < SML_CALLSITE_MAX ? uiIndex+1 : STACK_ID_UNKNOWN;
+}
+#else
+static unsigned int trace (int iLen)
+{
+  (void)iLen;
+
+  return STACK_ID_UNKNOWN;
+}
+
+static const char *getStackName (unsigned int uiStackId)
+{
+  (void)uiStackId;
+
+  return "traceDisabled";
+}
+#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+
+static struct memoryHeader *verifyIntegrity (void *vPtr)
+{
+  struct memoryHeader *mHead;
+
+  if (guardOwns (vPtr))
+  {
+    return guardVerify (vPtr);
+  }
+
+  // adjust pointer to the actual start of allocation
+  mHead = ((struct memoryHeader *)(vPtr))-1;
+
+  verifyGuards (vPtr, mHead->size);
+
+  return mHead;
+}
+
+// the guard bands sit right around the caller's bytes, the top one is the
+// end of the header (or of the pool slot).  This is called for every block
+// by the walkers, so the good case is a handful of wide compares - only if
+// one of them fails is the block checked again byte by byte, to report
+// exactly what was over-written
+static void verifyGuards (void *vPtr, size_t size)
+{
+  if (!guardsIntact (vPtr, size))
+  {
+    verifyGuardsSlow (vPtr, size);
+  }
+}
+
+// 1 if the guard bands and the pad of the block are all as written
+static int guardsIntact (void *vPtr, size_t size)
+{
+  unsigned long long *ullTop;
+  unsigned long long *ullCap;
+  unsigned long long ullBad = 0;
+#if GUARD_TAIL_WORD
+  unsigned long long *ullTail;
+  unsigned long long ullMask;
+#else
+  unsigned char *ucPtr;
+#endif //GUARD_TAIL_WORD
+#if (defined __SSE2__ && MEM_HEADER_GUARD_LEN == 2 && MEM_CAP_GUARD_LEN == 2)
+  __m128i xTop;
+  __m128i xCap;
+#else
+  int i;
+#endif //(defined __SSE2__ && MEM_HEADER_GUARD_LEN == 2 && MEM_CAP_GUARD_LEN == 2)
+
+  ullTop = ((unsigned long long *) vPtr) - MEM_HEADER_GUARD_LEN;
+  ullCap = (unsigned long long *) (((unsigned long long) vPtr + size + sizeof (unsigned long long) - 1) &
+                                   ~(unsigned long long) (sizeof (unsigned long long) - 1));
+
+#if (defined __SSE2__ && MEM_HEADER_GUARD_LEN == 2 && MEM_CAP_GUARD_LEN == 2)
+  // both guard bands are 16 bytes, one compare each.  The cap is only 8
+  // byte aligned, so these are unaligned loads
+  xTop = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i *) ullTop),
+                          _mm_set1_epi64x ((long long) GUARD_BAND_TOP));
+  xCap = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i *) ullCap),
+                          _mm_set1_epi64x ((long long) GUARD_BAND_BOTTOM));
+  ullBad = _mm_movemask_epi8 (_mm_and_si128 (xTop, xCap)) != 0xFFFF;
+#else
+  for (i = 0 ; i < MEM_HEADER_GUARD_LEN ; i++)
+  {
+    ullBad |= ullTop[i] ^ GUARD_BAND_TOP;
+  }
+  for (i = 0 ; i < MEM_CAP_GUARD_LEN ; i++)
+  {
+    ullBad |= ullCap[i] ^ GUARD_BAND_BOTTOM;
+  }
+#endif //(defined __SSE2__ && MEM_HEADER_GUARD_LEN == 2 && MEM_CAP_GUARD_LEN == 2)
+
+#if GUARD_TAIL_WORD
+  if (size % sizeof (unsigned long long))
+  {
+    // the last word holds the caller's last bytes and then the pad, only the
+    // pad is compared
+    ullTail = ullCap-1;
+    ullMask = ~0ULL << (8 * (size % sizeof (unsigned long long)));
+    ullBad |= (*ullTail ^ (GUARD_TAIL_PATTERN + ((unsigned long long) ullTail & 0xFF) * GUARD_TAIL_BYTES)) & ullMask;
+  }
+#else
+  for (ucPtr = (unsigned char *) vPtr + size ; ucPtr < (unsigned char *) ullCap ; ucPtr++)
+  {
+    ullBad |= *ucPtr ^ (unsigned char) (((unsigned long long) ucPtr) & 0xFF);
+  }
+#endif //GUARD_TAIL_WORD
+
+  return ullBad == 0;
+}
+
+
+// the original byte by byte check, which doesn't return if the block is bad
+static void verifyGuardsSlow (void *vPtr, size_t size)
+{
+  unsigned long long *ullTop;
+  struct memoryCap    *mCap;
+  unsigned char *ucPtr;
+  size_t s;
+  int i;
+
+  ullTop = ((unsigned long long *) vPtr) - MEM_HEADER_GUARD_LEN;
+  for (i = 0 ; i < MEM_HEADER_GUARD_LEN ; i++)
+  {
+    ASSERT (ullTop[i] == GUARD_BAND_TOP,
+            "Top guard band %d corrupt expected 0x%016llX got 0x016%llX - this is BEFORE allocated memory\n",
+            i, GUARD_BAND_TOP, ullTop[i]);
+  }
+
+  ucPtr = ((unsigned char *) vPtr);
+  for (s = size ;
+       ((unsigned long long) (ucPtr + s)) % (sizeof (unsigned long long));
+       s++)
+  {
+    ASSERT (ucPtr[s] == (unsigned char) (((unsigned long long) (ucPtr+s)) & 0xFF),
+            "end of alloc memory over-written %zu bytes beyond end", 1+s-size);
+  }
+  mCap = (struct memoryCap *)(ucPtr + s);
+
+  for (i = 0 ; i < MEM_CAP_GUARD_LEN ; i++)
+  {
+    ASSERT (mCap->ullFixedValues[i] == GUARD_BAND_BOTTOM,
+            "Bottom guard band %d corrupt expected 0x%016llX got 0x%016llX - this is AFTER allocated memory\n",
+            i, GUARD_BAND_BOTTOM, mCap->ullFixedValues[i]);
+  }
+}
+
+// fill up any unused bytes at the end of the allocation with essentially
+// address == data, and place guard bands on the memory at the bottom and top
+// of memory
+static void writeGuards (void *vPtr, size_t size)
+{
+  unsigned long long *ullTop;
+  struct memoryCap    *mCap;
+  unsigned char *ucPtr;
+  size_t s;
+  int i;
+
+  ullTop = ((unsigned long long *) vPtr) - MEM_HEADER_GUARD_LEN;
+  for (i = 0 ; i < MEM_HEADER_GUARD_LEN ; i++)
+  {
+    ullTop[i] = GUARD_BAND_TOP;
+  }
+
+  ucPtr = ((unsigned char *) vPtr);
+#if GUARD_TAIL_WORD
+  s = size;
+  if (s % sizeof (unsigned long long))
+  {
+    unsigned long long *ullTail;
+    unsigned long long ullMask;
+
+    // keep the caller's bytes in the last word and fill the pad in one go
+    ullTail = (unsigned long long *) (((unsigned long long) (ucPtr + s)) &
+                                      ~(unsigned long long) (sizeof (unsigned long long) - 1));
+    ullMask = ~0ULL << (8 * (s % sizeof (unsigned long long)));
+    *ullTail = (*ullTail & ~ullMask) |
+               ((GUARD_TAIL_PATTERN + ((unsigned long long) ullTail & 0xFF) * GUARD_TAIL_BYTES) & ullMask);
+    s = (unsigned char *) (ullTail+1) - ucPtr;
+  }
+#else
+  for (s = size ;
+       ((unsigned long long) (ucPtr + s)) % (sizeof (unsigned long long));
+       s++)
+  {
+    ucPtr[s] = (unsigned char) (((unsigned long long) (ucPtr+s)) & 0xFF);
+  }
+#endif //GUARD_TAIL_WORD
+
+  // fill up the cap
+  mCap = (struct memoryCap *)(ucPtr + s);
+  for (i = 0 ; i < MEM_CAP_GUARD_LEN ; i++)
+  {
+    mCap->ullFixedValues[i] = GUARD_BAND_BOTTOM;
+  }
+}
+
+// the walkers spend most of their time waiting for the next header to come
+// in from memory, as each block is a separate allocation.  While one block
+// is verified, this asks for the header two blocks ahead, and for the cap of
+// the next block (whose header was asked for in the previous step, so its
+// size is normally there by now)
+static void prefetchNext (struct memoryHeader *ml)
+{
+  struct memoryHeader *mNext;
+
+  mNext = ml->doubleLL.le_next;
+  if (mNext == NULL)
+  {
+    return;
+  }
+  __builtin_prefetch ((char *) (mNext+1) + mNext->size);
+  mNext = mNext->doubleLL.le_next;
+  if (mNext != NULL)
+  {
+    // the header spans two cache lines, the guards are at its end
+    __builtin_prefetch (mNext);
+    __builtin_prefetch (mNext->ullFixedValues);
+  }
+}
+
+
+// e^-x for x >= 0, without pulling libm into the library
+static double sampleExpNeg (double x)
+{
+  const double dLn2 = 0.69314718055994530942;
+  double dTerm = 1.0;
+  double dSum = 1.0;
+  int iShift;
+  int i;
+
+  if (x > 40.0)
+  {
+    return 0.0;
+  }
+
+  // e^-x = 2^-n * e^-r with r in [0, ln 2), and a short series for e^-r
+  iShift = (int) (x / dLn2);
+  x -= iShift * dLn2;
+  for (i = 1 ; i < 12 ; i++)
+  {
+    dTerm *= -x / i;
+    dSum += dTerm;
+  }
+
+  return dSum / (double) (1ULL << iShift);
+}
+
+// the number of bytes until the next sample, drawn from an exponential
+// distribution with a mean of gs_sampleInterval
+static long long sampleNextInterval (void)
+{
+  const double dLn2 = 0.69314718055994530942;
+  unsigned long long ullRandom;
+  unsigned long long ullQ;
+  double dFraction;
+  double dLog2;
+  int iExp;
+
+  if (gull_sampleRandom == 0)
+  {
+    // seed each thread differently, without a system call
+    gull_sampleRandom = ((unsigned long long) &gll_sampleCountdown * 0x9E3779B97F4A7C15ULL) | 1;
+  }
+
+  // xorshift64*
+  ullRandom = gull_sampleRandom;
+  ullRandom ^= ullRandom >> 12;
+  ullRandom ^= ullRandom << 25;
+  ullRandom ^= ullRandom >> 27;
+  gull_sampleRandom = ullRandom;
+  ullRandom *= 0x2545F4914F6CDD1DULL;
+
+  // -ln(U) for U uniform in (0,1] is (26 - log2(q)) * ln 2, with q in
+  // [1, 2^26].  log2() is approximated by a quadratic in the mantissa, good
+  // to about 0.005
+  ullQ = (ullRandom >> 38) + 1;
+  iExp = 63 - __builtin_clzll (ullQ);
+  dFraction = (double) (ullQ - (1ULL << iExp)) / (double) (1ULL << iExp);
+  dLog2 = iExp + dFraction * (1.3465 - 0.3465 * dFraction);
+
+  return 1 + (long long) ((26.0 - dLog2) * dLn2 *
+                          (double) __atomic_load_n (&gs_sampleInterval, __ATOMIC_RELAXED));
+}
+
+// counts size off the thread's countdown, 1 if this allocation is sampled
+static int sampleThisAllocation (size_t size)
+{
+  long long llLeft;
+
+  llLeft = gll_sampleCountdown - (long long) size;
+  if (llLeft > 0)
+  {
+    gll_sampleCountdown = llLeft;
+    return 0;
+  }
+
+  if (gull_sampleRandom == 0)
+  {
+    // the first allocation of a thread starts its countdown
+    gll_sampleCountdown = sampleNextInterval ();
+    return sampleThisAllocation (size);
+  }
+  gll_sampleCountdown = sampleNextInterval ();
+
+  return 1;
+}
+
+// 1 over the chance that a block of this size is sampled, so that the
+// sampled blocks, each scaled up by its weight, add up to the whole heap
+static double sampleWeight (size_t size)
+{
+  double dChance;
+
+  if (!gi_sampling || size == 0)
+  {
+    return 1.0;
+  }
+
+  dChance = 1.0 - sampleExpNeg ((double) size /
+                                (double) __atomic_load_n (&gs_sampleInterval, __ATOMIC_RELAXED));
+  if (dChance <= 0.0)
+  {
+    return 1.0;
+  }
+
+  return 1.0 / dChance;
+}
+
+// how many allocations, and how many bytes, a block stands for.  The same
+// numbers come out when it's counted in and when it's counted out
+static void estimate (size_t size, double dWeight, long long *llCount, long long *llBytes)
+{
+  if (dWeight == 1.0)
+  {
+    *llCount = 1;
+    *llBytes = (long long) size;
+    return;
+  }
+
+  *llCount = (long long) (dWeight + 0.5);
+  *llBytes = (long long) ((double) size * dWeight + 0.5);
+}
+
+static void **sampledSetBucket (void *vPtr, int iProbe)
+{
+  unsigned long long ullHash;
+
+  ullHash = ((unsigned long long) vPtr) >> 4;
+  ullHash *= 0x9E3779B97F4A7C15ULL;
+
+  return &gp_sampledSet[(((ullHash >> 32) + iProbe) & (SML_SAMPLE_SET_BUCKETS-1)) * SML_SAMPLE_SET_WAYS];
+}
+
+// a pointer only ever goes in one of SML_SAMPLE_SET_PROBES buckets, so a
+// look up reads at most that many cache lines, and a slot that's emptied
+// again is just a NULL - there are no tombstones to build up.  0 if there
+// was no room
+static int sampledSetInsert (void *vPtr)
+{
+  void **vBucket;
+  void *vEmpty;
+  int iProbe;
+  int i;
+
+  for (iProbe = 0 ; iProbe < SML_SAMPLE_SET_PROBES ; iProbe++)
+  {
+    vBucket = sampledSetBucket (vPtr, iProbe);
+    for (i = 0 ; i < SML_SAMPLE_SET_WAYS ; i++)
+    {
+      vEmpty = NULL;
+      if (__atomic_load_n (&vBucket[i], __ATOMIC_RELAXED) == NULL &&
+          __atomic_compare_exchange_n (&vBucket[i], &vEmpty, vPtr, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      {
+        __atomic_add_fetch (&gl_sampledLive, 1, __ATOMIC_RELAXED);
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// the slot holding vPtr, NULL if it wasn't sampled
+static void **sampledSetFind (void *vPtr)
+{
+  void **vBucket;
+  int iProbe;
+  int i;
+
+  if (__atomic_load_n (&gl_sampledLive, __ATOMIC_RELAXED) == 0)
+  {
+    return NULL;
+  }
+
+  for (iProbe = 0 ; iProbe < SML_SAMPLE_SET_PROBES ; iProbe++)
+  {
+    vBucket = sampledSetBucket (vPtr, iProbe);
+    for (i = 0 ; i < SML_SAMPLE_SET_WAYS ; i++)
+    {
+      if (__atomic_load_n (&vBucket[i], __ATOMIC_RELAXED) == vPtr)
+      {
+        return &vBucket[i];
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// 1 if vPtr was a sampled block, it's taken out of the set
+static int sampledSetRemove (void *vPtr)
+{
+  void **vSlot;
+
+  vSlot = sampledSetFind (vPtr);
+  if (vSlot == NULL)
+  {
+    return 0;
+  }
+
+  __atomic_store_n (vSlot, NULL, __ATOMIC_RELEASE);
+  __atomic_sub_fetch (&gl_sampledLive, 1, __ATOMIC_RELAXED);
+
+  return 1;
+}
+
+#define REALLOC  0
+#define MALLOC   1
+#define CALLOC   2
+#define MEMALIGN 3
+
+// in sampling mode only the sampled allocations are tracked, the rest (and
+// anything allocated inside the hooks) goes straight to glibc
+static void *sampledAlloc (size_t size, size_t nmemb, unsigned char type, size_t alignment, int iLen)
+{
+  void *vPtr;
+
+  if (!gi_hookDisabled && sampleThisAllocation (size*nmemb))
+  {
+    vPtr = internalRealloc (NULL, size, nmemb, type, 0.0, alignment, iLen+1);
+    if (vPtr == NULL)
+    {
+      return NULL;
+    }
+    if (sampledSetInsert (vPtr))
+    {
+      if (type == CALLOC)
+      {
+        memset (vPtr, 0, size*nmemb);
+      }
+      return vPtr;
+    }
+
+    // the set is full, free(3) couldn't tell this one apart from the others
+    internalFree (vPtr, SIZE_UNKNOWN, iLen+1);
+  }
+
+  if (type == CALLOC)
+  {
+    return gp_orgCalloc (size, nmemb);
+  }
+  if (type == MEMALIGN)
+  {
+    return gp_orgMemalign (alignment, size*nmemb);
+  }
+  return gp_orgMalloc (size*nmemb);
+}
+
+static void *sampledRealloc (void *vPtr, size_t size, int iLen)
+{
+  struct memoryHeader *mHead;
+  void *vNew;
+
+  if (vPtr == NULL)
+  {
+    return sampledAlloc (size, 1, REALLOC, 0, iLen+1);
+  }
+
+  // a block that wasn't sampled has no header, and no size to copy from, so
+  // it stays that way
+  if (sampledSetFind (vPtr) == NULL)
+  {
+    return gp_orgRealloc (vPtr, size);
+  }
+
+  // a sampled block stays sampled, with the weight it was sampled with.  It's
+  // moved by hand, so the old one is in the set until it's really gone -
+  // glibc could hand its address out again to another thread as soon as
+  // realloc(3) returns
+  mHead = verifyIntegrity (vPtr);
+  if (reallocInPlace (mHead, size))
+  {
+    return vPtr;
+  }
+
+  vNew = internalRealloc (NULL, size, 1, REALLOC, mHead->dWeight, 0, iLen+1);
+  if (vNew == NULL)
+  {
+    return NULL;
+  }
+  if (!sampledSetInsert (vNew))
+  {
+    internalFree (vNew, SIZE_UNKNOWN, iLen+1);
+    vNew = gp_orgMalloc (size);
+    if (vNew == NULL)
+    {
+      return NULL;
+    }
+  }
+  memcpy (vNew, vPtr, size < mHead->size ? size : mHead->size);
+  sampledSetRemove (vPtr);
+  internalFree (vPtr, SIZE_UNKNOWN, iLen+1);
+
+  return vNew;
+}
+
+// blocks of sBytes or more get pages of their own.  Only address space is
+// reserved here, a span is made usable as it's handed out.  If this fails
+// every block just keeps its guard words
+static void guardInit (size_t sBytes)
+{
+  char *szRegion;
+
+  gs_pageSize = (size_t) sysconf (_SC_PAGESIZE);
+  szRegion = (char *) mmap (NULL, SML_GUARD_REGION_SIZE, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (szRegion != MAP_FAILED)
+  {
+    gp_guardRegion = szRegion;
+    gi_guardBefore = getenv ("SML_GUARD_BEFORE") != NULL;
+    gs_guardBytes = sBytes;
+  }
+}
+
+// a range compare like poolOwns(), true for the headers on the lists as well
+// as for the caller's pointers
+static int guardOwns (void *vPtr)
+{
+  return (unsigned long long) ((char *) vPtr - gp_guardRegion) <
+         __atomic_load_n (&gull_guardUsed, __ATOMIC_ACQUIRE);
+}
+
+// a span for a block of size bytes: the header's page, then the caller's
+// pages and the guard page after them (or the guard page first, with
+// SML_GUARD_BEFORE).  The bytes end right at the guard page, or start right
+// after it, apart from the pad up to the alignment.  NULL once the region is
+// used up, or if the kernel won't split the mapping any further, and the
+// block goes to glibc instead
+static struct memoryHeader *guardMap (size_t size, size_t alignment)
+{
+  struct guardSpan *span;
+  unsigned long long ullUsed;
+  size_t sData;
+  size_t sPages;
+  size_t sSpan;
+  int iFailed;
+
+  if (alignment < ALIGN_PLAIN)
+  {
+    alignment = ALIGN_PLAIN;
+  }
+  sData = (size + alignment-1) & ~(alignment-1);
+  sPages = (sData + gs_pageSize-1) & ~(gs_pageSize-1);
+  if (sData < size || sPages < sData || sPages + 2*gs_pageSize < sPages)
+  {
+    return NULL;
+  }
+  sSpan = sPages + 2*gs_pageSize;
+
+  // never past the end, or guardOwns() would take in whatever is mapped there
+  ullUsed = __atomic_load_n (&gull_guardUsed, __ATOMIC_RELAXED);
+  do
+  {
+    if (sSpan > SML_GUARD_REGION_SIZE - ullUsed)
+    {
+      return NULL;
+    }
+  } while (!__atomic_compare_exchange_n (&gull_guardUsed, &ullUsed, ullUsed + sSpan, 1,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  span = (struct guardSpan *) (gp_guardRegion + ullUsed);
+  if (gi_guardBefore)
+  {
+    iFailed = mprotect (span, gs_pageSize, PROT_READ | PROT_WRITE) != 0 ||
+              mprotect ((char *) span + 2*gs_pageSize, sPages, PROT_READ | PROT_WRITE) != 0;
+  }
+  else
+  {
+    iFailed = mprotect (span, gs_pageSize + sPages, PROT_READ | PROT_WRITE) != 0;
+  }
+  if (iFailed)
+  {
+    mmap (span, sSpan, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    return NULL;
+  }
+
+  span->szData = gi_guardBefore ? (char *) span + 2*gs_pageSize :
+                                  (char *) span + gs_pageSize + sPages - sData;
+  span->sData = sData;
+  span->sSpan = sSpan;
+  span->head.size = size;
+
+  return &span->head;
+}
+
+// the header of a guarded block, from the caller's pointer.  The caller's
+// bytes start in the page after the header's (or after the guard page that
+// follows it), and that page is all it takes to find it.  Only the pad is
+// checked, an over-run past it has already faulted
+static struct memoryHeader *guardVerify (void *vPtr)
+{
+  struct guardSpan *span;
+  unsigned char *ucPtr;
+  size_t s;
+
+  span = (struct guardSpan *) (((unsigned long long) vPtr & ~(unsigned long long) (gs_pageSize-1)) -
+                               (gi_guardBefore ? 2 : 1) * gs_pageSize);
+  ASSERT (span->szData == (char *) vPtr, "%p is not the start of a guarded block (that starts at %p)",
+          vPtr, span->szData);
+
+  ucPtr = (unsigned char *) vPtr;
+  for (s = span->head.size ; s < span->sData ; s++)
+  {
+    ASSERT (ucPtr[s] == (unsigned char) (((unsigned long long) (ucPtr+s)) & 0xFF),
+            "end of alloc memory over-written %zu bytes beyond end", 1+s-span->head.size);
+  }
+
+  return &span->head;
+}
+
+// the pad of a guarded block, the same pattern as writeGuards() puts in
+static void guardWritePad (struct memoryHeader *mHead)
+{
+  struct guardSpan *span = (struct guardSpan *) mHead;
+  unsigned char *ucPtr = (unsigned char *) span->szData;
+  size_t s;
+
+  for (s = mHead->size ; s < span->sData ; s++)
+  {
+    ucPtr[s] = (unsigned char) (((unsigned long long) (ucPtr+s)) & 0xFF);
+  }
+}
+
+// a fresh PROT_NONE mapping over the span gives its pages back.  The address
+// space isn't used again, so a use (or a second free) of the block faults
+static void guardRelease (struct memoryHeader *mHead)
+{
+  struct guardSpan *span = (struct guardSpan *) mHead;
+
+  mmap (span, span->sSpan, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+#if SML_POOL_ENABLED
+static void poolInit (void)
+{
+  char *szRegion;
+  unsigned int uiClass;
+  unsigned int uiSlotSize;
+  unsigned int uiSlots;
+  unsigned int ui;
+  size_t sOffset;
+
+  for (ui = 0, uiClass = 0 ; ui <= SML_POOL_MAX_SIZE/16 ; ui++)
+  {
+    while (gui_poolClassSize[uiClass] < ui*16)
     {
-      // this should never happen..
-      free (szPtr);
-      szPtr = NULL;
+      uiClass++;
     }
+    guc_poolClass[ui] = (unsigned char) uiClass;
   }
 
-  free(strings);
+  // as many slots as fit after the side table, which the slots start on a
+  // cache line after
+  for (uiClass = 0 ; uiClass < SML_POOL_CLASSES ; uiClass++)
+  {
+    uiSlotSize = gui_poolClassSize[uiClass] + POOL_SLOT_GUARDS;
+    uiSlots = (SML_POOL_SLAB_SIZE - sizeof (struct poolSlab)) / (uiSlotSize + sizeof (struct poolSlot));
+    for ( ; ; uiSlots--)
+    {
+      sOffset = sizeof (struct poolSlab) + uiSlots * sizeof (struct poolSlot);
+      sOffset = (sOffset + 63) & ~(size_t) 63;
+      if (sOffset + (size_t) uiSlots * uiSlotSize <= SML_POOL_SLAB_SIZE)
+      {
+        break;
+      }
+    }
+    gui_poolSlots[uiClass] = uiSlots;
+    gui_poolDataOffset[uiClass] = (unsigned int) sOffset;
+  }
 
-  return szPtr;
+  // only address space is reserved here, each slab is made usable as it's
+  // handed out.  If this fails the pool just stays empty
+  szRegion = (char *) mmap (NULL, SML_POOL_REGION_SIZE + SML_POOL_SLAB_SIZE, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (szRegion != MAP_FAILED)
+  {
+    gp_poolRegion = (char *) (((unsigned long long) szRegion + SML_POOL_SLAB_SIZE-1) &
+                              ~(unsigned long long) (SML_POOL_SLAB_SIZE-1));
+  }
 }
-#else
-static char *trace (int iLen, unsigned ucGetPtr)
+
+// only slabs that have been handed out count, so this is never true while
+// the pool is empty (or couldn't be reserved)
+static int poolOwns (void *vPtr)
 {
-  (void)iLen;
-  (void)ucGetPtr;
-  static char szEmpty[] = "traceDisabled";
+  return (unsigned long long) ((char *) vPtr - gp_poolRegion) <
+         __atomic_load_n (&gull_poolSlabsUsed, __ATOMIC_ACQUIRE) * SML_POOL_SLAB_SIZE;
+}
 
-  return szEmpty;
+static void *poolSlotPointer (struct poolSlab *slab, unsigned int uiSlot)
+{
+  return (char *) slab + gui_poolDataOffset[slab->uiClass] +
+         (size_t) uiSlot * (gui_poolClassSize[slab->uiClass] + POOL_SLOT_GUARDS) +
+         MEM_HEADER_GUARD_LEN * sizeof (unsigned long long);
 }
-#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
 
-static struct memoryHeader *verifyIntegrity (void *vPtr)
+// a new slab for the cache, put at the front of its list for the class.
+// Called with the cache's registry mutex held
+static struct poolSlab *poolNewSlab (struct threadCache *cache, unsigned int uiClass)
 {
-  struct memoryHeader *mHead;
-  struct memoryCap    *mCap;
-  unsigned char *ucPtr;
-  size_t s;
+  struct poolSlab *slab;
+  unsigned long long ullIndex;
+
+  ullIndex = __atomic_load_n (&gull_poolSlabsUsed, __ATOMIC_RELAXED);
+  do
+  {
+    if (gp_poolRegion == NULL || ullIndex >= SML_POOL_REGION_SIZE / SML_POOL_SLAB_SIZE)
+    {
+      return NULL;
+    }
+  }
+  while (!__atomic_compare_exchange_n (&gull_poolSlabsUsed, &ullIndex, ullIndex+1, 1,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  slab = (struct poolSlab *) (gp_poolRegion + ullIndex * SML_POOL_SLAB_SIZE);
+  if (mprotect (slab, SML_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE) != 0)
+  {
+    return NULL;
+  }
+
+  // the pages are fresh, so everything else is already 0
+  slab->cache = cache;
+  slab->uiClass = uiClass;
+  slab->next = cache->poolSlabs[uiClass];
+  cache->poolSlabs[uiClass] = slab;
+
+  return slab;
+}
+
+// a free slot of the slab, or POOL_NO_SLOT.  Called with the owner's
+// registry mutex held
+static unsigned int poolTakeSlot (struct poolSlab *slab)
+{
+  unsigned int uiSlot;
+
+  if (slab->uiFree == 0 && slab->uiBump == gui_poolSlots[slab->uiClass])
+  {
+    // take back what other threads have freed, it's linked up already
+    slab->uiFree = __atomic_exchange_n (&slab->uiRemoteFree, 0, __ATOMIC_ACQUIRE);
+    for (uiSlot = slab->uiFree ; uiSlot != 0 ; uiSlot = slab->slots[uiSlot-1].uiNext)
+    {
+      __atomic_store_n (&slab->slots[uiSlot-1].uiState, POOL_SLOT_FREE, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (slab->uiFree != 0)
+  {
+    uiSlot = slab->uiFree - 1;
+    slab->uiFree = slab->slots[uiSlot].uiNext;
+    return uiSlot;
+  }
+  if (slab->uiBump < gui_poolSlots[slab->uiClass])
+  {
+    return slab->uiBump++;
+  }
+
+  return POOL_NO_SLOT;
+}
+
+// NULL if the block has to come from glibc instead
+static void *poolAlloc (size_t size, unsigned char type, int iLen)
+{
+  struct threadCache *cache;
+  struct poolSlab **link;
+  struct poolSlab *slab;
+  struct poolSlot *slot;
+  unsigned int uiClass;
+  unsigned int uiSlot = POOL_NO_SLOT;
+  unsigned int uiCaller;
+  void *vPtr;
+
+  if (size > SML_POOL_MAX_SIZE || gi_hookDisabled || (cache = getThreadCache ()) == NULL)
+  {
+    return NULL;
+  }
+  uiClass = guc_poolClass[(size+15) >> 4];
+
+  gi_hookDisabled = 1;
+  uiCaller = trace (iLen);
+  gi_hookDisabled = 0;
+
+  MUTEX_LOCK (&cache->registry.mutex);
+  // the first slab with room goes to the front, so the search only happens
+  // once a slab has filled up
+  for (link = &cache->poolSlabs[uiClass] ; (slab = *link) != NULL ; link = &slab->next)
+  {
+    uiSlot = poolTakeSlot (slab);
+    if (uiSlot != POOL_NO_SLOT)
+    {
+      if (link != &cache->poolSlabs[uiClass])
+      {
+        *link = slab->next;
+        slab->next = cache->poolSlabs[uiClass];
+        cache->poolSlabs[uiClass] = slab;
+      }
+      break;
+    }
+  }
+  if (slab == NULL)
+  {
+    slab = poolNewSlab (cache, uiClass);
+    if (slab == NULL)
+    {
+      MUTEX_UNLOCK (&cache->registry.mutex);
+      return NULL;
+    }
+    uiSlot = poolTakeSlot (slab);
+  }
+
+  slot = &slab->slots[uiSlot];
+  slot->uiSize = (unsigned int) size;
+  slot->uiStackId = uiCaller;
+  slot->uiGeneration = __atomic_load_n (&gui_generation, __ATOMIC_RELAXED);
+  vPtr = poolSlotPointer (slab, uiSlot);
+  writeGuards (vPtr, size);
+  __atomic_store_n (&slot->uiState, POOL_SLOT_USED, __ATOMIC_RELEASE);
+  MUTEX_UNLOCK (&cache->registry.mutex);
+
+  countAlloc (uiCaller, size, 1, size, NULL);
+  eventLog (type == CALLOC ? MEM_EVENT_CALLOC : type == REALLOC ? MEM_EVENT_REALLOC : MEM_EVENT_MALLOC,
+            vPtr, size, uiCaller);
+  if (SML_PRINTF_ENABLED)
+  {
+    gi_hookDisabled = 1;
+    SML_PRINTF ("pool alloc (%zu) = %p, allocated by %s, %d\n",
+                size, vPtr, getStackName (uiCaller), mem_get_alloc_count ());
+    gi_hookDisabled = 0;
+  }
+
+  return vPtr;
+}
+
+// find the slot of a pooled block, and check it's really allocated
+static struct poolSlot *poolVerify (void *vPtr, struct poolSlab **slabPtr, unsigned int *uiSlotPtr)
+{
+  struct poolSlab *slab;
+  struct poolSlot *slot;
+  unsigned long long ullOffset;
+  unsigned int uiSlotSize;
+  unsigned int uiState;
+
+  ullOffset = (unsigned long long) ((char *) vPtr - gp_poolRegion);
+  slab = (struct poolSlab *) (gp_poolRegion + (ullOffset & ~(unsigned long long) (SML_POOL_SLAB_SIZE-1)));
+  uiSlotSize = gui_poolClassSize[slab->uiClass] + POOL_SLOT_GUARDS;
+
+  ullOffset = (unsigned long long) ((char *) vPtr - (char *) slab) -
+              gui_poolDataOffset[slab->uiClass] - MEM_HEADER_GUARD_LEN * sizeof (unsigned long long);
+  ASSERT (ullOffset % uiSlotSize == 0 && ullOffset / uiSlotSize < slab->uiBump,
+          "%p is not the start of a pooled block", vPtr);
+
+  *slabPtr = slab;
+  *uiSlotPtr = (unsigned int) (ullOffset / uiSlotSize);
+  slot = &slab->slots[*uiSlotPtr];
+  uiState = __atomic_load_n (&slot->uiState, __ATOMIC_ACQUIRE);
+  ASSERT (uiState == POOL_SLOT_USED || uiState == POOL_SLOT_IGNORED,
+          "%p was already freed", vPtr);
+  verifyGuards (vPtr, slot->uiSize);
+
+  return slot;
+}
+
+// sizeHint as for internalFree(), the slot knows its size anyway
+static void poolFree (void *vPtr, size_t sizeHint)
+{
+  struct poolSlab *slab;
+  struct poolSlot *slot;
+  unsigned int uiSlot;
+  unsigned int uiState;
+  unsigned int uiHead;
   size_t size;
-  int i;
 
-  // adjust pointer to the actual start of allocation
-  mHead = ((struct memoryHeader *)(vPtr))-1;
+  slot = poolVerify (vPtr, &slab, &uiSlot);
+  size = slot->uiSize;
+  ASSERT (sizeHint == SIZE_UNKNOWN || sizeHint == size, "%p of %zu bytes freed as %zu bytes",
+          vPtr, size, sizeHint);
+  uiState = slot->uiState;
+  // logged while it's still ours, the slot could be handed out again at once
+  eventLog (MEM_EVENT_FREE, vPtr, size, slot->uiStackId);
+
+  if (gi_threadCacheState == THREAD_CACHE_ACTIVE && slab->cache == gp_threadCache)
+  {
+    MUTEX_LOCK (&slab->cache->registry.mutex);
+    __atomic_store_n (&slot->uiState, POOL_SLOT_FREE, __ATOMIC_RELAXED);
+    slot->uiNext = slab->uiFree;
+    slab->uiFree = uiSlot+1;
+    MUTEX_UNLOCK (&slab->cache->registry.mutex);
+  }
+  else
+  {
+    // the owner may be gone, or not allocate from this slab again for a
+    // while, but the slot is safe on the stack until somebody does
+    __atomic_store_n (&slot->uiState, POOL_SLOT_REMOTE, __ATOMIC_RELAXED);
+    uiHead = __atomic_load_n (&slab->uiRemoteFree, __ATOMIC_RELAXED);
+    do
+    {
+      slot->uiNext = uiHead;
+    }
+    while (!__atomic_compare_exchange_n (&slab->uiRemoteFree, &uiHead, uiSlot+1, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+  if (uiState == POOL_SLOT_USED)
+  {
+    countAlloc (slot->uiStackId, size, -1, -(long long) size, &slab->cache->registry);
+  }
+  if (SML_PRINTF_ENABLED && !gi_hookDisabled)
+  {
+    gi_hookDisabled = 1;
+    SML_PRINTF ("pool free (%p) (allocated by \"%s\"), %d\n",
+                vPtr, getStackName (slot->uiStackId), mem_get_alloc_count ());
+    gi_hookDisabled = 0;
+  }
+}
+
+static void *poolRealloc (void *vPtr, size_t size, int iLen)
+{
+  struct poolSlab *slab;
+  struct poolSlot *slot;
+  unsigned int uiSlot;
+  void *vNew;
 
-  size = mHead->size;
+  slot = poolVerify (vPtr, &slab, &uiSlot);
 
-  for (i = 0 ; i < MEM_HEADER_GUARD_LEN ; i++)
+  // the slot is kept if the new size is still in its class, or would go
+  // down at most one class (so a block that shrinks a lot gives its slot up)
+  if (size <= gui_poolClassSize[slab->uiClass] &&
+      (slab->uiClass < 2 || size > gui_poolClassSize[slab->uiClass-2]))
   {
-    ASSERT (mHead->ullFixedValues[i] == GUARD_BAND_TOP,
-            "Top guard band %d corrupt expected 0x%016llX got 0x016%llX - this is BEFORE allocated memory\n",
-            i, GUARD_BAND_TOP, mHead->ullFixedValues[i]);
+    size_t sOldSize;
+
+    MUTEX_LOCK (&slab->cache->registry.mutex);
+    sOldSize = slot->uiSize;
+    slot->uiSize = (unsigned int) size;
+    writeGuards (vPtr, size);
+    MUTEX_UNLOCK (&slab->cache->registry.mutex);
+    if (__atomic_load_n (&slot->uiState, __ATOMIC_RELAXED) == POOL_SLOT_USED)
+    {
+      countAlloc (slot->uiStackId, sOldSize, -1, -(long long) sOldSize, &slab->cache->registry);
+      countAlloc (slot->uiStackId, size, 1, size, &slab->cache->registry);
+    }
+    eventLog (MEM_EVENT_REALLOC_FREE, vPtr, sOldSize, slot->uiStackId);
+    eventLog (MEM_EVENT_REALLOC, vPtr, size, slot->uiStackId);
+    SML_PRINTF ("pool realloc (%p, %zu) in place, %d\n", vPtr, size, mem_get_alloc_count ());
+    return vPtr;
   }
 
-  ucPtr = ((unsigned char *) vPtr);
-  for (s = size ;
-       ((unsigned long long) (ucPtr + s)) % (sizeof (unsigned long long));
-       s++)
+  vNew = poolAlloc (size, REALLOC, iLen+1);
+  if (vNew == NULL)
   {
-    ASSERT (ucPtr[s] == (unsigned char) (((unsigned long long) (ucPtr+s)) & 0xFF),
-            "end of alloc memory over-written %zu bytes beyond end", 1+s-size);
+    vNew = internalRealloc (NULL, size, 1, REALLOC, 0.0, 0, iLen+1);
+    if (vNew == NULL)
+    {
+      return NULL;
+    }
   }
-  mCap = (struct memoryCap *)(ucPtr + s);
+  memcpy (vNew, vPtr, size < slot->uiSize ? size : slot->uiSize);
+  poolFree (vPtr, SIZE_UNKNOWN);
 
-  for (i = 0 ; i < MEM_CAP_GUARD_LEN ; i++)
+  return vNew;
+}
+
+// step through the pooled blocks of a registry that are in use, with its
+// mutex held.  Start with *slab == NULL, NULL is returned after the last one
+static struct poolSlot *poolNext (struct memoryRegistry *registry, struct poolSlab **slab,
+                                  unsigned int *uiSlot, void **vPtr)
+{
+  struct threadCache *cache = registry->cache;
+  unsigned int uiClass;
+
+  if (cache == NULL)
   {
-    ASSERT (mCap->ullFixedValues[i] == GUARD_BAND_BOTTOM,
-            "Bottom guard band %d corrupt expected 0x%016llX got 0x%016llX - this is AFTER allocated memory\n",
-            i, GUARD_BAND_BOTTOM, mCap->ullFixedValues[i]);
+    return NULL;
+  }
+
+  if (*slab == NULL)
+  {
+    uiClass = 0;
+    *slab = cache->poolSlabs[0];
+    *uiSlot = 0;
+  }
+  else
+  {
+    uiClass = (*slab)->uiClass;
+    (*uiSlot)++;
+  }
+
+  for ( ; ; )
+  {
+    if (*slab == NULL)
+    {
+      if (++uiClass == SML_POOL_CLASSES)
+      {
+        return NULL;
+      }
+      *slab = cache->poolSlabs[uiClass];
+      *uiSlot = 0;
+      continue;
+    }
+    for ( ; *uiSlot < (*slab)->uiBump ; (*uiSlot)++)
+    {
+      if (__atomic_load_n (&(*slab)->slots[*uiSlot].uiState, __ATOMIC_ACQUIRE) == POOL_SLOT_USED)
+      {
+        *vPtr = poolSlotPointer (*slab, *uiSlot);
+        return &(*slab)->slots[*uiSlot];
+      }
+    }
+    *slab = (*slab)->next;
+    *uiSlot = 0;
   }
+}
+
+static size_t poolUsableSize (void *vPtr)
+{
+  struct poolSlab *slab;
+  unsigned int uiSlot;
+
+  return poolVerify (vPtr, &slab, &uiSlot)->uiSize;
+}
+#else
+static int poolOwns (void *vPtr)
+{
+  (void)vPtr;
+
+  return 0;
+}
 
+static void *poolAlloc (size_t size, unsigned char type, int iLen)
+{
+  (void)size;
+  (void)type;
+  (void)iLen;
+
+  return NULL;
+}
+
+static void *poolRealloc (void *vPtr, size_t size, int iLen)
+{
+  (void)vPtr;
+  (void)size;
+  (void)iLen;
+
+  return NULL;
+}
+
+static void poolFree (void *vPtr, size_t sizeHint)
+{
+  (void)vPtr;
+  (void)sizeHint;
+}
+
+static struct poolSlot *poolNext (struct memoryRegistry *registry, struct poolSlab **slab,
+                                  unsigned int *uiSlot, void **vPtr)
+{
+  (void)registry;
+  (void)slab;
+  (void)uiSlot;
+  (void)vPtr;
+
+  return NULL;
+}
+
+static size_t poolUsableSize (void *vPtr)
+{
+  (void)vPtr;
+
+  return 0;
+}
+#endif //SML_POOL_ENABLED
+
+// where glibc's chunk of a block starts, the header itself unless the block
+// was aligned by alignedAlloc()
+static void *blockBase (struct memoryHeader *mHead)
+{
+  unsigned long long ullGap = ((unsigned long long *) mHead)[-1];
+
+  if ((ullGap & GUARD_ALIGNED_MASK) == GUARD_ALIGNED)
+  {
+    return (char *) mHead - (size_t) (ullGap & ~GUARD_ALIGNED_MASK);
+  }
   return mHead;
 }
 
-#define REALLOC 0
-#define MALLOC  1
-#define CALLOC  2
-static void *internalRealloc (void *vPtr, size_t size, size_t nmemb, unsigned char type)
+// the caller's bytes of a block on the lists
+static void *blockData (struct memoryHeader *mHead)
+{
+  return guardOwns (mHead) ? ((struct guardSpan *) mHead)->szData : (void *) (mHead+1);
+}
+
+// give a block that's off the lists back to where it came from
+static void blockRelease (struct memoryHeader *mHead)
+{
+  if (guardOwns (mHead))
+  {
+    guardRelease (mHead);
+  }
+  else
+  {
+    gp_orgFree (blockBase (mHead));
+  }
+}
+
+// grow or shrink a tracked block without moving it, if glibc's chunk already
+// has the room (malloc_usable_size(3)) and at most half of it would be left
+// unused.  The block stays on its list, keeps its call site and weight, and
+// only the cap moves - under the registry mutex, as a walker may be checking
+// the block.  Returns 0 if the block has to be reallocated for real
+static int reallocInPlace (struct memoryHeader *mHead, size_t size)
+{
+  size_t adjSize;
+  size_t sUsable;
+  size_t sOldSize;
+  long long llOldCount;
+  long long llOldBytes;
+  long long llCount;
+  long long llBytes;
+
+  // a guarded block's bytes end at its guard page, so it always moves
+  if (gp_orgUsableSize == NULL || guardOwns (mHead))
+  {
+    return 0;
+  }
+
+  adjSize = size + sizeof (struct memoryHeader) + sizeof (struct memoryCap);
+  if (adjSize % sizeof(unsigned long long))
+  {
+    adjSize += sizeof(unsigned long long) - (adjSize % sizeof(unsigned long long));
+  }
+  if (adjSize < size)
+  {
+    return 0;
+  }
+  sUsable = gp_orgUsableSize (blockBase (mHead)) - ((char *) mHead - (char *) blockBase (mHead));
+  if (adjSize > sUsable || adjSize < sUsable/2)
+  {
+    return 0;
+  }
+
+  MUTEX_LOCK (&mHead->registry->mutex);
+  // an ignored block is tracked again from its next realloc, which is left to
+  // the normal path
+  if (mHead->doubleLL.le_prev == NULL)
+  {
+    MUTEX_UNLOCK (&mHead->registry->mutex);
+    return 0;
+  }
+  sOldSize = mHead->size;
+  mHead->size = size;
+  writeGuards (mHead+1, size);
+  MUTEX_UNLOCK (&mHead->registry->mutex);
+
+  if (mHead->uiStackId != 0)
+  {
+    estimate (sOldSize, mHead->dWeight, &llOldCount, &llOldBytes);
+    estimate (size, mHead->dWeight, &llCount, &llBytes);
+    countAlloc (mHead->uiStackId, sOldSize, -llOldCount, -llOldBytes, mHead->registry);
+    countAlloc (mHead->uiStackId, size, llCount, llBytes, mHead->registry);
+    eventLog (MEM_EVENT_REALLOC_FREE, mHead+1, sOldSize, mHead->uiStackId);
+    eventLog (MEM_EVENT_REALLOC, mHead+1, size, mHead->uiStackId);
+  }
+  if (SML_PRINTF_ENABLED && !gi_hookDisabled)
+  {
+    gi_hookDisabled = 1;
+    SML_PRINTF ("realloc (%p, %zu) in place, allocated by %s, %d\n",
+                mHead+1, size, mHead->uiStackId != 0 ? getStackName (mHead->uiStackId) : "(null)",
+                mem_get_alloc_count ());
+    gi_hookDisabled = 0;
+  }
+
+  return 1;
+}
+
+// dWeight is what the new block stands for when sampling, 0.0 to work it out
+// from the size (a block that's reallocated keeps its own).  alignment is
+// only looked at for MEMALIGN, a power of 2 above ALIGN_PLAIN
+static void *internalRealloc (void *vPtr, size_t size, size_t nmemb, unsigned char type,
+                              double dWeight, size_t alignment, int iLen)
 {
   struct memoryHeader *mHead = NULL;
-  struct memoryCap    *mCap = NULL;
-  unsigned char *ucPtr;
+  struct memoryHeader *mOld = NULL;
+  struct memoryHeader *mGuard = NULL;
+  struct memoryRegistry *oldRegistry = NULL;
+  void *vNew;
   size_t adjSize;
-  size_t s;
-  char *szCaller = NULL;
-  char *szAllocator = NULL;
-  int i;
+  size_t sPad;
+  char *szBase;
+  size_t sOldSize = 0;
+  long long llOldCount = 0;
+  long long llOldBytes = 0;
+  long long llCount;
+  long long llBytes;
+  unsigned int uiCaller = 0;
+  unsigned int uiAllocator = 0;
+  int iOldLinked = 0;
+  int iOldCounted = 0;
 
   // NOTE: In this implementation, a size of 0 can be allocated
   //       This is POSIX compliant.  If the memory that is allocated
@@ -531,195 +4240,389 @@ static void *internalRealloc (void *vPtr, size_t size, size_t nmemb, unsigned ch
     // the memory - which may move it.  Verify the integrity of the memory as
     // well.
     mHead = verifyIntegrity (vPtr);
-    szAllocator = mHead->szAllocator;
-    MUTEX_LOCK (&g_mutex);
-    if (mHead->doubleLL.le_prev != NULL)
+    if (type == REALLOC && reallocInPlace (mHead, size))
+    {
+      return vPtr;
+    }
+    uiAllocator = mHead->uiStackId;
+    sOldSize = mHead->size;
+    estimate (mHead->size, mHead->dWeight, &llOldCount, &llOldBytes);
+    if (dWeight == 0.0)
+    {
+      dWeight = mHead->dWeight;
+    }
+    iOldLinked = registryRemove (mHead);
+    iOldCounted = iOldLinked && uiAllocator != 0;
+    mOld = mHead;
+    oldRegistry = mHead->registry;
+    // the old address is free for other threads as soon as glibc is done
+    if (uiAllocator != 0)
+    {
+      eventLog (MEM_EVENT_REALLOC_FREE, vPtr, sOldSize, uiAllocator);
+    }
+  }
+  if (gs_guardBytes != 0 && size*nmemb >= gs_guardBytes && alignment <= gs_pageSize)
+  {
+    mGuard = guardMap (size*nmemb, alignment);
+  }
+  if (mGuard != NULL || (mOld != NULL && guardOwns (mOld)))
+  {
+    // to or from a guarded block it's a copy, glibc can't move either
+    mHead = mGuard != NULL ? mGuard : (struct memoryHeader *) gp_orgMalloc (adjSize);
+    if (mHead != NULL && mOld != NULL)
+    {
+      memcpy (blockData (mHead), blockData (mOld), size*nmemb < sOldSize ? size*nmemb : sOldSize);
+      blockRelease (mOld);
+    }
+  }
+  else if (type == MEMALIGN)
+  {
+    // the header ends on the alignment, what's in front of it in the chunk is
+    // less than the alignment
+    sPad = ((sizeof (struct memoryHeader) + alignment-1) & ~(alignment-1)) - sizeof (struct memoryHeader);
+    szBase = adjSize + sPad < adjSize ? NULL : (char *) gp_orgMemalign (alignment, adjSize + sPad);
+    mHead = szBase != NULL ? (struct memoryHeader *) (szBase + sPad) : NULL;
+    if (mHead != NULL && sPad != 0)
     {
-      LIST_REMOVE (mHead, doubleLL);
-      mHead->doubleLL.le_prev = NULL;
+      ((unsigned long long *) mHead)[-1] = GUARD_ALIGNED | sPad;
     }
-    MUTEX_UNLOCK (&g_mutex);
   }
-  mHead = (struct memoryHeader *)gp_orgRealloc (mHead, adjSize);
+  else if (mOld != NULL && blockBase (mOld) != (void *) mOld)
+  {
+    // glibc would copy from the start of its chunk, not from the header
+    mHead = (struct memoryHeader *) gp_orgMalloc (adjSize);
+    if (mHead != NULL)
+    {
+      memcpy (mHead+1, mOld+1, size*nmemb < sOldSize ? size*nmemb : sOldSize);
+      gp_orgFree (blockBase (mOld));
+    }
+  }
+  else
+  {
+    mHead = (struct memoryHeader *)gp_orgRealloc (mHead, adjSize);
+  }
   if (mHead == NULL)
   {
+    if (iOldLinked)
+    {
+      // the original block is still valid, keep tracking it where it was
+      registryRelink (mOld);
+    }
+    if (mOld != NULL && uiAllocator != 0)
+    {
+      eventLog (MEM_EVENT_REALLOC, vPtr, sOldSize, uiAllocator);
+    }
     return NULL;
   }
 
+  if (dWeight == 0.0)
+  {
+    dWeight = sampleWeight (size*nmemb);
+  }
+  estimate (size*nmemb, dWeight, &llCount, &llBytes);
+  vNew = blockData (mHead);
+
+#ifdef _PTHREAD_H
+  // a thread's first block is counted in the cache registryInsert() puts it in
+  if (gi_threadCacheState == THREAD_CACHE_NONE)
+  {
+    getThreadCache ();
+  }
+#endif //_PTHREAD_H
   if (!gi_hookDisabled)
   {
     gi_hookDisabled = 1;
 
-    szCaller = trace (4, 1);
+    // glibc grew it where it was, it's still the same allocation
+    uiCaller = mOld == mHead && uiAllocator != 0 ? uiAllocator : trace (iLen);
     switch (type)
+
     {
     case REALLOC:
       // alloc count doesn't change - even if 0 size is being actually
-      // allocated - unless vPtr == NULL
-      if (vPtr == NULL)
+      // allocated - unless vPtr == NULL (or was ignored, it is tracked from
+      // here on)
+      if (iOldCounted)
       {
-        MUTEX_LOCK (&g_mutex);
-        gi_allocCount++;
-        MUTEX_UNLOCK (&g_mutex);
+        countAlloc (uiAllocator, sOldSize, -llOldCount, -llOldBytes, oldRegistry);
       }
+      countAlloc (uiCaller, size*nmemb, llCount, llBytes, NULL);
+      eventLog (MEM_EVENT_REALLOC, vNew, size*nmemb, uiCaller);
       SML_PRINTF ("realloc (%p, %zu) = %p, allocated by %s (org: %s) %d\n",
-                  vPtr, size, &mHead->ullFixedValues[MEM_HEADER_GUARD_LEN], szCaller, szAllocator, gi_allocCount);
-#if (defined _EXECINFO_H && _EXECINFO_H == 1)
-      if (szAllocator != NULL)
-      {
-        free (szAllocator);
-      }
-#else
-      (void) szAllocator;
-#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
+                  vPtr, size, vNew, getStackName (uiCaller),
+                  uiAllocator != 0 ? getStackName (uiAllocator) : "(null)", mem_get_alloc_count ());
       break;
 
     case MALLOC:
-      MUTEX_LOCK (&g_mutex);
-      gi_allocCount++;
-      MUTEX_UNLOCK (&g_mutex);
+      countAlloc (uiCaller, size*nmemb, llCount, llBytes, NULL);
+      eventLog (MEM_EVENT_MALLOC, vNew, size*nmemb, uiCaller);
       SML_PRINTF ("malloc (%zu) = %p, allocated by %s, %d\n",
-                  size, &mHead->ullFixedValues[MEM_HEADER_GUARD_LEN], szCaller, gi_allocCount);
+                  size, vNew, getStackName (uiCaller), mem_get_alloc_count ());
+      break;
+
+    case MEMALIGN:
+      countAlloc (uiCaller, size*nmemb, llCount, llBytes, NULL);
+      eventLog (MEM_EVENT_MALLOC, vNew, size*nmemb, uiCaller);
+      SML_PRINTF ("memalign (%zu, %zu) = %p, allocated by %s, %d\n",
+                  alignment, size, vNew, getStackName (uiCaller),
+                  mem_get_alloc_count ());
       break;
 
     case CALLOC:
-      MUTEX_LOCK (&g_mutex);
-      gi_allocCount++;
-      MUTEX_UNLOCK (&g_mutex);
+      countAlloc (uiCaller, size*nmemb, llCount, llBytes, NULL);
+      eventLog (MEM_EVENT_CALLOC, vNew, size*nmemb, uiCaller);
       SML_PRINTF ("calloc (%zu, %zu) = %p, allocated by %s, %d\n",
-                  nmemb, size, &mHead->ullFixedValues[MEM_HEADER_GUARD_LEN], szCaller, gi_allocCount);
+                  nmemb, size, vNew, getStackName (uiCaller), mem_get_alloc_count ());
       break;
     }
     gi_hookDisabled = 0;
   }
 
-  // save the allocator and size, fill up any unused bytes at the end of
-  // the allocation with essentially address == data, and place guard bands
-  // on the memory at the bottom and top of memory
-  mHead->szAllocator = szCaller;
+  // save the allocator and size, and place the guard bands
+  mHead->uiStackId = uiCaller;
+  mHead->uiGeneration = __atomic_load_n (&gui_generation, __ATOMIC_RELAXED);
   mHead->size = size*nmemb;
+  mHead->dWeight = dWeight;
 #ifdef _PTHREAD_H
   mHead->threadId = pthread_self ();
 #endif //_PTHREAD_H
-  MUTEX_LOCK (&g_mutex);
-  mHead->doubleLL.le_next = NULL;
-  mHead->doubleLL.le_prev = NULL;
-  LIST_INSERT_HEAD(&gp_listHead, mHead, doubleLL);
-  MUTEX_UNLOCK (&g_mutex);
-  for (i = 0 ; i < MEM_HEADER_GUARD_LEN ; i++)
-  {
-    mHead->ullFixedValues[i] = GUARD_BAND_TOP;
-  }
 
-  // point to usable memory
-  ucPtr = ((unsigned char *)(mHead+1));
-  for (s = mHead->size ;
-       ((unsigned long long) (ucPtr + s)) % (sizeof (unsigned long long));
-       s++)
+  // a guarded block only has the pad, its guard is the page
+  if (guardOwns (mHead))
   {
-    ucPtr[s] = (unsigned char) (((unsigned long long) (ucPtr+s)) & 0xFF);
+    guardWritePad (mHead);
   }
-
-  // fill up the cap
-  mCap = (struct memoryCap *)(ucPtr + s);
-  for (i = 0 ; i < MEM_CAP_GUARD_LEN ; i++)
+  else
   {
-    mCap->ullFixedValues[i] = GUARD_BAND_BOTTOM;
+    writeGuards (vNew, mHead->size);
   }
 
-  vPtr = ucPtr;
-  return vPtr;
+  // only link it in once the guard bands are in place, another thread may
+  // be walking the list and verifying every block on it
+  registryInsert (mHead);
+
+  return vNew;
 }
 
 static void *internalStaticAlloc (size_t size)
 {
   // glibc and C++ can make use of malloc and calloc before the init can be
   // called.  When this happens we have to pass back some usable memory.
-  // This memory is not freed() on exit - at least currently - if it is
-  // later, you'll have to modify the free and possibly realloc functions
-  // as well to detect this is statically allocated and not really part
-  // of the heap.
-
-  // C++ allocates quite a large block of memory on startup..
-  static __thread unsigned long long ullStatic[0x3000];
-  static __thread size_t sIndex = 0;
-  void *vPtr;
+  // It comes from the bootstrap arena, which grows by another chunk from
+  // mmap(2) when it runs out (C++ allocates quite a large block of memory on
+  // startup..).  This memory is not freed() on exit, free and realloc know
+  // these blocks aren't part of the heap with bootOwns().
+  struct bootHeader *bHead;
+  struct bootChunk *chunk;
+  size_t adjSize;
+  size_t sChunk;
+  char *szChunk;
+
+  adjSize = (size + sizeof (struct bootHeader) + SML_BOOT_ALIGN-1) & ~(size_t) (SML_BOOT_ALIGN-1);
+  if (adjSize < size)
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
 
-  vPtr = &ullStatic[sIndex];
+  // init() may not have run yet, so there's no mutex to take
+  while (__atomic_test_and_set (&gc_bootLock, __ATOMIC_ACQUIRE))
+  {
+  }
+  if (gi_bootChunks == 0 || adjSize > (size_t) (g_bootChunks[gi_bootChunks-1].szEnd - gp_bootNext))
+  {
+    // what's left of the last chunk is wasted, it's only start up
+    sChunk = SML_BOOT_CHUNK;
+    if (adjSize > sChunk)
+    {
+      sChunk = (adjSize + SML_BOOT_CHUNK-1) & ~(size_t) (SML_BOOT_CHUNK-1);
+    }
+    szChunk = gi_bootChunks < SML_BOOT_CHUNKS ?
+              (char *) mmap (NULL, sChunk, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : (char *) MAP_FAILED;
+    if (szChunk == (char *) MAP_FAILED)
+    {
+      __atomic_clear (&gc_bootLock, __ATOMIC_RELEASE);
+      errno = ENOMEM;
+      return NULL;
+    }
+
+    chunk = &g_bootChunks[gi_bootChunks];
+    chunk->szStart = szChunk;
+    chunk->szEnd = szChunk + sChunk;
+    if (gp_bootLow == NULL || szChunk < gp_bootLow)
+    {
+      gp_bootLow = szChunk;
+    }
+    if (chunk->szEnd > gp_bootHigh)
+    {
+      gp_bootHigh = chunk->szEnd;
+    }
+    gp_bootNext = szChunk;
+    __atomic_store_n (&gi_bootChunks, gi_bootChunks+1, __ATOMIC_RELEASE);
+  }
+  bHead = (struct bootHeader *) gp_bootNext;
+  gp_bootNext += adjSize;
+  __atomic_clear (&gc_bootLock, __ATOMIC_RELEASE);
+
+  bHead->size = size;
+
+  return bHead+1;
+}
 
-  // find next spot to "allocate" until init() can be called
-  // in case it happens multiple times
-  sIndex += (size + (sizeof(ullStatic[0])-1)) / sizeof (ullStatic[0]);
+// returns 1 if the block is from the bootstrap arena
+static int bootOwns (void *vPtr)
+{
+  char *szPtr = (char *) vPtr;
+  int iChunks;
+  int i;
 
-  // if we hit abort(), we have allocated more memory on startup than
-  // we made available, make ullStatic larger
+  if (szPtr < gp_bootLow || szPtr >= gp_bootHigh)
+  {
+    return 0;
+  }
 
-  // I can't use my regular ASSERT here, because it has a printf, and
-  // that needs allocated memory too, just abort
-  //
-  //ASSERT (sIndex < (sizeof (ullStatic) / sizeof (ullStatic[0])),
-  //        "Out of memory, index = %zu max index %zu", sIndex,
-  //        (sizeof (ullStatic) / sizeof (ullStatic[0])));
-  if (sIndex >= (sizeof (ullStatic) / sizeof (ullStatic[0])))
+  iChunks = __atomic_load_n (&gi_bootChunks, __ATOMIC_ACQUIRE);
+  for (i = 0 ; i < iChunks ; i++)
   {
-    // You ran out of memory before dlsym(3) could be called,
-    // increase the size of ullStatic.  You can figure out how much
-    // you need based off from the current value of sIndex, at least
-    // for this ONE allocation.
-    
-    abort ();
+    if (szPtr >= g_bootChunks[i].szStart && szPtr < g_bootChunks[i].szEnd)
+    {
+      return 1;
+    }
   }
 
-  return vPtr;
+  return 0;
+}
+
+// an aligned block from the bootstrap arena, with its own header right in
+// front of it so bootRealloc() still finds the size
+static void *bootAligned (size_t alignment, size_t size)
+{
+  struct bootHeader *bHead;
+  char *szPtr;
+
+  if (alignment <= SML_BOOT_ALIGN)
+  {
+    return internalStaticAlloc (size);
+  }
+  if (size + alignment < size)
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+  szPtr = (char *) internalStaticAlloc (size + alignment);
+  if (szPtr == NULL)
+  {
+    return NULL;
+  }
+  szPtr = (char *) (((unsigned long) szPtr + alignment-1) & ~(unsigned long) (alignment-1));
+  bHead = (struct bootHeader *) szPtr - 1;
+  bHead->size = size;
+
+  return szPtr;
+}
+
+// a bootstrap block is never resized, it's copied into a new block from
+// malloc(3) - which is the arena again if init() hasn't been done yet
+static void *bootRealloc (void *vPtr, size_t size)
+{
+  struct bootHeader *bHead;
+  void *vNew;
+
+  vNew = malloc (size);
+  if (vNew != NULL && vPtr != NULL)
+  {
+    bHead = (struct bootHeader *) vPtr - 1;
+    memcpy (vNew, vPtr, size < bHead->size ? size : bHead->size);
+  }
+
+  return vNew;
 }
 
-static void internalFree (void *vPtr, int iLen)
+// with a sizeHint the caller says how big the block is, so its cap is
+// checked right there and the header's size isn't looked at.  If it's wrong,
+// that's where the cap is found over-written
+static void internalFree (void *vPtr, size_t sizeHint, int iLen)
 {
   struct memoryHeader *mHead;
-  char *szCaller = NULL;
-  char *szAllocator = NULL;
+  struct memoryRegistry *registry;
+  unsigned int uiCaller = 0;
+  unsigned int uiAllocator = 0;
+  size_t size;
+
+  long long llCount;
+  long long llBytes;
+  int iRemote;
+  int iCounted;
 
   // verify no over-runs in data
-  mHead = verifyIntegrity (vPtr);
+  if (sizeHint == SIZE_UNKNOWN)
+  {
+    mHead = verifyIntegrity (vPtr);
+  }
+  else if (guardOwns (vPtr))
+  {
+    // its header is out of line, and has to be found first anyway
+    mHead = verifyIntegrity (vPtr);
+    ASSERT (mHead->size == sizeHint, "%p of %zu bytes freed as %zu bytes",
+            vPtr, mHead->size, sizeHint);
+  }
+  else
+  {
+    mHead = ((struct memoryHeader *) vPtr) - 1;
+    verifyGuards (vPtr, sizeHint);
+  }
 
-  szAllocator = mHead->szAllocator;
+  uiAllocator = mHead->uiStackId;
+  size = sizeHint == SIZE_UNKNOWN ? mHead->size : sizeHint;
+  registry = mHead->registry; // the header is gone once glibc has it back
+  estimate (size, mHead->dWeight, &llCount, &llBytes);
+  iCounted = uiAllocator != 0;
+  if (iCounted)
+  {
+    // before it's released, glibc could hand the address out again at once
+    eventLog (MEM_EVENT_FREE, vPtr, size, uiAllocator);
+  }
 
-  MUTEX_LOCK (&g_mutex);
-  if (mHead->doubleLL.le_prev != NULL)
+#ifdef _PTHREAD_H
+  // this also releases what other threads have freed into our cache
+  getThreadCache ();
+#endif //_PTHREAD_H
+  if (mHead->doubleLL.le_prev == NULL)
   {
-    LIST_REMOVE (mHead, doubleLL);
-    mHead->doubleLL.le_prev = NULL;
+    // ignored, it was taken out of the counts already
+    iCounted = 0;
+  }
+  iRemote = registryRemoteFree (mHead);
+  if (!iRemote)
+  {
+    iCounted = registryRemove (mHead) && iCounted;
+    blockRelease (mHead);
+  }
+  if (iCounted)
+  {
+    countAlloc (uiAllocator, size, -llCount, -llBytes, registry);
   }
-  MUTEX_UNLOCK (&g_mutex);
-  gp_orgFree (mHead);
 
-  if (!gi_hookDisabled)
+  // the stack of the caller is only wanted to print it
+  if (SML_PRINTF_ENABLED && !gi_hookDisabled)
   {
     gi_hookDisabled = 1;
-    szCaller = trace (iLen, 1);
-    if (szAllocator != NULL)
+    uiCaller = trace (iLen);
+    if (uiAllocator != 0)
     {
       SML_PRINTF ("free (%p) (allocated by \"%s\" freed by \"%s\"), %d\n",
-                  vPtr, szAllocator, szCaller, gi_allocCount);
-    }
-    MUTEX_LOCK (&g_mutex);
-    gi_allocCount--;
-    MUTEX_UNLOCK (&g_mutex);
-
-#if (defined _EXECINFO_H && _EXECINFO_H == 1)
-    if (szCaller != NULL)
-    {
-      free (szCaller);
+                  vPtr, getStackName (uiAllocator), getStackName (uiCaller), mem_get_alloc_count ());
     }
-    if (szAllocator != NULL)
+    else if (iRemote)
     {
-      free (szAllocator);
+      SML_PRINTF ("free (%p) (handed back to the allocating thread, freed by \"%s\"), %d\n",
+                  vPtr, getStackName (uiCaller), mem_get_alloc_count ());
     }
-#else
-    (void) szCaller;
-#endif //(defined _EXECINFO_H && _EXECINFO_H == 1)
     gi_hookDisabled = 0;
   }
+  (void) uiCaller;
+
 }
 
 void *malloc (size_t size)
@@ -731,9 +4634,17 @@ void *malloc (size_t size)
     // C++ allocates memory before init() can be called in this module
     vPtr = internalStaticAlloc (size);
   }
+  else if (gi_sampling)
+  {
+    vPtr = sampledAlloc (size, 1, MALLOC, 0, 4);
+  }
   else
   {
-    vPtr = internalRealloc (NULL, size, 1, MALLOC);
+    vPtr = poolAlloc (size, MALLOC, 4);
+    if (vPtr == NULL)
+    {
+      vPtr = internalRealloc (NULL, size, 1, MALLOC, 0.0, 0, 4);
+    }
   }
 
   return vPtr;
@@ -741,19 +4652,37 @@ void *malloc (size_t size)
 
 void *realloc(void *vPtr, size_t size)
 {
-  // if we hit this, some library that was called before this
-  // library's init() was called.  You'll have to go through a
-  // debugger to see what request is being made and then write
-  // the appropriate code.
-  ASSERT (gp_orgRealloc != NULL,
-          "realloc called before gp_orgRealloc set");
+  // a library that was called before this library's init() gets a
+  // block from the bootstrap arena, and so does its realloc (malloc is the
+  // last pointer that init() sets)
+  if (gp_orgMalloc == NULL || bootOwns (vPtr))
+  {
+    return bootRealloc (vPtr, size);
+  }
 
   // you can free memory with realloc, if you pass 0 size, with a
   // non NULL pointer however, I can see in the realloc(3) implementation
   // under linux, this will return a pointer which you can free, so
   // I alloc an allocation of 0 size, which returns a block of memory
   // that has no space to write to.
-  return internalRealloc (vPtr, size, 1, REALLOC);
+  if (gi_sampling)
+  {
+    return sampledRealloc (vPtr, size, 4);
+  }
+  if (poolOwns (vPtr))
+  {
+    return poolRealloc (vPtr, size, 4);
+  }
+  if (vPtr == NULL)
+  {
+    void *vNew = poolAlloc (size, REALLOC, 4);
+
+    if (vNew != NULL)
+    {
+      return vNew;
+    }
+  }
+  return internalRealloc (vPtr, size, 1, REALLOC, 0.0, 0, 4);
 }
 
 void *calloc(size_t nmemb, size_t size)
@@ -767,12 +4696,24 @@ void *calloc(size_t nmemb, size_t size)
     // like calloc() - we will return some statically allocated memory.
     vPtr = internalStaticAlloc (nmemb * size);
   }
+  else if (gi_sampling)
+  {
+    // this one comes back zeroed already
+    return sampledAlloc (nmemb, size, CALLOC, 0, 4);
+  }
   else
   {
-    vPtr = internalRealloc (NULL, nmemb, size, CALLOC);
+    vPtr = poolAlloc (nmemb * size, CALLOC, 4);
+    if (vPtr == NULL)
+    {
+      vPtr = internalRealloc (NULL, nmemb, size, CALLOC, 0.0, 0, 4);
+    }
   }
 
-  memset (vPtr, 0, nmemb*size);
+  if (vPtr != NULL)
+  {
+    memset (vPtr, 0, nmemb*size);
+  }
   return vPtr;
 }
 
@@ -781,6 +4722,181 @@ void free(void *vPtr)
   // a pointer value of NULL is legal under POSIX, oddly
   if (vPtr != NULL)
   {
-    internalFree (vPtr, 4);
+    if (poolOwns (vPtr))
+    {
+      poolFree (vPtr, SIZE_UNKNOWN);
+    }
+    else if (bootOwns (vPtr))
+    {
+      // the bootstrap arena is never given back
+    }
+    else if (gi_sampling && !sampledSetRemove (vPtr))
+    {
+      // not sampled, glibc's own block
+      gp_orgFree (vPtr);
+    }
+    else
+    {
+      internalFree (vPtr, SIZE_UNKNOWN, 4);
+    }
+  }
+}
+
+// free_sized() and free_aligned_sized(), iLen as for internalFree()
+static void sizedFree (void *vPtr, size_t size, int iLen)
+{
+  if (vPtr != NULL)
+  {
+    if (poolOwns (vPtr))
+    {
+      poolFree (vPtr, size);
+    }
+    else if (bootOwns (vPtr))
+    {
+      // the bootstrap arena is never given back
+    }
+    else if (gi_sampling && !sampledSetRemove (vPtr))
+    {
+      // not sampled, glibc's own block
+      gp_orgFree (vPtr);
+    }
+    else
+    {
+      internalFree (vPtr, size, iLen+1);
+    }
+  }
+}
+
+void free_sized (void *vPtr, size_t size)
+{
+  sizedFree (vPtr, size, 4);
+}
+
+void free_aligned_sized (void *vPtr, size_t alignment, size_t size)
+{
+  // the header says where the chunk starts, this is only a check
+  ASSERT (((unsigned long long) vPtr & (alignment-1)) == 0, "%p freed as %zu bytes aligned",
+          vPtr, alignment);
+
+  sizedFree (vPtr, size, 4);
+}
+
+// every block is ALIGN_PLAIN bytes aligned, only a bigger alignment needs a
+// block of its own from glibc.  alignment is a power of 2
+static void *alignedAlloc (size_t alignment, size_t size, int iLen)
+{
+  void *vPtr;
+
+  if (gp_orgMalloc == NULL)
+  {
+    return bootAligned (alignment, size);
+  }
+  if (alignment <= ALIGN_PLAIN)
+  {
+    // what malloc(3) does, but the caller is a frame further up
+    if (gi_sampling)
+    {
+      return sampledAlloc (size, 1, MALLOC, 0, iLen+1);
+    }
+    vPtr = poolAlloc (size, MALLOC, iLen+1);
+    return vPtr != NULL ? vPtr : internalRealloc (NULL, size, 1, MALLOC, 0.0, 0, iLen+1);
+  }
+  if (gi_sampling)
+  {
+    return sampledAlloc (size, 1, MEMALIGN, alignment, iLen+1);
+  }
+  return internalRealloc (NULL, size, 1, MEMALIGN, 0.0, alignment, iLen+1);
+}
+
+void *memalign (size_t alignment, size_t size)
+{
+  // glibc takes any alignment, and rounds it up to a power of 2
+  if (alignment > ((size_t) -1)/2 + 1)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  while (alignment & (alignment-1))
+  {
+    alignment = (alignment | (alignment-1)) + 1;
+  }
+
+  return alignedAlloc (alignment, size, 4);
+}
+
+void *aligned_alloc (size_t alignment, size_t size)
+{
+  if (alignment == 0 || (alignment & (alignment-1)) != 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return alignedAlloc (alignment, size, 4);
+}
+
+int posix_memalign (void **vPtr, size_t alignment, size_t size)
+{
+  void *vNew;
+  int iErrno = errno;
+
+  if (alignment % sizeof (void *) != 0 || (alignment & (alignment-1)) != 0 || alignment == 0)
+  {
+    return EINVAL;
+  }
+
+  // it returns the error, errno is left alone
+  vNew = alignedAlloc (alignment, size, 4);
+  errno = iErrno;
+  if (vNew == NULL)
+  {
+    return ENOMEM;
+  }
+  *vPtr = vNew;
+
+  return 0;
+}
+
+void *valloc (size_t size)
+{
+  return alignedAlloc ((size_t) sysconf (_SC_PAGESIZE), size, 4);
+}
+
+void *pvalloc (size_t size)
+{
+  size_t sPage = (size_t) sysconf (_SC_PAGESIZE);
+
+  // a whole number of pages, and at least one
+  if (size + sPage < size)
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size = size == 0 ? sPage : (size + sPage-1) & ~(sPage-1);
+
+  return alignedAlloc (sPage, size, 4);
+}
+
+// only the size that was asked for can be used, the rest of glibc's chunk
+// has the guard bands in it
+size_t malloc_usable_size (void *vPtr)
+{
+  if (vPtr == NULL)
+  {
+    return 0;
+  }
+  if (bootOwns (vPtr))
+  {
+    return ((struct bootHeader *) vPtr - 1)->size;
+  }
+  if (poolOwns (vPtr))
+  {
+    return poolUsableSize (vPtr);
+  }
+  if (gi_sampling && sampledSetFind (vPtr) == NULL)
+  {
+    return gp_orgUsableSize != NULL ? gp_orgUsableSize (vPtr) : 0;
   }
+
+  return verifyIntegrity (vPtr)->size;
 }
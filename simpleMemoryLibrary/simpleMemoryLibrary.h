@@ -1,6 +1,110 @@
+#ifndef SIMPLE_MEMORY_LIBRARY_H
+#define SIMPLE_MEMORY_LIBRARY_H
+
+#define MEM_STATS_BUCKETS   (48)
+#define MEM_STATS_TOP_SITES (10)
+#define MEM_STATS_TOP_THREADS (16)
+
+struct mem_stats_site
+{
+  const char *szName; // the call stack, never freed
+  long long llCount;
+  long long llBytes;
+};
+
+// the blocks a thread allocated are its own until they're freed, whichever
+// thread frees them.  A thread that has exited hands its cache (and what's
+// still live of its blocks) to the next thread that's created, so the live
+// counts of a thread take in what earlier owners of its cache left.  Its
+// allocations and lock waits are only its own, those of the earlier owners
+// are in one row for all the exited threads
+struct mem_stats_thread
+{
+  unsigned long ulThreadId; // pthread_t, 0 for the rows that aren't one thread
+  int iTid;                 // gettid(2), 0 for threads without a cache, -1 for the exited threads
+  int iAlive;
+  char szName[16];          // its comm, "" if it couldn't be read
+  long long llLiveCount;
+  long long llLiveBytes;
+  long long llAllocs;       // made by the thread
+  long long llLockWaits;    // MUTEX_LOCKs inside the library that found the mutex held
+  long long llLockWaitNs;
+};
+
+// see mem_get_stats(), everything is an estimate while sampling
+struct mem_stats
+{
+  unsigned long long ullTimeNs; // CLOCK_MONOTONIC, to turn the totals into rates
+  long long llLiveCount;
+  long long llLiveBytes;
+  long long llPeakBytes;
+  long long llPeakRss;          // of the whole process, from getrusage(2)
+  long long llAllocs;           // since start up, a realloc(3) is a free and an allocation
+  long long llFrees;
+  long long llHistogram[MEM_STATS_BUCKETS]; // live blocks, [i] holds 2^(i-1) up to 2^i - 1 bytes, [0] holds 0
+  int iSites;                   // only filled in with TRACE
+  struct mem_stats_site sites[MEM_STATS_TOP_SITES]; // by live bytes, the most first
+  long long llLockWaits;        // the lock counts are only kept with pthreads
+  long long llLockWaitNs;
+  long long llLockWaitMaxNs;
+  int iThreads;                 // how many there are, threads[] has the top ones
+  struct mem_stats_thread threads[MEM_STATS_TOP_THREADS]; // by live bytes, the most first
+};
+
+// the records of the SML_EVENTLOG file, see smlEventDecode.c.  The first one
+// is a MEM_EVENT_HEADER, and a record of all zeros ends the file
+#define MEM_EVENT_MAGIC (0x31305456454C4D53ULL) // "SMLEVT01"
+
+#define MEM_EVENT_MALLOC       (1)
+#define MEM_EVENT_CALLOC       (2)
+#define MEM_EVENT_REALLOC      (3)  // the new block
+#define MEM_EVENT_REALLOC_FREE (4)  // the old one, logged before the realloc
+#define MEM_EVENT_FREE         (5)
+#define MEM_EVENT_THREAD       (6)  // usThread is now ullPtr (pthread_t), ullSize is its tid
+#define MEM_EVENT_SYNC         (7)  // ullTime is CLOCK_MONOTONIC ullPtr, ullSize is CLOCK_REALTIME (ns)
+#define MEM_EVENT_DROPPED      (8)  // ullSize events of usThread were lost, its ring was full
+#define MEM_EVENT_SITE         (9)  // uiStackId is called ullSize bytes of name, in the records after it
+#define MEM_EVENT_HEADER       (10) // ullTime is MEM_EVENT_MAGIC, ullPtr the pid, ullSize sizeof (struct mem_event)
+
+#define MEM_EVENT_NO_THREAD    (0xFFFF) // a thread without a cache
+
+struct mem_event
+{
+  unsigned long long ullTime;  // TSC ticks (or CLOCK_MONOTONIC ns), see MEM_EVENT_SYNC
+  unsigned long long ullPtr;
+  unsigned long long ullSize;
+  unsigned int uiStackId;      // 0xFFFFFFFF without TRACE, 0xFFFFFFFE if backtrace(3) failed
+  unsigned short usThread;     // index of the thread cache
+  unsigned char ucOp;          // MEM_EVENT_*
+  unsigned char ucSpare;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
 void mem_show_allocations (FILE *fp);
 int mem_get_alloc_count (void);
 size_t mem_get_usage (void);
+size_t mem_get_peak_usage (void);
 size_t mem_get_real_usage (void);
 void mem_check_integrity (void);
 void mem_ignore_current_allocations (void);
+int mem_set_sample_interval (size_t sBytes);
+size_t mem_get_sample_interval (void);
+unsigned long mem_get_scan_passes (void);
+void mem_get_stats (struct mem_stats *stats);
+void mem_show_stats (FILE *fp);
+void mem_flush_events (void);
+unsigned int mem_mark_generation (void);
+void mem_report_since (FILE *fp, unsigned int uiGeneration);
+
+// C23, but not in every libc's stdlib.h yet
+void free_sized (void *vPtr, size_t size);
+void free_aligned_sized (void *vPtr, size_t alignment, size_t size);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif //SIMPLE_MEMORY_LIBRARY_H
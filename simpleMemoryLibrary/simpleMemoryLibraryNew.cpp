@@ -0,0 +1,155 @@
+////////////////////////////////////////////////////////////////////////////////
+// compile into the library with:
+// ------------------------------
+// gcc -g -Wall -rdynamic ./simpleMemoryLibrary.c ./simpleMemoryLibraryNew.cpp -ldl -pthread -lstdc++
+//
+// operator new and delete for C++ programs, straight onto the library's
+// malloc(3) and aligned_alloc(3), instead of through libstdc++'s.  What it
+// buys is the sized deletes: the compiler knows how big the object is, so
+// free_sized() checks the cap right where it says and aborts if the block is
+// some other size (a delete through the wrong type, or of the wrong array).
+// The aligned ones (over-aligned types, C++17) get their guard bands like any
+// other block, see "Aligned blocks" in simpleMemoryLibrary.c.
+//
+// As in libstdc++, a failed allocation calls the new handler until it gives
+// up, then throws std::bad_alloc (or returns NULL, for the nothrow ones).
+////////////////////////////////////////////////////////////////////////////////
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "simpleMemoryLibrary.h"
+
+static void *newBlock (std::size_t size, std::size_t alignment)
+{
+  std::new_handler handler;
+  void *vPtr;
+
+  for ( ; ; )
+  {
+    vPtr = alignment == 0 ? malloc (size) : aligned_alloc (alignment, size);
+    if (vPtr != NULL)
+    {
+      return vPtr;
+    }
+    handler = std::get_new_handler ();
+    if (handler == NULL)
+    {
+      throw std::bad_alloc ();
+    }
+    handler ();
+  }
+}
+
+static void *newBlockNoThrow (std::size_t size, std::size_t alignment) noexcept
+{
+  try
+  {
+    return newBlock (size, alignment);
+  }
+  catch (...)
+  {
+    return NULL;
+  }
+}
+
+void *operator new (std::size_t size)
+{
+  return newBlock (size, 0);
+}
+
+void *operator new[] (std::size_t size)
+{
+  return newBlock (size, 0);
+}
+
+void *operator new (std::size_t size, const std::nothrow_t &) noexcept
+{
+  return newBlockNoThrow (size, 0);
+}
+
+void *operator new[] (std::size_t size, const std::nothrow_t &) noexcept
+{
+  return newBlockNoThrow (size, 0);
+}
+
+void *operator new (std::size_t size, std::align_val_t alignment)
+{
+  return newBlock (size, static_cast<std::size_t> (alignment));
+}
+
+void *operator new[] (std::size_t size, std::align_val_t alignment)
+{
+  return newBlock (size, static_cast<std::size_t> (alignment));
+}
+
+void *operator new (std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+  return newBlockNoThrow (size, static_cast<std::size_t> (alignment));
+}
+
+void *operator new[] (std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+  return newBlockNoThrow (size, static_cast<std::size_t> (alignment));
+}
+
+void operator delete (void *vPtr) noexcept
+{
+  free (vPtr);
+}
+
+void operator delete[] (void *vPtr) noexcept
+{
+  free (vPtr);
+}
+
+void operator delete (void *vPtr, const std::nothrow_t &) noexcept
+{
+  free (vPtr);
+}
+
+void operator delete[] (void *vPtr, const std::nothrow_t &) noexcept
+{
+  free (vPtr);
+}
+
+void operator delete (void *vPtr, std::size_t size) noexcept
+{
+  free_sized (vPtr, size);
+}
+
+void operator delete[] (void *vPtr, std::size_t size) noexcept
+{
+  free_sized (vPtr, size);
+}
+
+void operator delete (void *vPtr, std::align_val_t) noexcept
+{
+  free (vPtr);
+}
+
+void operator delete[] (void *vPtr, std::align_val_t) noexcept
+{
+  free (vPtr);
+}
+
+void operator delete (void *vPtr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  free (vPtr);
+}
+
+void operator delete[] (void *vPtr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  free (vPtr);
+}
+
+void operator delete (void *vPtr, std::size_t size, std::align_val_t alignment) noexcept
+{
+  free_aligned_sized (vPtr, static_cast<std::size_t> (alignment), size);
+}
+
+void operator delete[] (void *vPtr, std::size_t size, std::align_val_t alignment) noexcept
+{
+  free_aligned_sized (vPtr, static_cast<std::size_t> (alignment), size);
+}
@@ -0,0 +1,738 @@
+////////////////////////////////////////////////////////////////////////////////
+// compile with:
+// -------------
+// g++ -O2 -g -Wall ./smlBench.cpp -o smlBench -pthread
+//
+// What does preloading simpleMemoryLibrary cost?  Runs a few allocation
+// patterns and prints, for each, the calls per second, the 99th percentile of
+// the time of one call and how much more memory the process used than it had
+// asked for:
+//
+//   small    : one thread, 64K live blocks of 8..256 bytes, free one and
+//              allocate another at random
+//   prodcons : pairs of threads, one allocates and hands the blocks to the
+//              other, which frees them
+//   realloc  : grow blocks 64 bytes at a time up to 256KB
+//   large    : 64KB..4MB blocks, allocated, touched and freed
+//   cxx      : new/delete of small objects and arrays
+//
+// Run it under whatever is preloaded:
+//
+//   LD_PRELOAD=./simpleMemoryLibrary.so ./smlBench
+//
+// or give it the libraries to compare, it runs itself once without any and
+// then once with each of them:
+//
+//   ./smlBench ./simpleMemoryLibrary.so ./simpleMemoryLibraryTrace.so
+//
+// Options:
+//   -n ops      calls per pattern (per thread pair for prodcons), 1000000
+//   -t pairs    thread pairs for prodcons, 2
+//   -p pattern  only run this one
+//
+// Each pattern runs in a child process of its own, so what one left in the
+// heap doesn't count for the next.  Only every 16th call is timed,
+// clock_gettime(3) costs about as much as a malloc(3).  The stderr of the
+// libraries being compared goes to /dev/null, or the leak report at exit
+// would bury the results.
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define BENCH_TIME_EVERY  (16)
+#define BENCH_BUCKETS     (64*16)
+#define BENCH_SMALL_LIVE  (64*1024)
+#define BENCH_RING        (1024)
+#define BENCH_REALLOC_MAX (256*1024)
+#define BENCH_MODES_MAX   (16)
+
+// latencies in ns, log2 buckets of 16 linear sub-buckets each
+struct histogram
+{
+  unsigned long long ullBucket[BENCH_BUCKETS];
+  unsigned long long ullCount;
+};
+
+struct result
+{
+  double dOpsPerSec;
+  double dP99;
+  long lOverheadKB;
+};
+
+struct pattern
+{
+  const char *szName;
+  void (*run) (struct result *res);
+};
+
+// one side of a producer/consumer pair
+struct ring
+{
+  void * volatile vSlots[BENCH_RING];
+  volatile unsigned long ulHead;
+  char cPad[64];
+  volatile unsigned long ulTail;
+  struct histogram hist;
+  pthread_t thread;
+};
+
+struct node
+{
+  struct node *next;
+  long lValue[3];
+};
+
+static long gl_ops = 1000000;
+static int gi_pairs = 2;
+
+static unsigned long long now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int bucketOf (unsigned long long ullNs)
+{
+  unsigned int uiBit;
+
+  if (ullNs < 16)
+  {
+    return (unsigned int) ullNs;
+  }
+  uiBit = 63 - __builtin_clzll (ullNs);
+  if (uiBit >= BENCH_BUCKETS/16)
+  {
+    return BENCH_BUCKETS-1;
+  }
+  return (uiBit-3) * 16 + (unsigned int) ((ullNs >> (uiBit-4)) & 15);
+}
+
+// the lowest value that lands in the bucket
+static double bucketValue (unsigned int uiBucket)
+{
+  unsigned int uiBit;
+
+  if (uiBucket < 16)
+  {
+    return uiBucket;
+  }
+  uiBit = uiBucket/16 + 3;
+  return (double) ((16ULL + (uiBucket & 15)) << (uiBit-4));
+}
+
+static void record (struct histogram *hist, unsigned long long ullStart)
+{
+  hist->ullBucket[bucketOf (now () - ullStart)]++;
+  hist->ullCount++;
+}
+
+static double percentile (const struct histogram *hist, double dWhich)
+{
+  unsigned long long ullWanted = (unsigned long long) (hist->ullCount * dWhich);
+  unsigned long long ullSeen = 0;
+  unsigned int ui;
+
+  for (ui = 0 ; ui < BENCH_BUCKETS ; ui++)
+  {
+    ullSeen += hist->ullBucket[ui];
+    if (ullSeen > ullWanted)
+    {
+      return bucketValue (ui);
+    }
+  }
+  return 0;
+}
+
+static void merge (struct histogram *dst, const struct histogram *src)
+{
+  unsigned int ui;
+
+  for (ui = 0 ; ui < BENCH_BUCKETS ; ui++)
+  {
+    dst->ullBucket[ui] += src->ullBucket[ui];
+  }
+  dst->ullCount += src->ullCount;
+}
+
+static long rssKB (void)
+{
+  long lPages = 0;
+  long lResident = 0;
+  FILE *fp;
+
+  fp = fopen ("/proc/self/statm", "r");
+  if (fp != NULL)
+  {
+    if (fscanf (fp, "%ld %ld", &lPages, &lResident) != 2)
+    {
+      lResident = 0;
+    }
+    fclose (fp);
+  }
+  return lResident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+static unsigned int randomNext (unsigned int *uiState)
+{
+  unsigned int ui = *uiState;
+
+  ui ^= ui << 13;
+  ui ^= ui >> 17;
+  ui ^= ui << 5;
+  *uiState = ui;
+  return ui;
+}
+
+static void finish (struct result *res, const struct histogram *hist, long lOps,
+                    unsigned long long ullStart, long lRssBefore, long lRssPeak,
+                    long long llLiveBytes)
+{
+  res->dOpsPerSec = (double) lOps * 1e9 / (double) (now () - ullStart);
+  res->dP99 = percentile (hist, 0.99);
+  res->lOverheadKB = lRssPeak - lRssBefore - (long) (llLiveBytes / 1024);
+}
+
+static void runSmall (struct result *res)
+{
+  static void *vLive[BENCH_SMALL_LIVE];
+  static struct histogram hist;
+  unsigned long long ullStart;
+  unsigned long long ullCall;
+  unsigned int uiRandom = 2463534242U;
+  unsigned int uiSlot;
+  long long llLive = 0;
+  long lRss;
+  long lPeak;
+  long l;
+  size_t size;
+
+  memset (&hist, 0, sizeof (hist));
+  lRss = rssKB ();
+  ullStart = now ();
+  for (l = 0 ; l < BENCH_SMALL_LIVE ; l++)
+  {
+    size = 8 + randomNext (&uiRandom) % 249;
+    vLive[l] = malloc (size);
+    ((char *) vLive[l])[0] = 1;
+    llLive += size;
+  }
+  lPeak = rssKB ();
+
+  for (l = 0 ; l < gl_ops ; l += 2)
+  {
+    uiSlot = randomNext (&uiRandom) % BENCH_SMALL_LIVE;
+    size = 8 + randomNext (&uiRandom) % 249;
+    if ((l & (BENCH_TIME_EVERY-1)) == 0)
+    {
+      ullCall = now ();
+      free (vLive[uiSlot]);
+      record (&hist, ullCall);
+      ullCall = now ();
+      vLive[uiSlot] = malloc (size);
+      record (&hist, ullCall);
+    }
+    else
+    {
+      free (vLive[uiSlot]);
+      vLive[uiSlot] = malloc (size);
+    }
+    ((char *) vLive[uiSlot])[0] = 1;
+  }
+
+  for (l = 0 ; l < BENCH_SMALL_LIVE ; l++)
+  {
+    free (vLive[l]);
+  }
+  finish (res, &hist, gl_ops + 2*BENCH_SMALL_LIVE, ullStart, lRss, lPeak, llLive);
+}
+
+static void *producer (void *vArg)
+{
+  struct ring *ring = (struct ring *) vArg;
+  unsigned long long ullCall;
+  unsigned int uiRandom = 88675123U;
+  void *vBlock;
+  long l;
+
+  for (l = 0 ; l < gl_ops/2 ; l++)
+  {
+    while (ring->ulHead - __atomic_load_n (&ring->ulTail, __ATOMIC_ACQUIRE) >= BENCH_RING)
+    {
+      sched_yield ();
+    }
+    if ((l & (BENCH_TIME_EVERY-1)) == 0)
+    {
+      ullCall = now ();
+      vBlock = malloc (16 + randomNext (&uiRandom) % 1009);
+      record (&ring->hist, ullCall);
+    }
+    else
+    {
+      vBlock = malloc (16 + randomNext (&uiRandom) % 1009);
+    }
+    ring->vSlots[ring->ulHead % BENCH_RING] = vBlock;
+    __atomic_store_n (&ring->ulHead, ring->ulHead+1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static void *consumer (void *vArg)
+{
+  struct ring *ring = (struct ring *) vArg;
+  struct histogram hist;
+  unsigned long long ullCall;
+  void *vBlock;
+  long l;
+
+  memset (&hist, 0, sizeof (hist));
+  for (l = 0 ; l < gl_ops/2 ; l++)
+  {
+    while (__atomic_load_n (&ring->ulHead, __ATOMIC_ACQUIRE) == ring->ulTail)
+    {
+      sched_yield ();
+    }
+    vBlock = ring->vSlots[ring->ulTail % BENCH_RING];
+    __atomic_store_n (&ring->ulTail, ring->ulTail+1, __ATOMIC_RELEASE);
+    if ((l & (BENCH_TIME_EVERY-1)) == 0)
+    {
+      ullCall = now ();
+      free (vBlock);
+      record (&hist, ullCall);
+    }
+    else
+    {
+      free (vBlock);
+    }
+  }
+
+  // the producer is done with its histogram by now
+  merge (&ring->hist, &hist);
+  return NULL;
+}
+
+static void runProdCons (struct result *res)
+{
+  static struct histogram hist;
+  struct ring *rings;
+  pthread_t consumers[64];
+  unsigned long long ullStart;
+  long lRss;
+  int i;
+
+  if (gi_pairs > 64)
+  {
+    gi_pairs = 64;
+  }
+  rings = (struct ring *) calloc (gi_pairs, sizeof (struct ring));
+  memset (&hist, 0, sizeof (hist));
+  lRss = rssKB ();
+  ullStart = now ();
+  for (i = 0 ; i < gi_pairs ; i++)
+  {
+    pthread_create (&rings[i].thread, NULL, producer, &rings[i]);
+    pthread_create (&consumers[i], NULL, consumer, &rings[i]);
+  }
+  for (i = 0 ; i < gi_pairs ; i++)
+  {
+    pthread_join (rings[i].thread, NULL);
+    pthread_join (consumers[i], NULL);
+    merge (&hist, &rings[i].hist);
+  }
+  // up to BENCH_RING blocks of a pair were in flight, they count as overhead
+  finish (res, &hist, gl_ops * gi_pairs, ullStart, lRss, rssKB (), 0);
+  free (rings);
+}
+
+static void runRealloc (struct result *res)
+{
+  static struct histogram hist;
+  unsigned long long ullStart;
+  unsigned long long ullCall;
+  char *szBlock = NULL;
+  size_t size = 0;
+  long lRss;
+  long lPeak = 0;
+  long l;
+
+  memset (&hist, 0, sizeof (hist));
+  lRss = rssKB ();
+  ullStart = now ();
+  for (l = 0 ; l < gl_ops ; l++)
+  {
+    size += 64;
+    if (size > BENCH_REALLOC_MAX)
+    {
+      if (lPeak == 0)
+      {
+        lPeak = rssKB ();
+      }
+      free (szBlock);
+      szBlock = NULL;
+      size = 64;
+    }
+    if ((l & (BENCH_TIME_EVERY-1)) == 0)
+    {
+      ullCall = now ();
+      szBlock = (char *) realloc (szBlock, size);
+      record (&hist, ullCall);
+    }
+    else
+    {
+      szBlock = (char *) realloc (szBlock, size);
+    }
+    szBlock[size-1] = 1;
+  }
+  if (lPeak == 0)
+  {
+    lPeak = rssKB ();
+  }
+  free (szBlock);
+  finish (res, &hist, gl_ops, ullStart, lRss, lPeak, BENCH_REALLOC_MAX);
+}
+
+static void runLarge (struct result *res)
+{
+  static struct histogram hist;
+  unsigned long long ullStart;
+  unsigned long long ullCall;
+  unsigned int uiRandom = 521288629U;
+  char *szBlock;
+  size_t size;
+  long lOps = gl_ops / 100; // each one is a few page faults
+  long lRss;
+  long lPeak;
+  long l;
+
+  memset (&hist, 0, sizeof (hist));
+  lRss = rssKB ();
+  lPeak = lRss;
+  ullStart = now ();
+  for (l = 0 ; l < lOps ; l++)
+  {
+    size = (64*1024) << (randomNext (&uiRandom) % 7);
+    ullCall = now ();
+    szBlock = (char *) malloc (size);
+    record (&hist, ullCall);
+    szBlock[0] = 1;
+    szBlock[size/2] = 1;
+    szBlock[size-1] = 1;
+    if (size == 4*1024*1024 && rssKB () > lPeak)
+    {
+      lPeak = rssKB ();
+    }
+    ullCall = now ();
+    free (szBlock);
+    record (&hist, ullCall);
+  }
+  // only 3 pages of a block are touched, anything more is overhead
+  finish (res, &hist, 2*lOps, ullStart, lRss, lPeak, 3*4096);
+}
+
+static void runCxx (struct result *res)
+{
+  static struct node *nodes[BENCH_SMALL_LIVE];
+  static struct histogram hist;
+  unsigned long long ullStart;
+  unsigned long long ullCall;
+  unsigned int uiRandom = 123456789U;
+  unsigned int uiSlot;
+  char *szArray;
+  long lRss;
+  long lPeak;
+  long l;
+
+  memset (&hist, 0, sizeof (hist));
+  lRss = rssKB ();
+  ullStart = now ();
+  for (l = 0 ; l < BENCH_SMALL_LIVE ; l++)
+  {
+    nodes[l] = new node;
+    nodes[l]->next = NULL;
+  }
+  lPeak = rssKB ();
+
+  for (l = 0 ; l < gl_ops ; l += 4)
+  {
+    uiSlot = randomNext (&uiRandom) % BENCH_SMALL_LIVE;
+    if ((l & (BENCH_TIME_EVERY-1)) == 0)
+    {
+      ullCall = now ();
+      delete nodes[uiSlot];
+      record (&hist, ullCall);
+      ullCall = now ();
+      nodes[uiSlot] = new node;
+      record (&hist, ullCall);
+      ullCall = now ();
+      szArray = new char[32 + uiSlot % 97];
+      record (&hist, ullCall);
+      ullCall = now ();
+      delete[] szArray;
+      record (&hist, ullCall);
+    }
+    else
+    {
+      delete nodes[uiSlot];
+      nodes[uiSlot] = new node;
+      szArray = new char[32 + uiSlot % 97];
+      // keep the compiler from dropping the pair
+      nodes[uiSlot]->next = (struct node *) szArray;
+      delete[] szArray;
+    }
+    nodes[uiSlot]->next = NULL;
+  }
+
+  for (l = 0 ; l < BENCH_SMALL_LIVE ; l++)
+  {
+    delete nodes[l];
+  }
+  finish (res, &hist, gl_ops + 2*BENCH_SMALL_LIVE, ullStart, lRss, lPeak,
+          (long long) BENCH_SMALL_LIVE * sizeof (struct node));
+}
+
+static const struct pattern g_patterns[] =
+{
+  {"small",    runSmall},
+  {"prodcons", runProdCons},
+  {"realloc",  runRealloc},
+  {"large",    runLarge},
+  {"cxx",      runCxx},
+  {NULL,       NULL}
+};
+
+// run the patterns, each in a child.  With bRaw only the numbers for the parent
+// that compares the libraries
+static void runAll (const char *szOnly, int bRaw)
+{
+  struct result res;
+  pid_t pid;
+  int fds[2];
+  int iStatus;
+  int i;
+
+  for (i = 0 ; g_patterns[i].szName != NULL ; i++)
+  {
+    if (szOnly != NULL && strcmp (szOnly, g_patterns[i].szName) != 0)
+    {
+      continue;
+    }
+    if (pipe (fds) != 0 || (pid = fork ()) < 0)
+    {
+      perror ("fork");
+      exit (1);
+    }
+    if (pid == 0)
+    {
+      close (fds[0]);
+      g_patterns[i].run (&res);
+      if (write (fds[1], &res, sizeof (res)) != sizeof (res))
+      {
+        _exit (1);
+      }
+      // no leak report from the library
+      _exit (0);
+    }
+    close (fds[1]);
+    if (read (fds[0], &res, sizeof (res)) != sizeof (res) ||
+        waitpid (pid, &iStatus, 0) != pid || !WIFEXITED (iStatus) || WEXITSTATUS (iStatus) != 0)
+    {
+      fprintf (stderr, "%s failed\n", g_patterns[i].szName);
+      exit (1);
+    }
+    close (fds[0]);
+
+    if (bRaw)
+    {
+      printf ("%s %f %f %ld\n", g_patterns[i].szName, res.dOpsPerSec, res.dP99, res.lOverheadKB);
+    }
+    else
+    {
+      printf ("%-10s %12.0f ops/s  p99 %8.0f ns  overhead %8ld KB\n",
+              g_patterns[i].szName, res.dOpsPerSec, res.dP99, res.lOverheadKB);
+    }
+    fflush (stdout);
+  }
+}
+
+// run this program again with szLib preloaded (none if NULL) and read back
+// what it measured
+static int runMode (char *argv0, char **szArgs, const char *szLib, struct result *results)
+{
+  char szLine[256];
+  char szName[64];
+  struct result res;
+  FILE *fp;
+  pid_t pid;
+  int fds[2];
+  int iStatus;
+  int iDevNull;
+  int i;
+
+  if (pipe (fds) != 0)
+  {
+    perror ("pipe");
+    return -1;
+  }
+  pid = fork ();
+  if (pid < 0)
+  {
+    perror ("fork");
+    return -1;
+  }
+  if (pid == 0)
+  {
+    dup2 (fds[1], 1);
+    iDevNull = open ("/dev/null", O_WRONLY);
+    if (iDevNull >= 0)
+    {
+      dup2 (iDevNull, 2);
+    }
+    close (fds[0]);
+    close (fds[1]);
+    if (szLib != NULL)
+    {
+      setenv ("LD_PRELOAD", szLib, 1);
+    }
+    else
+    {
+      unsetenv ("LD_PRELOAD");
+    }
+    execv ("/proc/self/exe", szArgs);
+    execvp (argv0, szArgs);
+    _exit (127);
+  }
+
+  close (fds[1]);
+  fp = fdopen (fds[0], "r");
+  while (fgets (szLine, sizeof (szLine), fp) != NULL)
+  {
+    if (sscanf (szLine, "%63s %lf %lf %ld", szName, &res.dOpsPerSec, &res.dP99, &res.lOverheadKB) != 4)
+    {
+      continue;
+    }
+    for (i = 0 ; g_patterns[i].szName != NULL ; i++)
+    {
+      if (strcmp (szName, g_patterns[i].szName) == 0)
+      {
+        results[i] = res;
+      }
+    }
+  }
+  fclose (fp);
+  waitpid (pid, &iStatus, 0);
+  if (!WIFEXITED (iStatus) || WEXITSTATUS (iStatus) != 0)
+  {
+    fprintf (stderr, "%s: the benchmark didn't finish\n", szLib != NULL ? szLib : "glibc");
+    return -1;
+  }
+  return 0;
+}
+
+static void usage (const char *szName)
+{
+  fprintf (stderr, "usage: %s [-n ops] [-t pairs] [-p pattern] [library.so ...]\n", szName);
+  exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+  static struct result results[BENCH_MODES_MAX][sizeof (g_patterns) / sizeof (g_patterns[0])];
+  const char *szModes[BENCH_MODES_MAX];
+  const char *szOnly = NULL;
+  char *szArgs[16];
+  char szOps[32];
+  char szPairs[32];
+  int iModes = 1;
+  int bRaw = 0;
+  int iArgs = 0;
+  int iOpt;
+  int i;
+  int m;
+
+  while ((iOpt = getopt (argc, argv, "n:t:p:r")) != -1)
+  {
+    switch (iOpt)
+    {
+    case 'n':
+      gl_ops = atol (optarg);
+      break;
+    case 't':
+      gi_pairs = atoi (optarg);
+      break;
+    case 'p':
+      szOnly = optarg;
+      break;
+    case 'r':
+      bRaw = 1;
+      break;
+    default:
+      usage (argv[0]);
+    }
+  }
+  if (gl_ops < 2*BENCH_TIME_EVERY || gi_pairs < 1)
+  {
+    usage (argv[0]);
+  }
+
+  if (optind == argc)
+  {
+    runAll (szOnly, bRaw);
+    return 0;
+  }
+
+  // compare: glibc first, then each library
+  snprintf (szOps, sizeof (szOps), "%ld", gl_ops);
+  snprintf (szPairs, sizeof (szPairs), "%d", gi_pairs);
+  szArgs[iArgs++] = argv[0];
+  szArgs[iArgs++] = (char *) "-r";
+  szArgs[iArgs++] = (char *) "-n";
+  szArgs[iArgs++] = szOps;
+  szArgs[iArgs++] = (char *) "-t";
+  szArgs[iArgs++] = szPairs;
+  if (szOnly != NULL)
+  {
+    szArgs[iArgs++] = (char *) "-p";
+    szArgs[iArgs++] = (char *) szOnly;
+  }
+  szArgs[iArgs] = NULL;
+
+  szModes[0] = NULL;
+  for (i = optind ; i < argc && iModes < BENCH_MODES_MAX ; i++)
+  {
+    szModes[iModes++] = argv[i];
+  }
+  for (m = 0 ; m < iModes ; m++)
+  {
+    if (runMode (argv[0], szArgs, szModes[m], results[m]) != 0)
+    {
+      return 1;
+    }
+  }
+
+  for (i = 0 ; g_patterns[i].szName != NULL ; i++)
+  {
+    if (szOnly != NULL && strcmp (szOnly, g_patterns[i].szName) != 0)
+    {
+      continue;
+    }
+    printf ("%s\n", g_patterns[i].szName);
+    for (m = 0 ; m < iModes ; m++)
+    {
+      printf ("  %-32s %12.0f ops/s (%5.2fx)  p99 %8.0f ns  overhead %8ld KB\n",
+              szModes[m] != NULL ? szModes[m] : "glibc", results[m][i].dOpsPerSec,
+              results[0][i].dOpsPerSec / results[m][i].dOpsPerSec,
+              results[m][i].dP99, results[m][i].lOverheadKB);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,198 @@
+////////////////////////////////////////////////////////////////////////////////
+// compile with:
+// -------------
+// gcc -g -Wall ./smlEventDecode.c -o smlEventDecode
+//
+// Turns the file written by simpleMemoryLibrary with SML_EVENTLOG set into
+// text, one line per event:
+//
+//   seconds since start, thread id, what, pointer, size, call site
+//
+//   ./smlEventDecode events.bin
+//
+// The events of one thread are in the file in the order they happened, but
+// those of different threads are only as close together as the writer's
+// passes.  Sort on the first column if you need them all in order.  The call
+// sites are only named if the library was built with TRACE.
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "simpleMemoryLibrary.h"
+
+static const char *opName (unsigned char ucOp)
+{
+  switch (ucOp)
+  {
+  case MEM_EVENT_MALLOC:       return "malloc";
+  case MEM_EVENT_CALLOC:       return "calloc";
+  case MEM_EVENT_REALLOC:      return "realloc";
+  case MEM_EVENT_REALLOC_FREE: return "realloc-from";
+  case MEM_EVENT_FREE:         return "free";
+  default:                     return "?";
+  }
+}
+
+int main (int argc, char *argv[])
+{
+  const struct mem_event *events;
+  const struct mem_event *event;
+  struct stat st;
+  char **szSites = NULL;
+  unsigned long ulTids[MEM_EVENT_NO_THREAD+1];
+  unsigned int uiSites = 0;
+  unsigned long long ullEvents;
+  unsigned long long ullCount = 0;
+  unsigned long long ullDropped = 0;
+  unsigned long long ullTick0 = 0;
+  unsigned long long ullNs0 = 0;
+  unsigned long long ullReal0 = 0;
+  unsigned long long ullTickN = 0;
+  unsigned long long ullNsN = 0;
+  unsigned long long ull;
+  unsigned long long ullSkip;
+  double dTicksPerNs = 1.0;
+  int iThreads = 0;
+  int iSyncs = 0;
+  int iPass;
+  int fd;
+
+  if (argc != 2)
+  {
+    fprintf (stderr, "usage: %s eventfile\n", argv[0]);
+    return 1;
+  }
+
+  fd = open (argv[1], O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) != 0)
+  {
+    perror (argv[1]);
+    return 1;
+  }
+  ullEvents = (unsigned long long) st.st_size / sizeof (struct mem_event);
+  if (ullEvents == 0)
+  {
+    fprintf (stderr, "%s: empty\n", argv[1]);
+    return 1;
+  }
+  events = (const struct mem_event *) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (events == MAP_FAILED)
+  {
+    perror ("mmap");
+    return 1;
+  }
+  if (events[0].ucOp != MEM_EVENT_HEADER || events[0].ullTime != MEM_EVENT_MAGIC ||
+      events[0].ullSize != sizeof (struct mem_event))
+  {
+    fprintf (stderr, "%s: not an event log of this version\n", argv[1]);
+    return 1;
+  }
+  for (ull = 0 ; ull <= MEM_EVENT_NO_THREAD ; ull++)
+  {
+    ulTids[ull] = 0;
+  }
+
+  // first the clock and the call site names, which may come after the
+  // events that use them, then the events
+  for (iPass = 0 ; iPass < 2 ; iPass++)
+  {
+    for (ull = 1 ; ull < ullEvents && events[ull].ucOp != 0 ; ull++)
+    {
+      event = &events[ull];
+      switch (event->ucOp)
+      {
+      case MEM_EVENT_SYNC:
+        if (iPass == 0)
+        {
+          if (iSyncs++ == 0)
+          {
+            ullTick0 = event->ullTime;
+            ullNs0 = event->ullPtr;
+            ullReal0 = event->ullSize;
+          }
+          ullTickN = event->ullTime;
+          ullNsN = event->ullPtr;
+        }
+        break;
+
+      case MEM_EVENT_SITE:
+        ullSkip = (event->ullSize + sizeof (struct mem_event) - 1) / sizeof (struct mem_event);
+        if (ullSkip >= ullEvents - ull)
+        {
+          // cut off in the middle of the name
+          ull = ullEvents-1;
+          break;
+        }
+        if (iPass == 0)
+        {
+          if (event->uiStackId >= uiSites)
+          {
+            unsigned int uiNew = event->uiStackId + 1024;
+
+            szSites = (char **) realloc (szSites, uiNew * sizeof (char *));
+            if (szSites == NULL)
+            {
+              perror ("realloc");
+              return 1;
+            }
+            memset (szSites + uiSites, 0, (uiNew - uiSites) * sizeof (char *));
+            uiSites = uiNew;
+          }
+          free (szSites[event->uiStackId]);
+          szSites[event->uiStackId] = strndup ((const char *) (event+1), event->ullSize);
+        }
+        ull += ullSkip;
+        break;
+
+      case MEM_EVENT_THREAD:
+        if (iPass == 1)
+        {
+          iThreads++;
+          ulTids[event->usThread] = (unsigned long) event->ullSize;
+        }
+        break;
+
+      case MEM_EVENT_DROPPED:
+        if (iPass == 1)
+        {
+          ullDropped += event->ullSize;
+          printf ("%14.6f %7lu dropped %llu events\n",
+                  (double) (long long) (event->ullTime - ullTick0) / dTicksPerNs / 1e9,
+                  ulTids[event->usThread], event->ullSize);
+        }
+        break;
+
+      default:
+        if (iPass == 1)
+        {
+          ullCount++;
+          printf ("%14.6f %7lu %-12s 0x%012llx %10llu %s\n",
+                  (double) (long long) (event->ullTime - ullTick0) / dTicksPerNs / 1e9,
+                  ulTids[event->usThread], opName (event->ucOp), event->ullPtr, event->ullSize,
+                  event->uiStackId < uiSites && szSites[event->uiStackId] != NULL ?
+                  szSites[event->uiStackId] : "-");
+        }
+        break;
+      }
+    }
+
+    // the time stamps are TSC ticks, or already ns if the first and the last
+    // sync say so
+    if (iPass == 0 && ullNsN > ullNs0)
+    {
+      dTicksPerNs = (double) (ullTickN - ullTick0) / (double) (ullNsN - ullNs0);
+    }
+  }
+
+  fprintf (stderr, "pid %llu, started %llu.%09llu (CLOCK_REALTIME): %llu events from %d threads, %llu dropped\n",
+           events[0].ullPtr, ullReal0 / 1000000000ULL, ullReal0 % 1000000000ULL,
+           ullCount, iThreads, ullDropped);
+
+  return 0;
+}
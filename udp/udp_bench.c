@@ -0,0 +1,916 @@
+// gcc -Wall -O2 udp_bench.c -o udp_bench -pthread
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+// Sender and receiver of the UDP pair in one go: every datagram carries a
+// sequence number and the time it was sent, so the receiving end can tell
+// what got lost, what came out of order and how long it took.  The receive
+// side is one of the ways udp_server has of doing it:
+//
+//   recvfrom  a datagram a call
+//   recvmmsg  a batch a call
+//   rawepoll  a non blocking socket, epoll_wait(2) then recvmmsg until it's
+//             dry.  Plain epoll, as a stand-in for the epoller: it's the
+//             same pattern without the epoller's bookkeeping (see
+//             udp_epoll_server for the real one)
+//   threads   a thread each with its own SO_REUSEPORT socket, recvmmsg
+//
+// In one process (the default) it runs each of them in turn, or the one -m
+// says, and prints a line for each.  Across hosts it's -s on the one and
+// -c host on the other; the server then reports when the traffic stops.
+// The latency is one way, which across hosts only means something with the
+// clocks in sync; with -e the server sends every datagram back and the
+// client reports the round trip instead.
+//
+// udp_bench [-m mode] [-t threads] [-f flows] [-n count] [-r rate] [-l length]
+//           [-b batch] [-B rcvbuf] [-e] [-s | -c host] [port]
+
+#define BENCH_MAGIC (0x55445042)     // "UDPB"
+#define BENCH_SLOT_SIZE (2048)       // what's read of a datagram, the header's at the front
+#define BENCH_MAX_BATCH (1024)       // UIO_MAXIOV
+#define BENCH_MAX_FLOWS (64)
+#define BENCH_MAX_THREADS (64)
+#define BENCH_IDLE_NS (100000000ULL) // a run is over when nothing comes for this long
+#define BENCH_SERVER_IDLE_NS (1000000000ULL)
+
+enum
+{
+  MODE_RECVFROM,
+  MODE_RECVMMSG,
+  MODE_RAW_EPOLL,
+  MODE_THREADS,
+  MODE_COUNT
+};
+
+static const char *gsz_Modes[MODE_COUNT] = { "recvfrom", "recvmmsg", "rawepoll", "threads" };
+
+struct benchHeader
+{
+  unsigned int uiMagic;
+  unsigned int uiFlow;
+  unsigned long long ullSeq;     // per flow, from 0
+  unsigned long long ullSentNs;  // on the sender's clock, see uiClock
+  unsigned int uiClock;          // CLOCK_MONOTONIC in one process, CLOCK_REALTIME across
+  unsigned int uiPad;
+};
+
+// latencies in ns: for each power of two 16 buckets, so they're within 6%
+#define HIST_SUB_BITS (4)
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct benchHist
+{
+  unsigned long long ullBuckets[HIST_BUCKETS];
+  unsigned long long ullCount;
+  unsigned long long ullMax;
+};
+
+static void histAdd (struct benchHist *hist, unsigned long long ullNs)
+{
+  int iExp;
+  int iBucket;
+
+  if (ullNs < HIST_SUB)
+  {
+    iBucket = ullNs;
+  }
+  else
+  {
+    iExp = 63 - __builtin_clzll (ullNs);
+    iBucket = (iExp - HIST_SUB_BITS + 1) * HIST_SUB + ((ullNs >> (iExp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+  }
+  hist->ullBuckets[iBucket]++;
+  hist->ullCount++;
+  if (ullNs > hist->ullMax)
+  {
+    hist->ullMax = ullNs;
+  }
+}
+
+static void histMerge (struct benchHist *to, const struct benchHist *from)
+{
+  int i;
+
+  for (i = 0 ; i < HIST_BUCKETS ; i++)
+  {
+    to->ullBuckets[i] += from->ullBuckets[i];
+  }
+  to->ullCount += from->ullCount;
+  if (from->ullMax > to->ullMax)
+  {
+    to->ullMax = from->ullMax;
+  }
+}
+
+// the low end of the bucket the fraction dFraction of them is in
+static unsigned long long histPercentile (const struct benchHist *hist, double dFraction)
+{
+  unsigned long long ullWanted = (unsigned long long) (dFraction * hist->ullCount + 0.5);
+  unsigned long long ullSeen = 0;
+  int iExp;
+  int i;
+
+  if (ullWanted == 0)
+  {
+    ullWanted = 1;
+  }
+  for (i = 0 ; i < HIST_BUCKETS ; i++)
+  {
+    ullSeen += hist->ullBuckets[i];
+    if (ullSeen >= ullWanted)
+    {
+      if (i < HIST_SUB)
+      {
+        return i;
+      }
+      iExp = i / HIST_SUB + HIST_SUB_BITS - 1;
+      return (unsigned long long) (HIST_SUB + i % HIST_SUB) << (iExp - HIST_SUB_BITS);
+    }
+  }
+  return hist->ullMax;
+}
+
+static unsigned long long clockNs (clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime (clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int gi_Stop;
+
+// a receiving thread, on the server side or reading the echoes on the client
+struct benchRecv
+{
+  int iFd;
+  int iMode;
+  int iBatch;
+  int bEcho;                             // send each datagram back
+  pthread_t thread;
+  unsigned long long ullPackets;         // published after each batch
+  unsigned long long ullLastNs;          // CLOCK_MONOTONIC, likewise
+  unsigned long long ullFirstNs;
+  unsigned long long ullCallNs;          // when the receive the first ones came from was made
+  unsigned long long ullBytes;
+  unsigned long long ullReordered;       // older than one seen before on its flow
+  unsigned long long ullForeign;         // not one of ours
+  unsigned long long ullNext[BENCH_MAX_FLOWS];
+  struct benchHist hist;
+} __attribute__ ((aligned (64)));
+
+static void benchCount (struct benchRecv *recv, const char *data, unsigned int uiLength)
+{
+  struct benchHeader header;
+  unsigned long long ullNow;
+
+  if (uiLength < sizeof (header))
+  {
+    recv->ullForeign++;
+    return;
+  }
+  memcpy (&header, data, sizeof (header));
+  if (header.uiMagic != BENCH_MAGIC || header.uiFlow >= BENCH_MAX_FLOWS)
+  {
+    recv->ullForeign++;
+    return;
+  }
+
+  ullNow = clockNs (header.uiClock);
+  histAdd (&recv->hist, ullNow > header.ullSentNs ? ullNow - header.ullSentNs : 0);
+
+  recv->ullBytes += uiLength;
+  if (header.ullSeq < recv->ullNext[header.uiFlow])
+  {
+    recv->ullReordered++;
+  }
+  else
+  {
+    recv->ullNext[header.uiFlow] = header.ullSeq + 1;
+  }
+}
+
+static void benchPublish (struct benchRecv *recv, unsigned long long ullPackets)
+{
+  unsigned long long ullNow = clockNs (CLOCK_MONOTONIC);
+
+  if (recv->ullPackets == 0)
+  {
+    recv->ullFirstNs = recv->ullCallNs;
+  }
+  __atomic_store_n (&recv->ullLastNs, ullNow, __ATOMIC_RELAXED);
+  __atomic_store_n (&recv->ullPackets, recv->ullPackets + ullPackets, __ATOMIC_RELAXED);
+}
+
+// the sockets have a receive timeout, so a blocking one comes back now and
+// then to look at gi_Stop
+static void *recvRun (void *vRecv)
+{
+  struct benchRecv *recv = vRecv;
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct sockaddr_storage *addrs;
+  struct epoll_event event;
+  char *buffers;
+  int iEpFd = -1;
+  int iRet;
+  int i;
+
+  msgs = calloc (recv->iBatch, sizeof (*msgs));
+  iovs = calloc (recv->iBatch, sizeof (*iovs));
+  addrs = calloc (recv->iBatch, sizeof (*addrs));
+  buffers = malloc ((size_t) recv->iBatch * BENCH_SLOT_SIZE);
+  if (msgs == NULL || iovs == NULL || addrs == NULL || buffers == NULL)
+  {
+    perror ("malloc");
+    exit (1);
+  }
+  for (i = 0 ; i < recv->iBatch ; i++)
+  {
+    iovs[i].iov_base = buffers + (size_t) i * BENCH_SLOT_SIZE;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+  }
+
+  if (recv->iMode == MODE_RAW_EPOLL)
+  {
+    iEpFd = epoll_create1 (0);
+    event.events = EPOLLIN;
+    event.data.fd = recv->iFd;
+    if (iEpFd < 0 || epoll_ctl (iEpFd, EPOLL_CTL_ADD, recv->iFd, &event) < 0)
+    {
+      perror ("epoll");
+      exit (1);
+    }
+  }
+
+  while (!__atomic_load_n (&gi_Stop, __ATOMIC_RELAXED))
+  {
+    // the run starts before its first receive, not once that has a batch
+    if (recv->ullPackets == 0)
+    {
+      recv->ullCallNs = clockNs (CLOCK_MONOTONIC);
+    }
+    if (recv->iMode == MODE_RECVFROM)
+    {
+      socklen_t addrLen = sizeof (addrs[0]);
+
+      iRet = recvfrom (recv->iFd, buffers, BENCH_SLOT_SIZE, MSG_TRUNC, (struct sockaddr *) &addrs[0], &addrLen);
+      if (iRet >= 0)
+      {
+        benchCount (recv, buffers, iRet);
+        if (recv->bEcho)
+        {
+          sendto (recv->iFd, buffers, iRet < BENCH_SLOT_SIZE ? iRet : BENCH_SLOT_SIZE, 0,
+                  (struct sockaddr *) &addrs[0], addrLen);
+        }
+        benchPublish (recv, 1);
+        continue;
+      }
+    }
+    else
+    {
+      if (recv->iMode == MODE_RAW_EPOLL)
+      {
+        iRet = epoll_wait (iEpFd, &event, 1, 100);
+        if (iRet <= 0)
+        {
+          continue;
+        }
+      }
+
+      // rawepoll: until it's dry, which the socket being non blocking says
+      do
+      {
+        for (i = 0 ; i < recv->iBatch ; i++)
+        {
+          iovs[i].iov_len = BENCH_SLOT_SIZE;
+          msgs[i].msg_hdr.msg_namelen = sizeof (addrs[i]);
+        }
+        iRet = recvmmsg (recv->iFd, msgs, recv->iBatch, MSG_WAITFORONE | MSG_TRUNC, NULL);
+        if (iRet > 0)
+        {
+          for (i = 0 ; i < iRet ; i++)
+          {
+            benchCount (recv, iovs[i].iov_base, msgs[i].msg_len);
+            if (msgs[i].msg_len < iovs[i].iov_len)
+            {
+              iovs[i].iov_len = msgs[i].msg_len;
+            }
+          }
+          if (recv->bEcho)
+          {
+            sendmmsg (recv->iFd, msgs, iRet, 0);
+          }
+          benchPublish (recv, iRet);
+        }
+      } while (iRet > 0 && recv->iMode == MODE_RAW_EPOLL);
+      if (iRet >= 0)
+      {
+        continue;
+      }
+    }
+
+    if (errno != EAGAIN && errno != EINTR && errno != ECONNREFUSED)
+    {
+      perror ("receive");
+      break;
+    }
+  }
+
+  if (iEpFd >= 0)
+  {
+    close (iEpFd);
+  }
+  free (buffers);
+  free (addrs);
+  free (iovs);
+  free (msgs);
+  return NULL;
+}
+
+struct benchConfig
+{
+  int iMode;
+  int iThreads;
+  int iFlows;
+  int iPort;
+  int iBatch;
+  int iRcvBuf;
+  int bEcho;
+  unsigned int uiLength;
+  unsigned long long ullCount;
+  unsigned long long ullRate;   // datagrams a second, 0 for as fast as it goes
+  clockid_t clock;
+  struct sockaddr_in serverAddr;
+};
+
+// a 100ms receive timeout, SO_REUSEPORT for the threads and a bigger buffer
+// if it says so (capped at net.core.rmem_max)
+static void benchSocketOptions (int iFd, const struct benchConfig *cfg)
+{
+  struct timeval tv = { 0, 100000 };
+
+  if (setsockopt (iFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0)
+  {
+    perror ("setsockopt SO_RCVTIMEO");
+    exit (1);
+  }
+  if (cfg->iRcvBuf > 0 && setsockopt (iFd, SOL_SOCKET, SO_RCVBUF, &cfg->iRcvBuf, sizeof (cfg->iRcvBuf)) < 0)
+  {
+    perror ("setsockopt SO_RCVBUF");
+    exit (1);
+  }
+}
+
+static int benchServerSocket (const struct benchConfig *cfg)
+{
+  struct sockaddr_in addr;
+  int iOn = 1;
+  int iFd;
+
+  iFd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (iFd < 0)
+  {
+    perror ("socket");
+    exit (1);
+  }
+  if (cfg->iMode == MODE_THREADS && setsockopt (iFd, SOL_SOCKET, SO_REUSEPORT, &iOn, sizeof (iOn)) < 0)
+  {
+    perror ("setsockopt SO_REUSEPORT");
+    exit (1);
+  }
+  if (cfg->iMode == MODE_RAW_EPOLL)
+  {
+    fcntl (iFd, F_SETFL, fcntl (iFd, F_GETFL) | O_NONBLOCK);
+  }
+  benchSocketOptions (iFd, cfg);
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (cfg->iPort);
+  addr.sin_addr.s_addr = htonl (INADDR_ANY);
+  if (bind (iFd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+  {
+    perror ("bind");
+    exit (1);
+  }
+  return iFd;
+}
+
+static void recvStart (struct benchRecv *recv, int iFd, int iMode, int iBatch, int bEcho)
+{
+  memset (recv, 0, sizeof (*recv));
+  recv->iFd = iFd;
+  recv->iMode = iMode;
+  recv->iBatch = iBatch;
+  recv->bEcho = bEcho;
+  if (pthread_create (&recv->thread, NULL, recvRun, recv) != 0)
+  {
+    perror ("pthread_create");
+    exit (1);
+  }
+}
+
+// wait for the receivers to go quiet: ullIdleNs after the last datagram, or
+// after ullSince if none came at all (for ever, with ullSince 0)
+static void recvWaitIdle (struct benchRecv *recvs, int iRecvs, unsigned long long ullSince, unsigned long long ullIdleNs)
+{
+  struct timespec ts = { 0, 10000000 };
+  unsigned long long ullLast;
+  unsigned long long ullNs;
+  int i;
+
+  for ( ;; )
+  {
+    nanosleep (&ts, NULL);
+    ullLast = ullSince;
+    for (i = 0 ; i < iRecvs ; i++)
+    {
+      ullNs = __atomic_load_n (&recvs[i].ullLastNs, __ATOMIC_RELAXED);
+      if (ullNs > ullLast)
+      {
+        ullLast = ullNs;
+      }
+    }
+    if (ullLast != 0 && clockNs (CLOCK_MONOTONIC) - ullLast > ullIdleNs)
+    {
+      return;
+    }
+  }
+}
+
+static void recvStop (struct benchRecv *recvs, int iRecvs)
+{
+  int i;
+
+  __atomic_store_n (&gi_Stop, 1, __ATOMIC_RELAXED);
+  for (i = 0 ; i < iRecvs ; i++)
+  {
+    pthread_join (recvs[i].thread, NULL);
+  }
+  __atomic_store_n (&gi_Stop, 0, __ATOMIC_RELAXED);
+}
+
+static void reportHeader (void)
+{
+  printf ("%-8s %3s %11s %11s %7s %8s %10s %8s %8s %8s %8s %8s\n",
+          "mode", "thr", "sent", "received", "loss%", "reorder", "pkts/s", "MB/s",
+          "p50us", "p99us", "p999us", "maxus");
+}
+
+// one line for the receivers of a run; with no count of what was sent it
+// goes by the highest sequence number that came in on each flow
+static void report (const char *szMode, int iThreads, const struct benchRecv *recvs, int iRecvs, unsigned long long ullSent)
+{
+  struct benchHist *hist;
+  unsigned long long ullNext[BENCH_MAX_FLOWS];
+  unsigned long long ullPackets = 0;
+  unsigned long long ullBytes = 0;
+  unsigned long long ullReordered = 0;
+  unsigned long long ullForeign = 0;
+  unsigned long long ullFirst = 0;
+  unsigned long long ullLast = 0;
+  unsigned long long ullExpected = 0;
+  double dSeconds;
+  int iFlow;
+  int i;
+
+  hist = calloc (1, sizeof (*hist));
+  if (hist == NULL)
+  {
+    perror ("calloc");
+    exit (1);
+  }
+  memset (ullNext, 0, sizeof (ullNext));
+  for (i = 0 ; i < iRecvs ; i++)
+  {
+    if (recvs[i].ullPackets == 0)
+    {
+      continue;
+    }
+    ullPackets += recvs[i].ullPackets;
+    ullBytes += recvs[i].ullBytes;
+    ullReordered += recvs[i].ullReordered;
+    ullForeign += recvs[i].ullForeign;
+    if (ullFirst == 0 || recvs[i].ullFirstNs < ullFirst)
+    {
+      ullFirst = recvs[i].ullFirstNs;
+    }
+    if (recvs[i].ullLastNs > ullLast)
+    {
+      ullLast = recvs[i].ullLastNs;
+    }
+    for (iFlow = 0 ; iFlow < BENCH_MAX_FLOWS ; iFlow++)
+    {
+      if (recvs[i].ullNext[iFlow] > ullNext[iFlow])
+      {
+        ullNext[iFlow] = recvs[i].ullNext[iFlow];
+      }
+    }
+    histMerge (hist, &recvs[i].hist);
+  }
+  if (ullSent == 0)
+  {
+    for (iFlow = 0 ; iFlow < BENCH_MAX_FLOWS ; iFlow++)
+    {
+      ullExpected += ullNext[iFlow];
+    }
+  }
+  else
+  {
+    ullExpected = ullSent;
+  }
+  ullPackets -= ullForeign;
+  dSeconds = ullLast > ullFirst ? (ullLast - ullFirst) / 1e9 : 0.0;
+
+  printf ("%-8s %3d %11llu %11llu %7.3f %8llu %10.0f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+          szMode, iThreads, ullExpected, ullPackets,
+          ullExpected > ullPackets ? 100.0 * (ullExpected - ullPackets) / ullExpected : 0.0,
+          ullReordered, dSeconds > 0 ? ullPackets / dSeconds : 0.0,
+          dSeconds > 0 ? ullBytes / dSeconds / 1e6 : 0.0,
+          histPercentile (hist, 0.5) / 1e3, histPercentile (hist, 0.99) / 1e3,
+          histPercentile (hist, 0.999) / 1e3, hist->ullMax / 1e3);
+  if (ullForeign != 0)
+  {
+    printf ("         %llu datagrams that weren't ours\n", ullForeign);
+  }
+  fflush (stdout);
+  free (hist);
+}
+
+// the batch goes when the datagrams before it are due, as in udp_client
+static void pace (unsigned long long ullStart, unsigned long long ullSent, unsigned long long ullRate)
+{
+  unsigned long long ullDue;
+  struct timespec ts;
+
+  ullDue = ullStart + (unsigned long long) ((double) ullSent * 1e9 / ullRate);
+  if (ullDue > clockNs (CLOCK_MONOTONIC))
+  {
+    ts.tv_sec = ullDue / 1000000000ULL;
+    ts.tv_nsec = ullDue % 1000000000ULL;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+  }
+}
+
+// a connected socket a flow, so the flows differ in their source port (which
+// is what SO_REUSEPORT spreads them by); the batches go round the flows
+static unsigned long long sendRun (const struct benchConfig *cfg, const int *iFds)
+{
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct benchHeader header;
+  struct pollfd pfd;
+  unsigned long long ullSeq[BENCH_MAX_FLOWS];
+  unsigned long long ullSent = 0;
+  unsigned long long ullStart;
+  unsigned long long ullNow;
+  char *buffers;
+  int iFlow = 0;
+  int iMsgs;
+  int iRet;
+  int i;
+
+  msgs = calloc (cfg->iBatch, sizeof (*msgs));
+  iovs = calloc (cfg->iBatch, sizeof (*iovs));
+  buffers = malloc ((size_t) cfg->iBatch * cfg->uiLength);
+  if (msgs == NULL || iovs == NULL || buffers == NULL)
+  {
+    perror ("malloc");
+    exit (1);
+  }
+  memset (buffers, 'x', (size_t) cfg->iBatch * cfg->uiLength);
+  for (i = 0 ; i < cfg->iBatch ; i++)
+  {
+    iovs[i].iov_base = buffers + (size_t) i * cfg->uiLength;
+    iovs[i].iov_len = cfg->uiLength;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  memset (ullSeq, 0, sizeof (ullSeq));
+  memset (&header, 0, sizeof (header));
+  header.uiMagic = BENCH_MAGIC;
+  header.uiClock = cfg->clock;
+  pfd.events = POLLOUT;
+
+  ullStart = clockNs (CLOCK_MONOTONIC);
+  while (ullSent < cfg->ullCount)
+  {
+    iMsgs = cfg->ullCount - ullSent < (unsigned long long) cfg->iBatch ? (int) (cfg->ullCount - ullSent) : cfg->iBatch;
+    if (cfg->ullRate != 0)
+    {
+      pace (ullStart, ullSent, cfg->ullRate);
+    }
+
+    // the one time for the batch, it goes out all at once
+    header.uiFlow = iFlow;
+    header.ullSentNs = clockNs (cfg->clock);
+    for (i = 0 ; i < iMsgs ; i++)
+    {
+      header.ullSeq = ullSeq[iFlow] + i;
+      memcpy (iovs[i].iov_base, &header, sizeof (header));
+    }
+
+    iRet = sendmmsg (iFds[iFlow], msgs, iMsgs, 0);
+    if (iRet < 0)
+    {
+      if (errno == EINTR || errno == ECONNREFUSED)
+      {
+        // the port unreachable of one before, nobody listening (yet)
+        continue;
+      }
+      if (errno == ENOBUFS)
+      {
+        pfd.fd = iFds[iFlow];
+        poll (&pfd, 1, 1);
+        continue;
+      }
+      perror ("sendmmsg");
+      break;
+    }
+    ullSeq[iFlow] += iRet;
+    ullSent += iRet;
+    iFlow = (iFlow + 1) % cfg->iFlows;
+  }
+
+  ullNow = clockNs (CLOCK_MONOTONIC);
+  if (ullNow > ullStart)
+  {
+    // what it could send, next to what came in
+    fprintf (stderr, "  sent %llu in %.3f s, %.0f a second\n", ullSent, (ullNow - ullStart) / 1e9,
+             ullSent * 1e9 / (ullNow - ullStart));
+  }
+
+  free (buffers);
+  free (iovs);
+  free (msgs);
+  return ullSent;
+}
+
+static void openFlows (const struct benchConfig *cfg, int *iFds)
+{
+  int i;
+
+  for (i = 0 ; i < cfg->iFlows ; i++)
+  {
+    iFds[i] = socket (AF_INET, SOCK_DGRAM, 0);
+    if (iFds[i] < 0)
+    {
+      perror ("socket");
+      exit (1);
+    }
+    benchSocketOptions (iFds[i], cfg);
+    if (connect (iFds[i], (const struct sockaddr *) &cfg->serverAddr, sizeof (cfg->serverAddr)) < 0)
+    {
+      perror ("connect");
+      exit (1);
+    }
+  }
+}
+
+// the client end: send, and with -e read the echoes on each flow and report
+// on those
+static unsigned long long runClient (const struct benchConfig *cfg, const char *szMode, int iThreads)
+{
+  struct benchRecv *echoes = NULL;
+  int iFds[BENCH_MAX_FLOWS];
+  unsigned long long ullSent;
+  unsigned long long ullDone;
+  int i;
+
+  openFlows (cfg, iFds);
+  if (cfg->bEcho)
+  {
+    echoes = aligned_alloc (64, sizeof (*echoes) * cfg->iFlows);
+    if (echoes == NULL)
+    {
+      perror ("aligned_alloc");
+      exit (1);
+    }
+    for (i = 0 ; i < cfg->iFlows ; i++)
+    {
+      recvStart (&echoes[i], iFds[i], MODE_RECVMMSG, cfg->iBatch, 0);
+    }
+  }
+
+  ullSent = sendRun (cfg, iFds);
+  ullDone = clockNs (CLOCK_MONOTONIC);
+
+  if (cfg->bEcho)
+  {
+    recvWaitIdle (echoes, cfg->iFlows, ullDone, BENCH_IDLE_NS);
+    recvStop (echoes, cfg->iFlows);
+    report (szMode, iThreads, echoes, cfg->iFlows, ullSent);
+    free (echoes);
+  }
+  for (i = 0 ; i < cfg->iFlows ; i++)
+  {
+    close (iFds[i]);
+  }
+  return ullSent;
+}
+
+// the server end of one run: bUntilIdle waits for the traffic to come and
+// go (server only), otherwise the client goes in this thread
+static void runMode (const struct benchConfig *cfg, int bServerOnly)
+{
+  struct benchRecv *recvs;
+  int iFds[BENCH_MAX_THREADS];
+  int iRecvs = cfg->iMode == MODE_THREADS ? cfg->iThreads : 1;
+  unsigned long long ullSent = 0;
+  unsigned long long ullDone;
+  int i;
+
+  recvs = aligned_alloc (64, sizeof (*recvs) * iRecvs);
+  if (recvs == NULL)
+  {
+    perror ("aligned_alloc");
+    exit (1);
+  }
+  for (i = 0 ; i < iRecvs ; i++)
+  {
+    iFds[i] = benchServerSocket (cfg);
+    recvStart (&recvs[i], iFds[i], cfg->iMode, cfg->iMode == MODE_RECVFROM ? 1 : cfg->iBatch, cfg->bEcho);
+  }
+
+  if (bServerOnly)
+  {
+    recvWaitIdle (recvs, iRecvs, 0, BENCH_SERVER_IDLE_NS);
+    recvStop (recvs, iRecvs);
+    report (gsz_Modes[cfg->iMode], iRecvs, recvs, iRecvs, 0);
+  }
+  else
+  {
+    ullSent = runClient (cfg, cfg->bEcho ? "rtt" : gsz_Modes[cfg->iMode], iRecvs);
+    ullDone = clockNs (CLOCK_MONOTONIC);
+    recvWaitIdle (recvs, iRecvs, ullDone, BENCH_IDLE_NS);
+    recvStop (recvs, iRecvs);
+    report (gsz_Modes[cfg->iMode], iRecvs, recvs, iRecvs, ullSent);
+  }
+
+  for (i = 0 ; i < iRecvs ; i++)
+  {
+    close (iFds[i]);
+  }
+  free (recvs);
+}
+
+int main (int argc, char **argv)
+{
+  struct benchConfig cfg;
+  struct addrinfo hints;
+  struct addrinfo *addrInfo;
+  const char *szHost = NULL;
+  int bServerOnly = 0;
+  int bAll = 1;
+  int iError;
+  int iOpt;
+  int i;
+
+  memset (&cfg, 0, sizeof (cfg));
+  cfg.iThreads = 4;
+  cfg.iPort = 4711;
+  cfg.iBatch = 64;
+  cfg.uiLength = 64;
+  cfg.ullCount = 1000000;
+  while ((iOpt = getopt (argc, argv, "m:t:f:n:r:l:b:B:esc:")) != -1)
+  {
+    switch (iOpt)
+    {
+    case 'm':
+      bAll = strcmp (optarg, "all") == 0;
+      for (cfg.iMode = 0 ; !bAll && cfg.iMode < MODE_COUNT && strcmp (optarg, gsz_Modes[cfg.iMode]) != 0 ; cfg.iMode++)
+      {
+      }
+      if (cfg.iMode == MODE_COUNT)
+      {
+        fprintf (stderr, "no mode %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 't':
+      cfg.iThreads = atoi (optarg);
+      break;
+    case 'f':
+      cfg.iFlows = atoi (optarg);
+      break;
+    case 'n':
+      cfg.ullCount = strtoull (optarg, NULL, 0);
+      break;
+    case 'r':
+      cfg.ullRate = strtoull (optarg, NULL, 0);
+      break;
+    case 'l':
+      cfg.uiLength = atoi (optarg);
+      break;
+    case 'b':
+      cfg.iBatch = atoi (optarg);
+      break;
+    case 'B':
+      cfg.iRcvBuf = atoi (optarg);
+      break;
+    case 'e':
+      cfg.bEcho = 1;
+      break;
+    case 's':
+      bServerOnly = 1;
+      break;
+    case 'c':
+      szHost = optarg;
+      break;
+    default:
+      fprintf (stderr, "usage: %s [-m mode] [-t threads] [-f flows] [-n count] [-r rate] [-l length]\n"
+                       "          [-b batch] [-B rcvbuf] [-e] [-s | -c host] [port]\n"
+                       "  mode: recvfrom, recvmmsg, rawepoll, threads or all\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc)
+  {
+    cfg.iPort = atoi (argv[optind++]);
+  }
+  if (cfg.iFlows == 0)
+  {
+    // the threads only get a share with more flows than there are of them
+    cfg.iFlows = bAll || cfg.iMode == MODE_THREADS ? cfg.iThreads * 2 : 1;
+  }
+  if (cfg.iThreads < 1 || cfg.iThreads > BENCH_MAX_THREADS || cfg.iFlows < 1 || cfg.iFlows > BENCH_MAX_FLOWS ||
+      cfg.iBatch < 1 || cfg.iBatch > BENCH_MAX_BATCH || cfg.uiLength < sizeof (struct benchHeader) ||
+      cfg.uiLength > 65507 || (bServerOnly && szHost != NULL) || ((bServerOnly || szHost) && bAll))
+  {
+    fprintf (stderr, "threads 1 to %d, flows 1 to %d, batch 1 to %d, length %d to 65507,"
+             " and -s or -c with one -m mode\n",
+             BENCH_MAX_THREADS, BENCH_MAX_FLOWS, BENCH_MAX_BATCH, (int) sizeof (struct benchHeader));
+    return 1;
+  }
+
+  // in one process and for the round trip it's the one clock, across hosts
+  // the one they'd both have in sync
+  cfg.clock = szHost == NULL || cfg.bEcho ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  iError = getaddrinfo (szHost == NULL ? "127.0.0.1" : szHost, NULL, &hints, &addrInfo);
+  if (iError != 0)
+  {
+    fprintf (stderr, "error with getaddrinfo: %s\n", gai_strerror (iError));
+    return 1;
+  }
+  cfg.serverAddr = *(struct sockaddr_in *) addrInfo->ai_addr;
+  cfg.serverAddr.sin_port = htons (cfg.iPort);
+  freeaddrinfo (addrInfo);
+
+  if (bServerOnly)
+  {
+    printf ("Server running on port %d%s\n", cfg.iPort, cfg.bEcho ? ", echoing" : "");
+  }
+  else
+  {
+    printf ("%llu datagrams of %u bytes, batches of %d, %d flows", cfg.ullCount, cfg.uiLength, cfg.iBatch, cfg.iFlows);
+    if (cfg.ullRate != 0)
+    {
+      printf (", %llu a second", cfg.ullRate);
+    }
+    printf ("%s\n", cfg.bEcho ? ", echoed" : "");
+  }
+  reportHeader ();
+  fflush (stdout);
+
+  if (szHost != NULL)
+  {
+    // the server is someone else's; a line if there's something to say
+    runClient (&cfg, cfg.bEcho ? "rtt" : gsz_Modes[cfg.iMode], 0);
+    return 0;
+  }
+  if (bServerOnly)
+  {
+    for ( ;; )
+    {
+      runMode (&cfg, 1);
+    }
+  }
+  for (i = bAll ? 0 : cfg.iMode ; i < (bAll ? MODE_COUNT : cfg.iMode + 1) ; i++)
+  {
+    cfg.iMode = i;
+    runMode (&cfg, 0);
+  }
+  return 0;
+}
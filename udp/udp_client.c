@@ -1,14 +1,22 @@
+// gcc -Wall -O2 udp_client.c -o udp_client
+#define _GNU_SOURCE // sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
 
 #include <sys/types.h>
 #include <netdb.h>
 
 
+#ifdef DUMP_ADDRINFO
 #include <ctype.h>
 #define DUMP_MEM(x) dumpMem (#x, (void *)&(x), sizeof (x))
 static void dumpMem (const char *szNote, const void *vData, unsigned int len)
@@ -60,14 +68,20 @@ static void dumpMem (const char *szNote, const void *vData, unsigned int len)
 }
 
 #define DUMP(x) printf ("%s: %08x\n", #x, (unsigned int)x);
+#endif
 
 int getIpv4Address (const char *szHostName, struct in_addr *inAddr)
 {
   struct addrinfo *addrInfoRes;
   struct addrinfo *addrInfoIter;
+  struct addrinfo hints;
   int iError;
 
-  iError = getaddrinfo (szHostName, NULL, NULL, &addrInfoRes);
+  // just the one entry per address, not one for each socket type
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  iError = getaddrinfo (szHostName, NULL, &hints, &addrInfoRes);
   if (iError != 0)
   {
     fprintf (stderr, "error with getaddrinfo: %s\n", gai_strerror(iError));
@@ -77,7 +91,7 @@ int getIpv4Address (const char *szHostName, struct in_addr *inAddr)
   iError = -1;
   for (addrInfoIter = addrInfoRes ; addrInfoIter != NULL ; addrInfoIter = addrInfoIter->ai_next)
   {
-#if 1
+#ifdef DUMP_ADDRINFO // -DDUMP_ADDRINFO=1 to see what getaddrinfo(3) says
     printf ("\n=====================================\n");
     DUMP_MEM (addrInfoIter->ai_flags);
     DUMP_MEM (addrInfoIter->ai_family);
@@ -98,42 +112,348 @@ int getIpv4Address (const char *szHostName, struct in_addr *inAddr)
     DUMP_MEM (addrInfoIter->ai_canonname);
 #endif
     
-    if (addrInfoRes->ai_family == AF_INET)
+    if (addrInfoIter->ai_family == AF_INET)
     {
       iError = 0;
       // (struct addrinfo *) contains s_addr which is a POINTER to a struct sockaddr
       // which can be cast to a struct sockaddr_in *
       // Why unions aren't used, is never explained.
-      *inAddr = ((struct sockaddr_in *)addrInfoRes->ai_addr)->sin_addr;
-      printf ("found\n");
-//      break;
+      *inAddr = ((struct sockaddr_in *)addrInfoIter->ai_addr)->sin_addr;
+      break;
     }
   }
   freeaddrinfo (addrInfoRes);
   return iError;
 }
 
+
+// the load generator: the address is looked up once and the socket
+// connect(2)ed, so the kernel doesn't route each datagram on its own, then
+// count datagrams go out a batch of messages a sendmmsg(2).  With GSO a
+// message holds several datagrams of the same length that the kernel cuts
+// up late (UDP_SEGMENT), with MSG_ZEROCOPY it sends straight from our pages
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103  // older libc headers
+#endif
+#define UDP_MAX_BATCH (1024)        // UIO_MAXIOV, what sendmmsg takes
+#define UDP_MAX_SEGMENTS (64)       // datagrams a GSO send, the kernel's limit
+#define UDP_MAX_PAYLOAD (65507)     // 64K less the IPv4 and UDP headers
+
+struct udpLoad
+{
+  unsigned long long ullCount;  // datagrams
+  unsigned long long ullRate;   // datagrams a second, 0 for as fast as it goes
+  unsigned int uiLength;        // bytes a datagram
+  int iBatch;                   // messages a sendmmsg
+  int iSegments;                // datagrams a message, 1 without GSO
+  int bZeroCopy;
+};
+
+struct udpSendStats
+{
+  unsigned long long ullDatagrams;
+  unsigned long long ullBytes;
+  unsigned long long ullCalls;
+  unsigned long long ullRefused;   // nobody listening, as the ICMP said
+  unsigned long long ullZcSent;    // messages sent MSG_ZEROCOPY
+  unsigned long long ullZcDone;    // and the kernel said it's done with
+  unsigned long long ullZcCopied;  // which it copied after all
+};
+
+static unsigned long long nowNs (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// every MSG_ZEROCOPY message gets a number, and once the kernel is through
+// with its pages it says so on the error queue, a range of numbers at a
+// time.  Our payload never changes, so there's no holding it back until
+// then, but the notes have to be read off or the socket runs out of option
+// memory and the sends fail with ENOBUFS
+static void reapZeroCopy (int iFd, struct udpSendStats *stats)
+{
+  char control[CMSG_SPACE (sizeof (struct sock_extended_err) + sizeof (struct sockaddr_in))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *err;
+  unsigned int uiRange;
+
+  for ( ;; )
+  {
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    if (recvmsg (iFd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+    {
+      return; // EAGAIN, that's all of them
+    }
+
+    for (cmsg = CMSG_FIRSTHDR (&msg) ; cmsg != NULL ; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+      if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+      {
+        continue;
+      }
+      err = (struct sock_extended_err *) CMSG_DATA (cmsg);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+      {
+        continue;
+      }
+      uiRange = err->ee_data - err->ee_info + 1;
+      stats->ullZcDone += uiRange;
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+      {
+        stats->ullZcCopied += uiRange;
+      }
+    }
+  }
+}
+
+// the batch goes when the datagrams before it are due, so the rate holds on
+// average and comes in bursts of a batch
+static void pace (unsigned long long ullStart, unsigned long long ullSent, unsigned long long ullRate)
+{
+  unsigned long long ullDue;
+  struct timespec ts;
+
+  ullDue = ullStart + (unsigned long long) ((double) ullSent * 1e9 / ullRate);
+  if (ullDue > nowNs ())
+  {
+    ts.tv_sec = ullDue / 1000000000ULL;
+    ts.tv_nsec = ullDue % 1000000000ULL;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+  }
+}
+
+static int sendLoad (int iFd, const struct udpLoad *load, const char *szMessage)
+{
+  struct udpSendStats stats;
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct pollfd pfd;
+  char *payload;
+  size_t ulMessage = (size_t) load->uiLength * load->iSegments;
+  size_t ulFill = strlen (szMessage);
+  size_t ul;
+  unsigned long long ullStart;
+  unsigned long long ullLast;
+  unsigned long long ullNow;
+  unsigned long long ullLeft;
+  unsigned long long ullLastDatagrams = 0;
+  unsigned long long ullLastBytes = 0;
+  unsigned int uiSegments;
+  int iMsgs;
+  int iRet;
+  int i;
+
+  memset (&stats, 0, sizeof (stats));
+  msgs = calloc (load->iBatch, sizeof (*msgs));
+  iovs = calloc (load->iBatch, sizeof (*iovs));
+  payload = malloc (ulMessage);
+  if (msgs == NULL || iovs == NULL || payload == NULL)
+  {
+    perror ("malloc");
+    exit (1);
+  }
+
+  // the message over and over; every message points at the same bytes
+  for (ul = 0 ; ul < ulMessage ; ul++)
+  {
+    payload[ul] = ulFill ? szMessage[(ul % load->uiLength) % ulFill] : 'x';
+  }
+  for (i = 0 ; i < load->iBatch ; i++)
+  {
+    iovs[i].iov_base = payload;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  printf ("Sending %llu datagrams of %u bytes, %d messages a call, %d datagrams a message%s",
+          load->ullCount, load->uiLength, load->iBatch, load->iSegments, load->bZeroCopy ? ", zerocopy" : "");
+  if (load->ullRate != 0)
+  {
+    printf (", %llu a second", load->ullRate);
+  }
+  printf ("\n");
+
+  pfd.fd = iFd;
+  pfd.events = POLLOUT;
+  ullStart = ullLast = nowNs ();
+  while (stats.ullDatagrams < load->ullCount)
+  {
+    // the last message of all may be a short one
+    ullLeft = load->ullCount - stats.ullDatagrams;
+    for (i = 0 ; i < load->iBatch && ullLeft > 0 ; i++)
+    {
+      uiSegments = ullLeft < (unsigned long long) load->iSegments ? ullLeft : load->iSegments;
+      iovs[i].iov_len = (size_t) uiSegments * load->uiLength;
+      ullLeft -= uiSegments;
+    }
+    iMsgs = i;
+
+    if (load->ullRate != 0)
+    {
+      pace (ullStart, stats.ullDatagrams, load->ullRate);
+    }
+
+    iRet = sendmmsg (iFd, msgs, iMsgs, load->bZeroCopy ? MSG_ZEROCOPY : 0);
+    if (iRet < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == ECONNREFUSED)
+      {
+        // the port unreachable for one of the last ones, it's only reported
+        // and the next send goes again
+        stats.ullRefused++;
+        continue;
+      }
+      if (errno == ENOBUFS)
+      {
+        // the device queue is full, or too many zerocopy messages are
+        // still out: give it a moment (an error queue entry wakes it up too)
+        poll (&pfd, 1, 10);
+        if (load->bZeroCopy)
+        {
+          reapZeroCopy (iFd, &stats);
+        }
+        continue;
+      }
+      perror ("sendmmsg");
+      break;
+    }
+
+    stats.ullCalls++;
+    for (i = 0 ; i < iRet ; i++)
+    {
+      stats.ullDatagrams += (msgs[i].msg_len + load->uiLength - 1) / load->uiLength;
+      stats.ullBytes += msgs[i].msg_len;
+    }
+    if (load->bZeroCopy)
+    {
+      stats.ullZcSent += iRet;
+      reapZeroCopy (iFd, &stats);
+    }
+
+    ullNow = nowNs ();
+    if (ullNow - ullLast >= 1000000000ULL)
+    {
+      printf ("%.0f datagrams/s, %.1f Mbit/s\n",
+              (stats.ullDatagrams - ullLastDatagrams) * 1e9 / (ullNow - ullLast),
+              (stats.ullBytes - ullLastBytes) * 8e3 / (ullNow - ullLast));
+      fflush (stdout);
+      ullLastDatagrams = stats.ullDatagrams;
+      ullLastBytes = stats.ullBytes;
+      ullLast = ullNow;
+    }
+  }
+  ullNow = nowNs ();
+
+  printf ("%llu datagrams, %llu bytes in %.3f s: %.0f datagrams/s, %.1f Mbit/s, %.1f datagrams a call, %llu refused\n",
+          stats.ullDatagrams, stats.ullBytes, (ullNow - ullStart) / 1e9,
+          stats.ullDatagrams * 1e9 / (ullNow - ullStart + 1), stats.ullBytes * 8e3 / (ullNow - ullStart + 1),
+          stats.ullCalls ? (double) stats.ullDatagrams / stats.ullCalls : 0.0, stats.ullRefused);
+
+  if (load->bZeroCopy)
+  {
+    // the last of the notes, for the count of copies; a second at most
+    pfd.events = 0; // POLLERR comes anyway
+    for (i = 0 ; i < 10 && stats.ullZcDone < stats.ullZcSent ; i++)
+    {
+      poll (&pfd, 1, 100);
+      reapZeroCopy (iFd, &stats);
+    }
+    printf ("%llu zerocopy messages, %llu done, %llu of them copied anyway%s\n",
+            stats.ullZcSent, stats.ullZcDone, stats.ullZcCopied,
+            stats.ullZcCopied ? " (loopback always copies)" : "");
+  }
+
+  free (payload);
+  free (iovs);
+  free (msgs);
+  return stats.ullDatagrams < load->ullCount;
+}
+
+// udp_client [-n count [-r rate] [-l length] [-b batch] [-g segments] [-z]] [port [host [message]]]
+//   without -n the message goes out once.  With it, it's the load generator:
+//   count datagrams of length bytes (the message over and over), batch
+//   messages a sendmmsg, at rate a second if there's a -r.  -g puts that many
+//   datagrams in a message for the kernel to cut up (UDP GSO), -z sends
+//   MSG_ZEROCOPY, which only pays off from some 10K a message
 int main (int argc, char **argv)
 {
   int iFd;
   int iPort = 4000;
+  int iOpt;
+  int iOn = 1;
   struct sockaddr_in serveraddr;
+  struct udpLoad load;
   const char *szMessage = "hello";
   const char *szHostName = "127.0.0.1";
 
-  if (argc >= 2)
+  memset (&load, 0, sizeof (load));
+  load.iBatch = 64;
+  load.iSegments = 1;
+  while ((iOpt = getopt (argc, argv, "n:r:l:b:g:z")) != -1)
+  {
+    switch (iOpt)
+    {
+    case 'n':
+      load.ullCount = strtoull (optarg, NULL, 0);
+      break;
+    case 'r':
+      load.ullRate = strtoull (optarg, NULL, 0);
+      break;
+    case 'l':
+      load.uiLength = atoi (optarg);
+      break;
+    case 'b':
+      load.iBatch = atoi (optarg);
+      break;
+    case 'g':
+      load.iSegments = atoi (optarg);
+      break;
+    case 'z':
+      load.bZeroCopy = 1;
+      break;
+    default:
+      fprintf (stderr, "usage: %s [-n count [-r rate] [-l length] [-b batch] [-g segments] [-z]] [port [host [message]]]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc)
   {
-    iPort = atoi (argv[1]);
+    iPort = atoi (argv[optind++]);
   }
-  if (argc >= 3)
+  if (optind < argc)
   {
-    szHostName = argv[2];
+    szHostName = argv[optind++];
   }
-  if (argc >= 4)
+  if (optind < argc)
   {
-    szMessage = argv[3];
+    szMessage = argv[optind++];
   }
-  
+
+  if (load.uiLength == 0)
+  {
+    load.uiLength = strlen (szMessage) ? strlen (szMessage) : 1;
+  }
+  if (load.iBatch < 1 || load.iBatch > UDP_MAX_BATCH ||
+      load.iSegments < 1 || load.iSegments > UDP_MAX_SEGMENTS ||
+      (unsigned long long) load.uiLength * load.iSegments > UDP_MAX_PAYLOAD)
+  {
+    fprintf (stderr, "batch is 1 to %d, segments 1 to %d, and length times segments at most %d\n",
+             UDP_MAX_BATCH, UDP_MAX_SEGMENTS, UDP_MAX_PAYLOAD);
+    return 1;
+  }
+
   iFd = socket (AF_INET, SOCK_DGRAM, 0);
   if (iFd < 0)
   {
@@ -145,15 +465,47 @@ int main (int argc, char **argv)
   serveraddr.sin_family = AF_INET;
   serveraddr.sin_port = htons (iPort);
   //serveraddr.sin_addr.s_addr = htonl (0x7f000001);
-  getIpv4Address (szHostName, &(serveraddr.sin_addr));
+  if (getIpv4Address (szHostName, &(serveraddr.sin_addr)) != 0)
+  {
+    fprintf (stderr, "no IPv4 address for %s\n", szHostName);
+    return 1;
+  }
+  if (connect (iFd, (struct sockaddr *)&serveraddr, sizeof (serveraddr)) < 0)
+  {
+    perror ("connect");
+    return 1;
+  }
 
   printf ("UDP client sending to port %d\n", iPort);
 
-  if (sendto (iFd, szMessage, strlen (szMessage), 0, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0 )
+  if (load.ullCount == 0)
   {
-    perror ("sendto");
+    if (send (iFd, szMessage, strlen (szMessage), 0) < 0)
+    {
+      perror ("send");
+    }
+    printf ("message sent\n");
+    close (iFd);
+    return 0;
   }
-  printf ("message sent\n");
-  
+
+  if (load.iSegments > 1)
+  {
+    int iSegmentSize = load.uiLength;
+
+    if (setsockopt (iFd, SOL_UDP, UDP_SEGMENT, &iSegmentSize, sizeof (iSegmentSize)) < 0)
+    {
+      perror ("setsockopt UDP_SEGMENT");
+      return 1;
+    }
+  }
+  if (load.bZeroCopy && setsockopt (iFd, SOL_SOCKET, SO_ZEROCOPY, &iOn, sizeof (iOn)) < 0)
+  {
+    perror ("setsockopt SO_ZEROCOPY");
+    return 1;
+  }
+
+  iOpt = sendLoad (iFd, &load, szMessage);
   close( iFd );
+  return iOpt;
 }
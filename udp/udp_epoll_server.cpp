@@ -0,0 +1,291 @@
+// g++ -Wall -O2 -DEPOLLER_NO_MAIN=1 -I../epoll_example udp_epoll_server.cpp ../epoll_example/epoll_example.cpp -o udp_epoll_server -pthread
+//
+// udp_server's job for any number of feeds in one thread: a socket for each
+// port and family, all of them in one epoller.  A ready socket is emptied in
+// non blocking recvmmsg batches (epoller::receive) into the epoller's pooled
+// buffers, and the epoller's per fd table takes us straight to the feed.  A
+// busy feed only gets EPOLLER_RECV_MAX datagrams at a time before the others
+// get their turn.
+//
+// udp_epoll_server [-4 | -6] [-p] port [port ...]
+//   both IPv4 and IPv6 unless it says, -p prints every datagram the way
+//   udp_server does, otherwise there's a line of totals a second
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "epoll_example.h"
+
+struct udpFeed
+{
+  int iFd;
+  int iPort;
+  int iFamily;
+  unsigned long long ullPackets;
+  unsigned long long ullBytes;
+  unsigned long long ullTruncated;
+  unsigned long long ullCalls;   // receive()s that got something
+};
+
+struct udpServer
+{
+  std::vector<udpFeed *> vFeeds;
+  std::vector<epollDatagram> vDatagrams; // reused for every receive()
+  epollTimer timer;
+  unsigned long long ullLastPackets;
+  unsigned long long ullLastBytes;
+  bool bPrint;
+  bool bStop;
+};
+
+static udpServer gs_Server;
+
+// IPv6 with IPV6_V6ONLY, so the IPv4 socket can have the same port
+static int openFeed (int iFamily, int iPort)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  int iOn = 1;
+  int iFd;
+
+  iFd = socket (iFamily, SOCK_DGRAM, 0);
+  if (iFd < 0)
+  {
+    perror ("socket");
+    exit (1);
+  }
+
+  memset (&addr, 0, sizeof (addr));
+  if (iFamily == AF_INET6)
+  {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &addr;
+
+    if (setsockopt (iFd, IPPROTO_IPV6, IPV6_V6ONLY, &iOn, sizeof (iOn)) < 0)
+    {
+      perror ("setsockopt IPV6_V6ONLY");
+      exit (1);
+    }
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons (iPort);
+    in6->sin6_addr = in6addr_any;
+    addrLen = sizeof (*in6);
+  }
+  else
+  {
+    struct sockaddr_in *in4 = (struct sockaddr_in *) &addr;
+
+    in4->sin_family = AF_INET;
+    in4->sin_port = htons (iPort);
+    in4->sin_addr.s_addr = htonl (INADDR_ANY);
+    addrLen = sizeof (*in4);
+  }
+
+  if (bind (iFd, (struct sockaddr *) &addr, addrLen) < 0)
+  {
+    perror ("bind");
+    exit (1);
+  }
+  return iFd;
+}
+
+static void printDatagram (const udpFeed *feed, const epollDatagram &datagram)
+{
+  char hostname [NI_MAXHOST] = "";
+  char service [NI_MAXSERV] = "";
+  int iError;
+
+  iError = getnameinfo ((const struct sockaddr *) &datagram.addr, datagram.addrLen, hostname, NI_MAXHOST,
+                        service, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+  if (iError != 0)
+  {
+    fprintf (stderr, "error in getnameinfo: %s\n", gai_strerror (iError));
+  }
+  printf ("port %d: %zu bytes%s: '%.*s': %s, port %s, IP %s\n", feed->iPort, datagram.view.iov_len,
+          datagram.bTruncated ? " (truncated)" : "", (int) datagram.view.iov_len,
+          (const char *) datagram.view.iov_base, datagram.addr.ss_family == AF_INET6 ? "IPV6" : "IPV4",
+          service, hostname);
+}
+
+// one receive() a wakeup: if it stopped at EPOLLER_RECV_MAX the epoller
+// hands the fd out again after the others
+static void onReadable (epoller &ep, int iFd, uint32_t u32Events, void *vFeed)
+{
+  udpFeed *feed = static_cast<udpFeed *>(vFeed);
+  std::vector<epollDatagram> &vDatagrams = gs_Server.vDatagrams;
+  int iRet;
+
+  iRet = ep.receive (iFd, vDatagrams);
+  if (iRet < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      perror ("recvmmsg");
+    }
+    return;
+  }
+
+  feed->ullCalls++;
+  for (size_t i = 0 ; i < vDatagrams.size () ; i++)
+  {
+    feed->ullPackets++;
+    feed->ullBytes += vDatagrams[i].view.iov_len;
+    if (vDatagrams[i].bTruncated)
+    {
+      feed->ullTruncated++;
+    }
+    if (gs_Server.bPrint)
+    {
+      printDatagram (feed, vDatagrams[i]);
+    }
+  }
+  ep.release (vDatagrams);
+}
+
+static void onError (epoller &ep, int iFd, uint32_t u32Events, void *vFeed)
+{
+  udpFeed *feed = static_cast<udpFeed *>(vFeed);
+  int iError = 0;
+  socklen_t errLen = sizeof (iError);
+
+  getsockopt (iFd, SOL_SOCKET, SO_ERROR, &iError, &errLen);
+  fprintf (stderr, "port %d: %s\n", feed->iPort, strerror (iError));
+}
+
+static void onSignal (epoller &ep, int iFd, uint32_t u32Events, void *vUser)
+{
+  struct signalfd_siginfo info;
+
+  while (read (iFd, &info, sizeof (info)) == sizeof (info))
+  {
+    gs_Server.bStop = true;
+  }
+}
+
+static void onSecond (epoller &ep, epollTimer *timer, void *vUser)
+{
+  unsigned long long ullPackets = 0;
+  unsigned long long ullBytes = 0;
+  int iActive = 0;
+
+  for (size_t i = 0 ; i < gs_Server.vFeeds.size () ; i++)
+  {
+    ullPackets += gs_Server.vFeeds[i]->ullPackets;
+    ullBytes += gs_Server.vFeeds[i]->ullBytes;
+    iActive += gs_Server.vFeeds[i]->ullPackets != 0;
+  }
+  if (ullPackets != gs_Server.ullLastPackets)
+  {
+    printf ("%llu packets/s, %.1f Mbit/s, %d of %zu feeds heard from\n", ullPackets - gs_Server.ullLastPackets,
+            (ullBytes - gs_Server.ullLastBytes) * 8.0 / 1e6, iActive, gs_Server.vFeeds.size ());
+    fflush (stdout);
+  }
+  gs_Server.ullLastPackets = ullPackets;
+  gs_Server.ullLastBytes = ullBytes;
+  ep.addTimer (timer, 1000, onSecond, NULL);
+}
+
+int main (int argc, char **argv)
+{
+  epoller ep;
+  std::vector<int> vFamilies;
+  sigset_t signals;
+  bool b4 = true;
+  bool b6 = true;
+  int iSignalFd;
+  int iOpt;
+
+  while ((iOpt = getopt (argc, argv, "46p")) != -1)
+  {
+    switch (iOpt)
+    {
+    case '4':
+      b6 = false;
+      break;
+    case '6':
+      b4 = false;
+      break;
+    case 'p':
+      gs_Server.bPrint = true;
+      break;
+    default:
+      fprintf (stderr, "usage: %s [-4 | -6] [-p] port [port ...]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc || (!b4 && !b6))
+  {
+    fprintf (stderr, "usage: %s [-4 | -6] [-p] port [port ...]\n", argv[0]);
+    return 1;
+  }
+  if (b4)
+  {
+    vFamilies.push_back (AF_INET);
+  }
+  if (b6)
+  {
+    vFamilies.push_back (AF_INET6);
+  }
+
+  for (int i = optind ; i < argc ; i++)
+  {
+    for (size_t j = 0 ; j < vFamilies.size () ; j++)
+    {
+      udpFeed *feed = new udpFeed ();
+
+      feed->iPort = atoi (argv[i]);
+      feed->iFamily = vFamilies[j];
+      feed->iFd = openFeed (feed->iFamily, feed->iPort);
+      if (!ep.add (feed->iFd, onReadable, NULL, onError, feed))
+      {
+        return 1;
+      }
+      gs_Server.vFeeds.push_back (feed);
+    }
+  }
+
+  // SIGINT and SIGTERM as one more fd, so they're seen between batches
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGINT);
+  sigaddset (&signals, SIGTERM);
+  sigprocmask (SIG_BLOCK, &signals, NULL);
+  iSignalFd = signalfd (-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (iSignalFd < 0 || !ep.add (iSignalFd, onSignal, NULL, NULL, NULL))
+  {
+    perror ("signalfd");
+    return 1;
+  }
+  ep.addTimer (&gs_Server.timer, 1000, onSecond, NULL);
+
+  printf ("Server running on %zu sockets%s\n", gs_Server.vFeeds.size (), ep.usingUring () ? " (io_uring)" : "");
+  fflush (stdout);
+  while (!gs_Server.bStop)
+  {
+    ep.dispatch (-1);
+  }
+
+  printf ("%6s %5s %12s %14s %10s %10s\n", "port", "", "packets", "bytes", "truncated", "per call");
+  for (size_t i = 0 ; i < gs_Server.vFeeds.size () ; i++)
+  {
+    udpFeed *feed = gs_Server.vFeeds[i];
+
+    printf ("%6d %5s %12llu %14llu %10llu %10.1f\n", feed->iPort, feed->iFamily == AF_INET6 ? "IPv6" : "IPv4",
+            feed->ullPackets, feed->ullBytes, feed->ullTruncated,
+            feed->ullCalls ? (double) feed->ullPackets / feed->ullCalls : 0.0);
+    ep.close (feed->iFd);
+    delete feed;
+  }
+  ep.close (iSignalFd);
+
+  return 0;
+}
@@ -1,31 +1,482 @@
+// gcc -Wall -O2 udp_server.c -o udp_server -pthread
+#define _GNU_SOURCE // recvmmsg, CPU pinning
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <linux/filter.h>
 
 #include <sys/socket.h>
 #include <netinet/ip.h> 
 #include <netdb.h>
 
-int main (int argc, char **argv)
+// the high rate mode: recvmmsg(2) into slots that are set up once, and each
+// datagram handed to a handler as it is - the address the way the kernel
+// gave it, no strings made per packet
+#define UDP_SLOT_SIZE (2048) // more than a datagram in a 1500 byte MTU
+
+typedef void (*udpHandler) (const struct sockaddr *addr, socklen_t addrLen, const char *data, unsigned int uiLength, void *vUser);
+
+struct udpRing
 {
-  int iPort = 4000;
+  int iBatch;
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct sockaddr_storage *addrs;
+  char *buffers;
+  unsigned long long ullTruncated; // datagrams bigger than a slot
+};
+
+static struct udpRing *ringCreate (int iBatch)
+{
+  struct udpRing *ring;
+  int i;
+
+  ring = calloc (1, sizeof (*ring));
+  if (ring == NULL)
+  {
+    perror ("calloc");
+    exit (1);
+  }
+  ring->iBatch = iBatch;
+  ring->msgs = calloc (iBatch, sizeof (*ring->msgs));
+  ring->iovs = calloc (iBatch, sizeof (*ring->iovs));
+  ring->addrs = calloc (iBatch, sizeof (*ring->addrs));
+  ring->buffers = malloc ((size_t) iBatch * UDP_SLOT_SIZE);
+  if (ring->msgs == NULL || ring->iovs == NULL || ring->addrs == NULL || ring->buffers == NULL)
+  {
+    perror ("ring");
+    exit (1);
+  }
+
+  for (i = 0 ; i < iBatch ; i++)
+  {
+    ring->iovs[i].iov_base = ring->buffers + (size_t) i * UDP_SLOT_SIZE;
+    ring->iovs[i].iov_len = UDP_SLOT_SIZE;
+    ring->msgs[i].msg_hdr.msg_iov = &ring->iovs[i];
+    ring->msgs[i].msg_hdr.msg_iovlen = 1;
+    ring->msgs[i].msg_hdr.msg_name = &ring->addrs[i];
+  }
+
+  return ring;
+}
+
+static void ringDestroy (struct udpRing *ring)
+{
+  free (ring->buffers);
+  free (ring->addrs);
+  free (ring->iovs);
+  free (ring->msgs);
+  free (ring);
+}
+
+// one recvmmsg: waits for a datagram, then takes what else is there up to
+// the batch.  Returns how many were handled, -1 with errno
+static int ringReceive (int iFd, struct udpRing *ring, udpHandler fnHandler, void *vUser)
+{
+  int iCount;
+  int i;
+
+  // the kernel writes these back, the rest stays as ringCreate left it
+  for (i = 0 ; i < ring->iBatch ; i++)
+  {
+    ring->msgs[i].msg_hdr.msg_namelen = sizeof (ring->addrs[i]);
+    ring->msgs[i].msg_hdr.msg_flags = 0;
+  }
+
+  iCount = recvmmsg (iFd, ring->msgs, ring->iBatch, MSG_WAITFORONE, NULL);
+  for (i = 0 ; i < iCount ; i++)
+  {
+    // a socket that's been shut down reads as an empty datagram from nowhere
+    if (ring->msgs[i].msg_hdr.msg_namelen == 0)
+    {
+      continue;
+    }
+    if (ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+    {
+      ring->ullTruncated++;
+    }
+    fnHandler ((const struct sockaddr *) &ring->addrs[i], ring->msgs[i].msg_hdr.msg_namelen,
+               ring->iovs[i].iov_base, ring->msgs[i].msg_len, vUser);
+  }
+
+  return iCount;
+}
+
+struct udpStats
+{
+  unsigned long long ullPackets;
+  unsigned long long ullBytes;
+};
+
+static void countPacket (const struct sockaddr *addr, socklen_t addrLen, const char *data, unsigned int uiLength, void *vUser)
+{
+  struct udpStats *stats = vUser;
+
+  (void)addr;
+  (void)addrLen;
+  (void)data;
+
+  stats->ullPackets++;
+  stats->ullBytes += uiLength;
+}
+
+static int gi_Stop;
+
+static void stopSignal (int iSignal)
+{
+  (void)iSignal;
+  __atomic_store_n (&gi_Stop, 1, __ATOMIC_RELEASE);
+}
+
+// what the high rate mode prints is once a second, and the total when
+// SIGINT or SIGTERM stops it (the handler is set without SA_RESTART, so a
+// blocked recvmmsg comes back with EINTR)
+static int receiveBatches (int iFd, int iBatch)
+{
+  struct udpRing *ring;
+  struct udpStats stats = {0, 0};
+  struct sigaction action;
+  unsigned long long ullBatches = 0;
+  unsigned long long ullTotal = 0;
+  unsigned long long ullBytes = 0;
+  unsigned long long ullCalls = 0;
+  time_t tLast = time (NULL);
+  time_t tNow;
+  int iRet;
+
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = stopSignal;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+
+  printf ("Receiving in batches of %d, %d byte slots\n", iBatch, UDP_SLOT_SIZE);
+  ring = ringCreate (iBatch);
+
+  while (!__atomic_load_n (&gi_Stop, __ATOMIC_ACQUIRE))
+  {
+    iRet = ringReceive (iFd, ring, countPacket, &stats);
+    if (iRet < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror ("recvmmsg");
+      break;
+    }
+    ullBatches++;
+
+    tNow = time (NULL);
+    if (tNow != tLast)
+    {
+      printf ("%llu packets/s, %.1f Mbit/s, %.1f packets a call, %llu truncated\n",
+              stats.ullPackets / (tNow - tLast), stats.ullBytes * 8.0 / 1e6 / (tNow - tLast),
+              (double) stats.ullPackets / ullBatches, ring->ullTruncated);
+      fflush (stdout);
+      ullTotal += stats.ullPackets;
+      ullBytes += stats.ullBytes;
+      ullCalls += ullBatches;
+      stats.ullPackets = stats.ullBytes = 0;
+      ullBatches = 0;
+      tLast = tNow;
+    }
+  }
+
+  ullTotal += stats.ullPackets;
+  ullBytes += stats.ullBytes;
+  ullCalls += ullBatches;
+  printf ("\ntotal %llu packets, %llu bytes, %.1f packets a call, %llu truncated\n", ullTotal, ullBytes,
+          ullCalls ? (double) ullTotal / ullCalls : 0.0, ring->ullTruncated);
+  ringDestroy (ring);
+
+  return __atomic_load_n (&gi_Stop, __ATOMIC_ACQUIRE) ? 0 : 1;
+}
+
+// the worker per core mode: a thread each with its own SO_REUSEPORT socket
+// on the port, the kernel spreads the datagrams over them by a hash of the
+// addresses.  Pinned (-c), worker i runs on CPU i (modulo the CPUs).
+// Steered (-s) as well, the socket is picked by the CPU the datagram came in
+// on rather than the hash, so the worker that takes it is on the CPU that has
+// it in cache.  That wants a worker per CPU (-t 0) and the NIC's RX queue
+// interrupts spread over the same CPUs
+struct udpWorker
+{
+  int iIndex;
   int iFd;
+  int iBatch;
+  int bPin;
+  pthread_t thread;
+  unsigned long long ullPackets; // published after each batch
+  unsigned long long ullBytes;
+  unsigned long long ullTruncated;
+  unsigned long long ullBatches;
+} __attribute__ ((aligned (64)));  // a line each, they're written all the time
+
+static int openReusePort (int iPort, int iCpu)
+{
   struct sockaddr_in serveraddr;
+  int iOn = 1;
+  int iFd;
 
   iFd = socket (AF_INET, SOCK_DGRAM, 0);
-  if ( iFd < 0 )
+  if (iFd < 0)
   {
     perror ("socket");
+    exit (1);
+  }
+  if (setsockopt (iFd, SOL_SOCKET, SO_REUSEPORT, &iOn, sizeof (iOn)) < 0)
+  {
+    perror ("SO_REUSEPORT");
+    exit (1);
+  }
+  if (iCpu >= 0 && setsockopt (iFd, SOL_SOCKET, SO_INCOMING_CPU, &iCpu, sizeof (iCpu)) < 0)
+  {
+    perror ("SO_INCOMING_CPU");
+  }
+
+  memset (&serveraddr, 0, sizeof (serveraddr));
+  serveraddr.sin_family = AF_INET;
+  serveraddr.sin_port = htons (iPort);
+  serveraddr.sin_addr.s_addr = htonl (INADDR_ANY);
+  if (bind (iFd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0)
+  {
+    perror ("bind");
+    exit (1);
+  }
+
+  return iFd;
+}
+
+// the group picks socket (CPU % sockets), sockets are in the group in the
+// order they were bound
+static void steerByCpu (int iFd, int iSockets)
+{
+  struct sock_filter code[] =
+  {
+    {BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+    {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int) iSockets},
+    {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog = {sizeof (code) / sizeof (code[0]), code};
+
+  if (setsockopt (iFd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof (prog)) < 0)
+  {
+    perror ("SO_ATTACH_REUSEPORT_CBPF");
+  }
+}
+
+static void *workerRun (void *vWorker)
+{
+  struct udpWorker *worker = vWorker;
+  struct udpStats stats = {0, 0};
+  struct udpRing *ring;
+  int iRet;
+
+  if (worker->bPin)
+  {
+    cpu_set_t cpus;
+    int iCpu = worker->iIndex % (int) sysconf (_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO (&cpus);
+    CPU_SET (iCpu, &cpus);
+    if (pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus) != 0)
+    {
+      fprintf (stderr, "worker %d: can't pin to CPU %d\n", worker->iIndex, iCpu);
+    }
+  }
+
+  ring = ringCreate (worker->iBatch);
+  for ( ;; )
+  {
+    iRet = ringReceive (worker->iFd, ring, countPacket, &stats);
+    if (iRet < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror ("recvmmsg");
+      break;
+    }
+    __atomic_store_n (&worker->ullPackets, stats.ullPackets, __ATOMIC_RELAXED);
+    __atomic_store_n (&worker->ullBytes, stats.ullBytes, __ATOMIC_RELAXED);
+    __atomic_store_n (&worker->ullTruncated, ring->ullTruncated, __ATOMIC_RELAXED);
+    __atomic_store_n (&worker->ullBatches, worker->ullBatches + 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n (&gi_Stop, __ATOMIC_ACQUIRE))
+    {
+      // shut down, see receiveWorkers
+      break;
+    }
+  }
+  ringDestroy (ring);
+
+  return NULL;
+}
+
+// the main thread prints the total once a second, and stops the workers at
+// SIGINT or SIGTERM: shutdown(2) wakes a blocked recvmmsg
+static int receiveWorkers (int iPort, int iBatch, int iThreads, int bPin, int bSteer)
+{
+  struct udpWorker *workers;
+  unsigned long long ullLast = 0;
+  unsigned long long ullTotal;
+  unsigned long long ullBytes = 0;
+  unsigned long long ullTruncated = 0;
+  unsigned long long ullBatches = 0;
+  struct timespec ts = {1, 0};
+  sigset_t signals;
+  int iSignal;
+  int i;
+
+  if (iThreads <= 0)
+  {
+    iThreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  }
+  if (iBatch <= 0)
+  {
+    iBatch = 64;
+  }
+  printf ("%d workers, batches of %d%s%s\n", iThreads, iBatch, bPin ? ", pinned" : "", bSteer ? ", steered by CPU" : "");
+
+  // the workers don't get the signals, the main thread waits for them
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGINT);
+  sigaddset (&signals, SIGTERM);
+  pthread_sigmask (SIG_BLOCK, &signals, NULL);
+
+  workers = aligned_alloc (64, sizeof (*workers) * iThreads);
+  if (workers == NULL)
+  {
+    perror ("aligned_alloc");
     return 1;
   }
+  memset (workers, 0, sizeof (*workers) * iThreads);
+
+  // bound one after the other, so socket i is i in the group
+  for (i = 0 ; i < iThreads ; i++)
+  {
+    workers[i].iIndex = i;
+    workers[i].iBatch = iBatch;
+    workers[i].bPin = bPin;
+    workers[i].iFd = openReusePort (iPort, bSteer ? i : -1);
+  }
+  if (bSteer)
+  {
+    steerByCpu (workers[0].iFd, iThreads);
+  }
+  for (i = 0 ; i < iThreads ; i++)
+  {
+    if (pthread_create (&workers[i].thread, NULL, workerRun, &workers[i]) != 0)
+    {
+      perror ("pthread_create");
+      return 1;
+    }
+  }
+
+  for ( ;; )
+  {
+    iSignal = sigtimedwait (&signals, NULL, &ts);
+    if (iSignal == SIGINT || iSignal == SIGTERM)
+    {
+      break;
+    }
+    ullTotal = 0;
+    for (i = 0 ; i < iThreads ; i++)
+    {
+      ullTotal += __atomic_load_n (&workers[i].ullPackets, __ATOMIC_RELAXED);
+    }
+    printf ("%llu packets/s\n", ullTotal - ullLast);
+    fflush (stdout);
+    ullLast = ullTotal;
+  }
 
-  if (argc >= 2)
+  __atomic_store_n (&gi_Stop, 1, __ATOMIC_RELEASE);
+  for (i = 0 ; i < iThreads ; i++)
+  {
+    shutdown (workers[i].iFd, SHUT_RD);
+  }
+  ullTotal = 0;
+  printf ("\nworker     packets        bytes  per call  truncated\n");
+  for (i = 0 ; i < iThreads ; i++)
   {
-    iPort = atoi (argv[1]);
+    pthread_join (workers[i].thread, NULL);
+    close (workers[i].iFd);
+    printf ("%6d %11llu %12llu %9.1f %10llu\n", i, workers[i].ullPackets, workers[i].ullBytes,
+            workers[i].ullBatches ? (double) workers[i].ullPackets / workers[i].ullBatches : 0.0,
+            workers[i].ullTruncated);
+    ullTotal += workers[i].ullPackets;
+    ullBytes += workers[i].ullBytes;
+    ullTruncated += workers[i].ullTruncated;
+    ullBatches += workers[i].ullBatches;
+  }
+  printf (" total %11llu %12llu %9.1f %10llu\n", ullTotal, ullBytes,
+          ullBatches ? (double) ullTotal / ullBatches : 0.0, ullTruncated);
+  free (workers);
+
+  return 0;
+}
+
+// udp_server [-t threads] [-c] [-s] [port [batch]]
+//   with a batch it's the high rate mode, -t is a worker per core (or as many
+//   as it says) with -c to pin them and -s to steer by CPU
+int main (int argc, char **argv)
+{
+  int iPort = 4000;
+  int iBatch = 0;
+  int iThreads = -1;
+  int bPin = 0;
+  int bSteer = 0;
+  int iOpt;
+  int iFd;
+  struct sockaddr_in serveraddr;
+
+  while ((iOpt = getopt (argc, argv, "t:cs")) != -1)
+  {
+    switch (iOpt)
+    {
+    case 't':
+      iThreads = atoi (optarg);
+      break;
+    case 'c':
+      bPin = 1;
+      break;
+    case 's':
+      bSteer = 1;
+      break;
+    default:
+      fprintf (stderr, "usage: %s [-t threads] [-c] [-s] [port [batch]]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc)
+  {
+    iPort = atoi (argv[optind++]);
+  }
+  if (optind < argc)
+  {
+    iBatch = atoi (argv[optind++]);
   }
   printf ("Server running on port %d\n", iPort);
+
+  if (iThreads >= 0)
+  {
+    return receiveWorkers (iPort, iBatch, iThreads, bPin, bSteer);
+  }
+
+  iFd = socket (AF_INET, SOCK_DGRAM, 0);
+  if ( iFd < 0 )
+  {
+    perror ("socket");
+    return 1;
+  }
   
   memset (&serveraddr, 0, sizeof (serveraddr));
   serveraddr.sin_family = AF_INET;
@@ -38,6 +489,11 @@ int main (int argc, char **argv)
     return 1;
   }
 
+  if (iBatch > 0)
+  {
+    return receiveBatches (iFd, iBatch);
+  }
+
   for ( ;; )
   {
     char buffer[200];